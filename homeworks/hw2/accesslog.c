@@ -0,0 +1,177 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "accesslog.h"
+#include "threadslots.h"
+
+#define ACCESS_LOG_BATCH 256     // Records per writev(), three iovecs each.
+
+static thread_slot_t ring_slots[ACCESS_LOG_MAX_RINGS];
+static thread_slots_t rings = THREAD_SLOTS_INITIALIZER(ring_slots, sizeof(access_log_ring_t));
+static int log_fd = -1;
+static int log_enabled;
+
+static __thread access_log_ring_t *thread_ring;
+
+static void *access_log_routine(void *arg);
+
+static long long clock_us(clockid_t clock) {
+  struct timespec ts;
+  clock_gettime(clock, &ts);
+  return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+int access_log_init(int fd, int enabled) {
+  pthread_t thread;
+
+  log_fd = fd;
+  log_enabled = enabled;
+
+  if (pthread_create(&thread, NULL, access_log_routine, NULL) != 0) {
+    perror("Error create access log thread");
+    return -1;
+  }
+  pthread_detach(thread);
+  return 0;
+}
+
+void access_log_toggle(void) {
+  __atomic_xor_fetch(&log_enabled, 1, __ATOMIC_RELAXED);
+}
+
+long long access_log_start(void) {
+  if (log_fd < 0 || !__atomic_load_n(&log_enabled, __ATOMIC_RELAXED)) {
+    return 0;
+  }
+  return clock_us(CLOCK_MONOTONIC);
+}
+
+/* The calling thread's ring, an exited thread's one if there is one */
+static access_log_ring_t *access_log_ring(void) {
+  if (thread_ring == NULL) {
+    thread_ring = thread_slots_claim(&rings);
+  }
+  return thread_ring;
+}
+
+void access_log_request(struct http_request *request, int status, size_t bytes,
+    long long start) {
+  if (start == 0) {
+    return;
+  }
+  long long latency = clock_us(CLOCK_MONOTONIC) - start;
+
+  access_log_ring_t *ring = access_log_ring();
+  if (ring == NULL) {
+    return;
+  }
+
+  unsigned long head = ring->head;
+  if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == ACCESS_LOG_RING_SIZE) {
+    __atomic_add_fetch(&ring->dropped, 1, __ATOMIC_RELAXED);
+    return;
+  }
+
+  access_log_record_t *record = &ring->records[head & (ACCESS_LOG_RING_SIZE - 1)];
+  record->time_us = clock_us(CLOCK_REALTIME);
+  record->latency_us = latency;
+  record->bytes = bytes;
+  record->status = status;
+  record->method_size = request->method_size < ACCESS_LOG_METHOD_MAX
+      ? request->method_size : ACCESS_LOG_METHOD_MAX;
+  record->path_size = request->path_size < ACCESS_LOG_PATH_MAX
+      ? request->path_size : ACCESS_LOG_PATH_MAX;
+  memcpy(record->method, request->method, record->method_size);
+  memcpy(record->path, request->path, record->path_size);
+  __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+/* Writes every iovec, a full disk or closed pipe just loses the batch */
+static void access_log_writev(struct iovec *iov, int count) {
+  while (count > 0) {
+    ssize_t written = writev(log_fd, iov, count);
+    if (written < 0 && errno == EINTR)
+      continue;
+    if (written < 0)
+      return;
+
+    while (count > 0 && (size_t) written >= iov->iov_len) {
+      written -= iov->iov_len;
+      iov++;
+      count--;
+    }
+    if (count > 0) {
+      iov->iov_base = (char *) iov->iov_base + written;
+      iov->iov_len -= written;
+    }
+  }
+}
+
+/* Write out up to ACCESS_LOG_BATCH records of RING, the path goes
+ * straight from the ring. Returns how many were written. */
+static int access_log_drain(access_log_ring_t *ring) {
+  static struct iovec iov[ACCESS_LOG_BATCH * 3];
+  static char prefix[ACCESS_LOG_BATCH][64];
+  static char suffix[ACCESS_LOG_BATCH][80];
+
+  unsigned long tail = ring->tail;
+  unsigned long head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+  int count = 0;
+
+  for (; tail + count != head && count < ACCESS_LOG_BATCH; count++) {
+    access_log_record_t *record = &ring->records[(tail + count) & (ACCESS_LOG_RING_SIZE - 1)];
+    iov[count * 3].iov_base = prefix[count];
+    iov[count * 3].iov_len = snprintf(prefix[count], sizeof(prefix[count]),
+        "ts=%lld.%06lld method=%.*s path=", record->time_us / 1000000,
+        record->time_us % 1000000, record->method_size, record->method);
+    iov[count * 3 + 1].iov_base = record->path;
+    iov[count * 3 + 1].iov_len = record->path_size;
+    iov[count * 3 + 2].iov_base = suffix[count];
+    iov[count * 3 + 2].iov_len = snprintf(suffix[count], sizeof(suffix[count]),
+        " status=%d bytes=%zu us=%lld\n", record->status, record->bytes,
+        record->latency_us);
+  }
+
+  if (count > 0) {
+    access_log_writev(iov, count * 3);
+    /* Only now may the owner reuse the slots */
+    __atomic_store_n(&ring->tail, tail + count, __ATOMIC_RELEASE);
+  }
+  return count;
+}
+
+static void *access_log_routine(void *arg) {
+  struct timespec pause = { 0, ACCESS_LOG_FLUSH_MS * 1000000 };
+  char line[64];
+
+  for (;;) {
+    int drained = 0;
+    int count = thread_slots_count(&rings);
+    for (int i = 0; i < count; i++) {
+      access_log_ring_t *ring = thread_slots_get(&rings, i);
+      if (ring == NULL) {
+        continue;
+      }
+      drained += access_log_drain(ring);
+
+      unsigned long dropped = __atomic_exchange_n(&ring->dropped, 0, __ATOMIC_RELAXED);
+      if (dropped > 0) {
+        struct iovec iov = { line, snprintf(line, sizeof(line), "dropped=%lu\n", dropped) };
+        access_log_writev(&iov, 1);
+      }
+    }
+
+    /* Sleep only once everything is out, a busy log is drained back to back */
+    if (drained == 0) {
+      nanosleep(&pause, NULL);
+    }
+  }
+
+  return NULL;
+}
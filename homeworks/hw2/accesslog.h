@@ -0,0 +1,59 @@
+#ifndef __ACCESSLOG__
+#define __ACCESSLOG__
+
+#include <stddef.h>
+
+#include "libhttp.h"
+
+/* ACCESSLOG writes one line per request without holding up the thread that
+ * served it. Every thread logs into a ring of its own, a single-producer
+ * single-consumer queue needing no lock, and a background thread drains
+ * all of them in batches with writev(). A full ring drops the record
+ * instead of blocking; drops are counted and reported in the log.
+ *
+ * Lines look like
+ *   ts=1700000000.123456 method=GET path=/index.html status=200 bytes=512 us=42
+ * where US is the time from the parsed request to the response handed to
+ * the socket (or the event loop's buffer). */
+
+#define ACCESS_LOG_RING_SIZE 1024      // Records per thread, a power of two.
+#define ACCESS_LOG_MAX_RINGS 256
+#define ACCESS_LOG_PATH_MAX 256        // Longer paths are cut.
+#define ACCESS_LOG_METHOD_MAX 16
+#define ACCESS_LOG_FLUSH_MS 50
+
+typedef struct access_log_record {
+  long long time_us;                   // Wall clock.
+  long long latency_us;
+  size_t bytes;
+  int status;
+  unsigned char method_size;
+  unsigned short path_size;
+  char method[ACCESS_LOG_METHOD_MAX];
+  char path[ACCESS_LOG_PATH_MAX];
+} access_log_record_t;
+
+typedef struct access_log_ring {
+  unsigned long head;                  // Written by the owner thread.
+  unsigned long tail;                  // Written by the drain thread.
+  unsigned long dropped;
+  access_log_record_t records[ACCESS_LOG_RING_SIZE];
+} access_log_ring_t;
+
+/* Starts logging to FD, enabled or not. Returns -1 if the drain thread
+ * can't be started. */
+int access_log_init(int fd, int enabled);
+
+/* Turns logging on or off, safe to call from a signal handler. */
+void access_log_toggle(void);
+
+/* Microseconds on the monotonic clock, 0 while logging is off, so the
+ * clock isn't even read for requests that won't be logged. */
+long long access_log_start(void);
+
+/* Logs REQUEST, answered with STATUS and BYTES, begun at START (from
+ * access_log_start()). Does nothing if START is 0. */
+void access_log_request(struct http_request *request, int status, size_t bytes,
+    long long start);
+
+#endif
@@ -0,0 +1,152 @@
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <linux/mempolicy.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "affinity.h"
+#include "metrics.h"
+
+static int cpus[AFFINITY_MAX_CPUS];
+static int cpu_count;
+static __thread int current_cpu = -1;
+
+/* CPU to NUMA node, read once from sysfs */
+static int nodes[AFFINITY_MAX_CPUS];
+static pthread_once_t nodes_once = PTHREAD_ONCE_INIT;
+
+/* Calls ADD(CPU, ARG) for every CPU of LIST. Returns -1 if it's malformed. */
+static int affinity_parse(char *list, void (*add)(int, void *), void *arg) {
+  char *p = list;
+  while (*p != '\0' && *p != '\n') {
+    char *end;
+    long first = strtol(p, &end, 10);
+    long last = first;
+    if (end == p || first < 0) return -1;
+    p = end;
+    if (*p == '-') {
+      last = strtol(p + 1, &end, 10);
+      if (end == p + 1 || last < first) return -1;
+      p = end;
+    }
+    if (last >= AFFINITY_MAX_CPUS) return -1;
+    for (long cpu = first; cpu <= last; cpu++) {
+      add(cpu, arg);
+    }
+    if (*p == ',') p++;
+    else if (*p != '\0' && *p != '\n') return -1;
+  }
+  return 0;
+}
+
+static void affinity_add_node_cpu(int cpu, void *node) {
+  nodes[cpu] = *(int *) node;
+}
+
+static void affinity_read_nodes(void) {
+  DIR *dir = opendir("/sys/devices/system/node");
+  if (dir == NULL) {
+    return;
+  }
+  struct dirent *de;
+  while ((de = readdir(dir)) != NULL) {
+    int node;
+    char path[300];
+    char list[4096];
+    if (sscanf(de->d_name, "node%d", &node) != 1) continue;
+    snprintf(path, sizeof(path), "/sys/devices/system/node/%s/cpulist", de->d_name);
+    FILE *file = fopen(path, "r");
+    if (file == NULL) continue;
+    if (fgets(list, sizeof(list), file) != NULL) {
+      affinity_parse(list, affinity_add_node_cpu, &node);
+    }
+    fclose(file);
+  }
+  closedir(dir);
+}
+
+/* Keeps CPUs the process may run on, in the order given */
+static void affinity_add_cpu(int cpu, void *allowed) {
+  if (cpu_count < AFFINITY_MAX_CPUS && CPU_ISSET(cpu, (cpu_set_t *) allowed)) {
+    cpus[cpu_count++] = cpu;
+  }
+}
+
+int affinity_init(char *list) {
+  cpu_set_t allowed;
+  if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0) {
+    perror("Can't get CPU affinity");
+    return -1;
+  }
+  cpu_count = 0;
+  if (affinity_parse(list, affinity_add_cpu, &allowed) < 0 || cpu_count == 0) {
+    cpu_count = 0;
+    return -1;
+  }
+  return 0;
+}
+
+int affinity_enabled(void) {
+  return cpu_count > 0;
+}
+
+int affinity_cpu(int index) {
+  if (cpu_count > 0) {
+    return cpus[index % cpu_count];
+  }
+  long num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  return index % (num_cpus > 0 ? num_cpus : 1);
+}
+
+int affinity_pin(int cpu) {
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  int status = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+  if (status != 0) {
+    fprintf(stderr, "Can't pin thread to CPU %d: %s\n", cpu, strerror(status));
+    return -1;
+  }
+  current_cpu = cpu;
+
+  /* First touch places pages anyway, unless the process was started with
+   * another policy, e.g. interleaved by numactl */
+  syscall(SYS_set_mempolicy, MPOL_LOCAL, NULL, 0);
+  return 0;
+}
+
+int affinity_current(void) {
+  return current_cpu;
+}
+
+int affinity_node(int cpu) {
+  pthread_once(&nodes_once, affinity_read_nodes);
+  return cpu >= 0 && cpu < AFFINITY_MAX_CPUS ? nodes[cpu] : 0;
+}
+
+int affinity_incoming_cpu(int fd) {
+  int cpu;
+  socklen_t size = sizeof(cpu);
+  if (getsockopt(fd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &size) < 0) {
+    return -1;
+  }
+  return cpu;
+}
+
+void affinity_account(int fd) {
+  int incoming = affinity_incoming_cpu(fd);
+  int cpu = sched_getcpu();
+  if (incoming < 0 || cpu < 0 || incoming == cpu) {
+    return;
+  }
+  metrics_count(METRIC_REMOTE_CPU, 1);
+  if (affinity_node(incoming) != affinity_node(cpu)) {
+    metrics_count(METRIC_REMOTE_NODE, 1);
+  }
+}
@@ -0,0 +1,41 @@
+#ifndef __AFFINITY__
+#define __AFFINITY__
+
+/* AFFINITY keeps threads on the CPUs given with --cpus, and what they
+ * allocate on the NUMA node of their CPU. Pinned threads of each kind (pool
+ * workers, acceptors, loops) take the CPUs of the list in turn; threads
+ * started by a pinned thread inherit its CPU, so a shard stays on one. It
+ * also tells which CPU a connection's packets are processed on, and counts
+ * the connections served away from it. */
+
+#define AFFINITY_MAX_CPUS 1024
+
+/* Takes the CPU list LIST, like "0-3,8,10-11". Returns -1 if it's malformed
+ * or names no online CPU. */
+int affinity_init(char *list);
+
+/* Whether a CPU list was given */
+int affinity_enabled(void);
+
+/* The INDEX-th CPU of the list, wrapping around; without a list, INDEX
+ * modulo the online CPUs */
+int affinity_cpu(int index);
+
+/* Pins the calling thread to CPU, and has its memory allocated on the NUMA
+ * node of the CPU from then on */
+int affinity_pin(int cpu);
+
+/* The CPU the calling thread was pinned to, -1 if it wasn't */
+int affinity_current(void);
+
+/* The NUMA node of CPU, 0 if unknown */
+int affinity_node(int cpu);
+
+/* The CPU that processed the last packets of socket FD, -1 if unknown */
+int affinity_incoming_cpu(int fd);
+
+/* Counts connection FD in the metrics if served on another CPU or node
+ * than its packets arrive on */
+void affinity_account(int fd);
+
+#endif
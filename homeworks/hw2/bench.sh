@@ -0,0 +1,76 @@
+#!/bin/bash
+# Load scenarios for httpserver, run with bench_load against servers started
+# here on a scratch tree: small files, a large file, a text file with and
+# without gzip, directory listings and a mix of them, in the thread pool,
+# event loop and io_uring modes, the same tree packed with mkpack, then the
+# proxy in front of a local stub upstream. Open loop rows run at a fixed rate and report latency from when
+# each request was due.
+#
+# Usage: ./bench.sh [seconds per scenario] [connections]
+DURATION=${1:-3}
+CONNECTIONS=${2:-32}
+RATE=2000
+PORT=8140
+ROOT=$(mktemp -d)
+trap 'pkill -f "httpserver --files $ROOT"; pkill -f "httpserver --pack $ROOT.pack"; pkill -f "httpserver --proxy .* --port $PORT"; rm -rf "$ROOT" "$ROOT.pack"' EXIT
+
+head -c 1024 /dev/urandom > "$ROOT/small.bin"
+head -c $((8 << 20)) /dev/urandom > "$ROOT/large.bin"
+seq 1 10000 > "$ROOT/text.txt"
+mkdir "$ROOT/dir"
+(cd "$ROOT/dir" && seq -f "entry_%05g.txt" 1 2000 | xargs touch)
+
+scenario() {
+  local name=$1
+  shift
+  printf "%-30s %s\n" "$name" "$(./bench_load -s -d "$DURATION" "$@" "localhost:$PORT")"
+}
+
+files() {
+  scenario "small keep-alive" -c "$CONNECTIONS" -m /small.bin
+  scenario "small close" -c "$CONNECTIONS" -k 0 -m /small.bin
+  scenario "small open loop $RATE/s" -c "$CONNECTIONS" -r $RATE -m /small.bin
+  scenario "large" -c 4 -m /large.bin
+  scenario "large 64k ranges" -c 4 -m /large.bin -H "Range: bytes=0-65535"
+  scenario "large revalidated" -c 4 -m /large.bin \
+    -H "If-Modified-Since: Fri, 01 Jan 2100 00:00:00 GMT"
+  scenario "text" -c "$CONNECTIONS" -m /text.txt
+  scenario "text gzip" -c "$CONNECTIONS" -m /text.txt -H "Accept-Encoding: gzip"
+  scenario "listing" -c 8 -m /dir/
+  scenario "mix" -c "$CONNECTIONS" -m /small.bin:16,/large.bin:1,/dir/:2,/missing:1
+  scenario "mix open loop $RATE/s" -c "$CONNECTIONS" -r $RATE \
+    -m /small.bin:16,/large.bin:1,/dir/:2,/missing:1
+}
+
+header() {
+  printf "\n%s\n%-30s %10s %8s %8s %8s %8s %6s\n" "$1" "scenario" "req/s" "p50 ms" \
+    "p99 ms" "p99.9 ms" "max ms" "errors"
+}
+
+for mode in "--num-threads 8" "--event-loop" "--io-uring"; do
+  ./httpserver --files "$ROOT" --port $PORT $mode >/dev/null 2>&1 &
+  sleep 0.5
+  header "httpserver --files $mode"
+  files
+  pkill -f "httpserver --files $ROOT"
+  sleep 0.3
+done
+
+./mkpack "$ROOT" "$ROOT.pack" >/dev/null
+for mode in "--num-threads 8" "--event-loop" "--io-uring"; do
+  ./httpserver --pack "$ROOT.pack" --port $PORT $mode >/dev/null 2>&1 &
+  sleep 0.5
+  header "httpserver --pack $mode"
+  files
+  pkill -f "httpserver --pack $ROOT.pack"
+  sleep 0.3
+done
+
+./httpserver --files "$ROOT" --port $((PORT + 1)) --event-loop >/dev/null 2>&1 &
+./httpserver --proxy "localhost:$((PORT + 1))" --port $PORT --num-threads 2 >/dev/null 2>&1 &
+sleep 0.5
+header "httpserver --proxy to a local --event-loop stub"
+scenario "small keep-alive" -c "$CONNECTIONS" -m /small.bin
+scenario "small close" -c "$CONNECTIONS" -k 0 -m /small.bin
+scenario "small open loop $RATE/s" -c "$CONNECTIONS" -r $RATE -m /small.bin
+scenario "large" -c 4 -m /large.bin
@@ -0,0 +1,62 @@
+#!/bin/bash
+# Affinity scenarios for httpserver: the same load against a server kept on
+# SERVER_CPUS, first with its threads free to move, then pinned with --cpus
+# and with connections steered to the CPU their packets are processed on.
+# The load generator stays on LOAD_CPUS. Every request comes on a new
+# connection, so each one is placed anew, and the server's own counters tell
+# how many were served on another CPU, and on another NUMA node, than their
+# packets. On a two socket machine, give the server both sockets and the
+# load one of them to see the cross-socket share before and after.
+#
+# Usage: ./bench_affinity.sh [server cpus] [load cpus] [seconds] [connections]
+SERVER_CPUS=${1:-0-$(($(getconf _NPROCESSORS_ONLN) - 1))}
+LOAD_CPUS=${2:-$SERVER_CPUS}
+DURATION=${3:-3}
+CONNECTIONS=${4:-32}
+PORT=8150
+ROOT=$(mktemp -d)
+trap 'pkill -f "httpserver --files $ROOT"; rm -rf "$ROOT"' EXIT
+
+head -c 1024 /dev/urandom > "$ROOT/small.bin"
+
+# CPUs in a list like 0-3,8
+THREADS=0
+for range in ${SERVER_CPUS//,/ }; do
+  THREADS=$((THREADS + ${range#*-} - ${range%-*} + 1))
+done
+
+metric() {
+  exec 3<>"/dev/tcp/127.0.0.1/$PORT"
+  printf "GET /metrics HTTP/1.0\r\n\r\n" >&3
+  awk -v name="$1" '$1 == name { print $2 }' <&3
+  exec 3<&-
+}
+
+scenario() {
+  local name=$1
+  shift
+  taskset -c "$SERVER_CPUS" ./httpserver --files "$ROOT" --port $PORT --metrics "$@" \
+    >/dev/null 2>&1 &
+  sleep 0.5
+  local result=($(taskset -c "$LOAD_CPUS" ./bench_load -s -d "$DURATION" -c "$CONNECTIONS" \
+    -k 0 -m /small.bin "localhost:$PORT"))
+  local requests=$(metric httpserver_requests_total)
+  local remote_cpu=$(metric httpserver_remote_cpu_connections_total)
+  local remote_node=$(metric httpserver_remote_node_connections_total)
+  printf "%-36s %10s %8s %12s %13s\n" "$name" "${result[0]}" "${result[2]}" \
+    "$(awk -v n="$remote_cpu" -v d="$requests" 'BEGIN { printf "%.1f%%", 100 * n / d }')" \
+    "$(awk -v n="$remote_node" -v d="$requests" 'BEGIN { printf "%.1f%%", 100 * n / d }')"
+  pkill -f "httpserver --files $ROOT"
+  sleep 0.3
+}
+
+printf "server on CPUs %s, load on CPUs %s\n%-36s %10s %8s %12s %13s\n" "$SERVER_CPUS" \
+  "$LOAD_CPUS" "scenario" "req/s" "p99 ms" "remote CPU" "remote node"
+scenario "threads, unpinned" --num-threads "$THREADS" --work-stealing rr
+scenario "threads, pinned, by incoming CPU" --num-threads "$THREADS" --work-stealing cpu \
+  --cpus "$SERVER_CPUS"
+scenario "listeners, pinned and steered" --listeners "$THREADS" --num-threads 1 \
+  --cpus "$SERVER_CPUS"
+scenario "event loops, unpinned" --event-loop
+scenario "event loops, pinned and steered" --event-loop --listeners "$THREADS" \
+  --cpus "$SERVER_CPUS"
@@ -0,0 +1,41 @@
+#!/bin/bash
+# Times directory listings of a 50k-entry directory, cold (rendered and
+# streamed in chunks) and warm (from the response cache), in both serving
+# modes and with the response cache turned off.
+#
+# Usage: ./bench_listing.sh [entries] [requests]
+ENTRIES=${1:-50000}
+REQUESTS=${2:-20}
+PORT=8123
+ROOT=$(mktemp -d)
+trap 'pkill -f "httpserver --files $ROOT"; rm -rf "$ROOT"' EXIT
+
+mkdir "$ROOT/big"
+(cd "$ROOT/big" && seq -f "file_with_a_fairly_long_name_%06g.txt" 1 "$ENTRIES" | xargs touch)
+
+url="http://localhost:$PORT/big"
+
+run() {
+  ./httpserver --files "$ROOT" --port $PORT --num-threads 4 "$@" >/dev/null 2>&1 &
+  sleep 0.5
+
+  cold=$(curl -s -o /dev/null -w "%{time_total}" "$url")
+  warm=0
+  for i in $(seq 1 "$REQUESTS"); do
+    t=$(curl -s -o /dev/null -w "%{time_total}" "$url")
+    warm=$(awk "BEGIN { print $warm + $t }")
+  done
+  size=$(curl -s "$url" | wc -c)
+  printf "%-28s %10d %10.4f %10.4f\n" "$*" "$size" "$cold" \
+    "$(awk "BEGIN { print $warm / $REQUESTS }")"
+
+  pkill -f "httpserver --files $ROOT"
+  sleep 0.3
+}
+
+printf "%-28s %10s %10s %10s\n" "mode" "bytes" "cold (s)" "warm (s)"
+# The 50k-entry listing is ~5MB, give each cache shard room for it
+run --cache-size 256
+run --event-loop --cache-size 256
+run --cache-size 0
+run --event-loop --cache-size 0
@@ -0,0 +1,646 @@
+/*
+ * Load generator for httpserver.
+ *
+ * Usage: ./bench_load [-t threads] [-c connections] [-d seconds] [-r rate]
+ *                     [-k 0|1] [-m path[:weight],...] [-H header] [-s] host:port
+ *
+ * Every thread drives its share of the connections from an epoll loop.
+ * Without -r the loop is closed: a connection sends its next request as soon
+ * as the previous response is in. With -r it is open: RATE requests per
+ * second are due, spread evenly over the connections, whether or not the
+ * server keeps up. A request that has to wait for its connection is timed
+ * from when it was due rather than from when it went out; timing only the
+ * send hides the queueing a stalled server causes (coordinated omission).
+ * Both are reported, the gap is the queueing.
+ *
+ * -k 0 sends every request on a new connection, -m picks paths at random
+ * with the given weights (default /), -H adds a header line to every
+ * request (Range, If-None-Match...), -s prints a single line for scripts:
+ *   requests/s p50 p99 p99.9 max (ms) errors
+ * where errors are failed connections and 5xx responses.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <limits.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#include <unistd.h>
+
+#define LOAD_MAX_THREADS 64
+#define LOAD_MAX_PATHS 32
+#define LOAD_MAX_EVENTS 256
+#define LOAD_READ_SIZE 65536
+#define LOAD_HEADER_SIZE 8192
+#define LOAD_RETRY_US 10000     // Closed loop pause after a failed request.
+#define LOAD_SUB_BUCKETS 16
+#define LOAD_BUCKETS (LOAD_SUB_BUCKETS + 32 * LOAD_SUB_BUCKETS)
+
+/* Log-linear like the server's metrics: exact below 16 us, then within 6% */
+typedef struct histogram {
+  unsigned long buckets[LOAD_BUCKETS];
+  unsigned long count;
+  long long max;
+  double sum;
+} histogram_t;
+
+typedef enum {
+  PARSE_HEADERS,
+  PARSE_BODY,           // Content-Length bytes.
+  PARSE_CHUNK_SIZE,
+  PARSE_CHUNK_DATA,     // The chunk and its CRLF.
+  PARSE_CHUNK_END,      // Trailers up to the blank line.
+  PARSE_UNTIL_EOF,
+} parse_state_t;
+
+typedef struct load_conn {
+  int fd;
+  int busy;                   // A request is out.
+  int path;
+  size_t sent;
+  long long due;              // us, when the next request should go out.
+  long long intended;         // us, when the current one was due.
+  long long started;          // us, when it went out.
+  parse_state_t state;
+  char header[LOAD_HEADER_SIZE];
+  size_t header_size;
+  unsigned long long remaining;
+  char line[32];
+  int line_size;
+  int status;
+  int close_after;            // The server closes the connection after this.
+} load_conn_t;
+
+typedef struct load_thread {
+  pthread_t thread;
+  int epoll_fd;
+  int timer_fd;               // Wakes the open loop when a request is due.
+  load_conn_t *conns;
+  int conn_count;
+  unsigned int seed;
+  histogram_t latency;        // From when the request was due.
+  histogram_t service;        // From when it was sent.
+  unsigned long statuses[6];  // By class, [0] counts transport errors.
+  unsigned long long bytes;
+  char buffer[LOAD_READ_SIZE];
+} load_thread_t;
+
+static struct sockaddr_storage address;
+static socklen_t address_size;
+static char *requests[LOAD_MAX_PATHS];
+static size_t request_sizes[LOAD_MAX_PATHS];
+static int weights[LOAD_MAX_PATHS];     // Cumulative.
+static int path_count;
+static int keep_alive = 1;
+static char extra_headers[LOAD_HEADER_SIZE];
+static double rate;
+static long long interval;              // us between requests on a connection.
+static long long start_us;
+static long long end_us;
+
+static long long load_now_us(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+static int histogram_bucket(unsigned long long us) {
+  if (us < LOAD_SUB_BUCKETS) {
+    return us;
+  }
+  int exponent = 63 - __builtin_clzll(us);
+  if (exponent > 35) {
+    return LOAD_BUCKETS - 1;
+  }
+  return LOAD_SUB_BUCKETS + (exponent - 4) * LOAD_SUB_BUCKETS
+      + ((us >> (exponent - 4)) & (LOAD_SUB_BUCKETS - 1));
+}
+
+/* The highest value bucket I holds */
+static long long histogram_value(int i) {
+  if (i < LOAD_SUB_BUCKETS) {
+    return i;
+  }
+  int exponent = (i - LOAD_SUB_BUCKETS) / LOAD_SUB_BUCKETS + 4;
+  int sub_bucket = (i - LOAD_SUB_BUCKETS) % LOAD_SUB_BUCKETS;
+  return ((long long) (LOAD_SUB_BUCKETS + sub_bucket + 1) << (exponent - 4)) - 1;
+}
+
+static void histogram_record(histogram_t *h, long long us) {
+  if (us < 0) {
+    us = 0;
+  }
+  h->buckets[histogram_bucket(us)]++;
+  h->count++;
+  h->sum += us;
+  if (us > h->max) {
+    h->max = us;
+  }
+}
+
+static void histogram_merge(histogram_t *into, histogram_t *from) {
+  for (int i = 0; i < LOAD_BUCKETS; i++) {
+    into->buckets[i] += from->buckets[i];
+  }
+  into->count += from->count;
+  into->sum += from->sum;
+  if (from->max > into->max) {
+    into->max = from->max;
+  }
+}
+
+/* In milliseconds */
+static double histogram_percentile(histogram_t *h, double percentile) {
+  unsigned long rank = (unsigned long) (percentile / 100 * h->count + 0.999999);
+  unsigned long seen = 0;
+  for (int i = 0; i < LOAD_BUCKETS && h->count > 0; i++) {
+    seen += h->buckets[i];
+    if (seen >= rank) {
+      long long value = histogram_value(i);
+      return (value < h->max ? value : h->max) / 1000.0;
+    }
+  }
+  return 0;
+}
+
+static void load_close(load_conn_t *conn) {
+  if (conn->fd >= 0) {
+    close(conn->fd);
+    conn->fd = -1;
+  }
+}
+
+static int load_connect(load_thread_t *thread, load_conn_t *conn) {
+  int fd = socket(address.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    return -1;
+  }
+  int one = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  if (connect(fd, (struct sockaddr *) &address, address_size) < 0 && errno != EINPROGRESS) {
+    close(fd);
+    return -1;
+  }
+
+  struct epoll_event event;
+  event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+  event.data.ptr = conn;
+  if (epoll_ctl(thread->epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0) {
+    close(fd);
+    return -1;
+  }
+  conn->fd = fd;
+  return 0;
+}
+
+static void load_fail(load_thread_t *thread, load_conn_t *conn, long long now) {
+  thread->statuses[0]++;
+  conn->busy = 0;
+  load_close(conn);
+  if (rate == 0) {
+    conn->due = now + LOAD_RETRY_US;
+  }
+}
+
+static void load_complete(load_thread_t *thread, load_conn_t *conn) {
+  long long now = load_now_us();
+  histogram_record(&thread->latency, now - conn->intended);
+  histogram_record(&thread->service, now - conn->started);
+  thread->statuses[conn->status >= 100 && conn->status < 600 ? conn->status / 100 : 0]++;
+
+  conn->busy = 0;
+  if (!keep_alive || conn->close_after) {
+    load_close(conn);
+  }
+  if (rate == 0) {
+    conn->due = now;
+  }
+}
+
+/* Picks Content-Length, chunked and Connection: close out of the headers */
+static int load_parse_headers(load_conn_t *conn, size_t size) {
+  char *end = conn->header + size;
+  if (size < 12 || strncmp(conn->header, "HTTP/1.", 7) != 0) {
+    return -1;
+  }
+  conn->status = atoi(conn->header + 9);
+  conn->state = PARSE_UNTIL_EOF;
+  conn->close_after = 0;
+
+  long long content_length = -1;
+  int chunked = 0;
+  for (char *line = memchr(conn->header, '\n', size); line != NULL && line + 1 < end;
+      line = memchr(line + 1, '\n', end - line - 1)) {
+    char *name = line + 1;
+    if (strncasecmp(name, "Content-Length:", 15) == 0) {
+      content_length = strtoll(name + 15, NULL, 10);
+    } else if (strncasecmp(name, "Transfer-Encoding:", 18) == 0) {
+      chunked = strncasecmp(name + 18 + strspn(name + 18, " "), "chunked", 7) == 0;
+    } else if (strncasecmp(name, "Connection:", 11) == 0) {
+      conn->close_after = strncasecmp(name + 11 + strspn(name + 11, " "), "close", 5) == 0;
+    }
+  }
+
+  if (conn->status / 100 == 1 || conn->status == 204 || conn->status == 304) {
+    /* No body, whatever the headers say */
+    conn->state = PARSE_BODY;
+    conn->remaining = 0;
+  } else if (chunked) {
+    conn->state = PARSE_CHUNK_SIZE;
+    conn->line_size = 0;
+  } else if (content_length >= 0) {
+    conn->state = PARSE_BODY;
+    conn->remaining = content_length;
+  } else {
+    conn->close_after = 1;
+  }
+  return 0;
+}
+
+/* Feeds response bytes to CONN's parser. Returns 1 once the response is
+ * complete, 0 when more is needed and -1 on garbage. */
+static int load_feed(load_conn_t *conn, char *data, size_t size) {
+  while (size > 0 || (conn->state == PARSE_BODY && conn->remaining == 0)) {
+    switch (conn->state) {
+      case PARSE_HEADERS: {
+        size_t space = LOAD_HEADER_SIZE - conn->header_size;
+        size_t copied = size < space ? size : space;
+        size_t from = conn->header_size > 3 ? conn->header_size - 3 : 0;
+        memcpy(conn->header + conn->header_size, data, copied);
+        conn->header_size += copied;
+
+        char *blank = memmem(conn->header + from, conn->header_size - from, "\r\n\r\n", 4);
+        if (blank == NULL) {
+          if (conn->header_size == LOAD_HEADER_SIZE) return -1;
+          return 0;
+        }
+        size_t header_size = blank + 4 - conn->header;
+        size_t used = header_size - (conn->header_size - copied);
+        data += used;
+        size -= used;
+        if (load_parse_headers(conn, header_size) < 0) return -1;
+        break;
+      }
+      case PARSE_BODY: {
+        size_t used = size < conn->remaining ? size : conn->remaining;
+        conn->remaining -= used;
+        if (conn->remaining == 0) return 1;
+        return 0;
+      }
+      case PARSE_CHUNK_SIZE:
+      case PARSE_CHUNK_END: {
+        char c = *data++;
+        size--;
+        if (c != '\n') {
+          if (conn->line_size < (int) sizeof(conn->line) - 1) {
+            conn->line[conn->line_size++] = c;
+          }
+          break;
+        }
+        conn->line[conn->line_size] = '\0';
+        int blank = conn->line_size == 0 || (conn->line_size == 1 && conn->line[0] == '\r');
+        conn->line_size = 0;
+        if (conn->state == PARSE_CHUNK_END) {
+          if (blank) return 1;
+          break;
+        }
+        conn->remaining = strtoull(conn->line, NULL, 16);
+        if (conn->remaining == 0) {
+          conn->state = PARSE_CHUNK_END;
+        } else {
+          conn->remaining += 2;
+          conn->state = PARSE_CHUNK_DATA;
+        }
+        break;
+      }
+      case PARSE_CHUNK_DATA: {
+        size_t used = size < conn->remaining ? size : conn->remaining;
+        conn->remaining -= used;
+        data += used;
+        size -= used;
+        if (conn->remaining == 0) conn->state = PARSE_CHUNK_SIZE;
+        break;
+      }
+      case PARSE_UNTIL_EOF:
+        return 0;
+    }
+  }
+  return 0;
+}
+
+static void load_write(load_thread_t *thread, load_conn_t *conn) {
+  char *request = requests[conn->path];
+  size_t request_size = request_sizes[conn->path];
+  while (conn->sent < request_size) {
+    ssize_t nsent = send(conn->fd, request + conn->sent, request_size - conn->sent,
+        MSG_NOSIGNAL);
+    if (nsent < 0) {
+      if (errno == EINTR) continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK) return;
+      load_fail(thread, conn, load_now_us());
+      return;
+    }
+    conn->sent += nsent;
+  }
+}
+
+/* Reads until the socket runs dry; a response may complete on the way and
+ * an idle connection the server closed is dropped */
+static void load_read(load_thread_t *thread, load_conn_t *conn) {
+  while (conn->fd >= 0) {
+    ssize_t nread = read(conn->fd, thread->buffer, LOAD_READ_SIZE);
+    if (nread < 0 && errno == EINTR) {
+      continue;
+    }
+    if (nread < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      return;
+    }
+    if (nread <= 0) {
+      if (conn->busy && nread == 0 && conn->state == PARSE_UNTIL_EOF) {
+        load_complete(thread, conn);
+      } else if (conn->busy) {
+        load_fail(thread, conn, load_now_us());
+      }
+      load_close(conn);
+      return;
+    }
+
+    thread->bytes += nread;
+    if (conn->busy) {
+      int status = load_feed(conn, thread->buffer, nread);
+      if (status < 0) {
+        load_fail(thread, conn, load_now_us());
+      } else if (status > 0) {
+        load_complete(thread, conn);
+      }
+    }
+  }
+}
+
+static void load_send(load_thread_t *thread, load_conn_t *conn, long long now) {
+  conn->intended = rate > 0 ? conn->due : now;
+  conn->due = rate > 0 ? conn->due + interval : LLONG_MAX;
+
+  if (conn->fd < 0 && load_connect(thread, conn) < 0) {
+    load_fail(thread, conn, now);
+    return;
+  }
+
+  int pick = rand_r(&thread->seed) % weights[path_count - 1];
+  conn->path = 0;
+  while (weights[conn->path] <= pick) {
+    conn->path++;
+  }
+  conn->busy = 1;
+  conn->sent = 0;
+  conn->started = now;
+  conn->state = PARSE_HEADERS;
+  conn->header_size = 0;
+  load_write(thread, conn);
+}
+
+/* Sends whatever is due, returns when the next request is */
+static long long load_start_due(load_thread_t *thread, long long now) {
+  long long next = end_us;
+  for (int i = 0; i < thread->conn_count; i++) {
+    load_conn_t *conn = &thread->conns[i];
+    if (!conn->busy && conn->due <= now) {
+      load_send(thread, conn, now);
+    }
+    if (!conn->busy && conn->due < next) {
+      next = conn->due;
+    }
+  }
+  return next;
+}
+
+static void *load_routine(void *load_thread) {
+  load_thread_t *thread = (load_thread_t *) load_thread;
+  struct epoll_event events[LOAD_MAX_EVENTS];
+
+  for (;;) {
+    long long now = load_now_us();
+    if (now >= end_us) {
+      break;
+    }
+    /* epoll_wait() counts in ms, the timer keeps the schedule to the us */
+    long long next = load_start_due(thread, now);
+    struct itimerspec timer = { { 0, 0 }, { next / 1000000, next % 1000000 * 1000 } };
+    timerfd_settime(thread->timer_fd, TFD_TIMER_ABSTIME, &timer, NULL);
+
+    int num_events = epoll_wait(thread->epoll_fd, events, LOAD_MAX_EVENTS, 100);
+    for (int i = 0; i < num_events; i++) {
+      load_conn_t *conn = (load_conn_t *) events[i].data.ptr;
+      if (conn == NULL) {
+        unsigned long long expirations;
+        read(thread->timer_fd, &expirations, sizeof(expirations));
+        continue;
+      }
+      if ((events[i].events & EPOLLOUT) && conn->busy && conn->fd >= 0) {
+        load_write(thread, conn);
+      }
+      if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+        load_read(thread, conn);
+      }
+    }
+  }
+
+  for (int i = 0; i < thread->conn_count; i++) {
+    load_close(&thread->conns[i]);
+  }
+  return NULL;
+}
+
+/* Splits host:port and resolves it */
+static int load_resolve(char *target, char **host) {
+  char *colon = strrchr(target, ':');
+  if (colon == NULL) {
+    return -1;
+  }
+  *colon = '\0';
+  *host = target;
+
+  struct addrinfo hints, *result;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  if (getaddrinfo(target, colon + 1, &hints, &result) != 0) {
+    return -1;
+  }
+  memcpy(&address, result->ai_addr, result->ai_addrlen);
+  address_size = result->ai_addrlen;
+  freeaddrinfo(result);
+  return 0;
+}
+
+/* Builds the request for every path:weight in MIX */
+static int load_parse_mix(char *mix, char *host) {
+  char *saveptr;
+  int total = 0;
+  for (char *item = strtok_r(mix, ",", &saveptr); item != NULL;
+      item = strtok_r(NULL, ",", &saveptr)) {
+    if (path_count == LOAD_MAX_PATHS) {
+      return -1;
+    }
+    char *weight = strchr(item, ':');
+    int w = 1;
+    if (weight != NULL) {
+      *weight = '\0';
+      w = atoi(weight + 1);
+    }
+    if (w <= 0 || item[0] != '/') {
+      return -1;
+    }
+    total += w;
+    weights[path_count] = total;
+    request_sizes[path_count] = asprintf(&requests[path_count],
+        "GET %s HTTP/1.1\r\nHost: %s\r\nUser-Agent: bench_load\r\n%s%s\r\n", item, host,
+        keep_alive ? "" : "Connection: close\r\n", extra_headers);
+    path_count++;
+  }
+  return path_count > 0 ? 0 : -1;
+}
+
+static void print_latency(char *label, histogram_t *h) {
+  printf("  %-14s p50 %8.3f  p90 %8.3f  p99 %8.3f  p99.9 %8.3f  max %8.3f ms\n", label,
+      histogram_percentile(h, 50), histogram_percentile(h, 90), histogram_percentile(h, 99),
+      histogram_percentile(h, 99.9), h->max / 1000.0);
+}
+
+static void usage(char *name) {
+  fprintf(stderr, "Usage: %s [-t threads] [-c connections] [-d seconds] [-r rate]\n"
+      "       [-k 0|1] [-m path[:weight],...] [-H header] [-s] host:port\n", name);
+  exit(1);
+}
+
+int main(int argc, char **argv) {
+  int num_threads = 2;
+  int num_conns = 32;
+  double duration = 5;
+  char *mix = NULL;
+  int summary = 0;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "t:c:d:r:k:m:H:s")) != -1) {
+    switch (opt) {
+      case 't': num_threads = atoi(optarg); break;
+      case 'c': num_conns = atoi(optarg); break;
+      case 'd': duration = atof(optarg); break;
+      case 'r': rate = atof(optarg); break;
+      case 'k': keep_alive = atoi(optarg); break;
+      case 'm': mix = optarg; break;
+      case 'H':
+        if (strlen(extra_headers) + strlen(optarg) + 3 > sizeof(extra_headers)) usage(argv[0]);
+        strcat(extra_headers, optarg);
+        strcat(extra_headers, "\r\n");
+        break;
+      case 's': summary = 1; break;
+      default: usage(argv[0]);
+    }
+  }
+
+  char *host;
+  char default_mix[] = "/";
+  if (optind != argc - 1 || num_threads <= 0 || num_threads > LOAD_MAX_THREADS
+      || num_conns <= 0 || duration <= 0 || rate < 0) {
+    usage(argv[0]);
+  }
+  if (load_resolve(argv[optind], &host) < 0) {
+    fprintf(stderr, "Can't resolve %s\n", argv[optind]);
+    return 1;
+  }
+  if (load_parse_mix(mix ? mix : default_mix, host) < 0) {
+    fprintf(stderr, "Bad request mix, expected /path[:weight],...\n");
+    return 1;
+  }
+  if (num_threads > num_conns) {
+    num_threads = num_conns;
+  }
+
+  static load_thread_t threads[LOAD_MAX_THREADS];
+  load_conn_t *conns = calloc(num_conns, sizeof(load_conn_t));
+  if (conns == NULL) {
+    perror("Can't allocate connections");
+    return 1;
+  }
+
+  start_us = load_now_us();
+  end_us = start_us + (long long) (duration * 1000000);
+  if (rate > 0) {
+    interval = (long long) (num_conns * 1000000.0 / rate);
+  }
+  for (int i = 0; i < num_conns; i++) {
+    conns[i].fd = -1;
+    /* Stagger the open loop so requests don't come in bursts */
+    conns[i].due = start_us + (rate > 0 ? i * interval / num_conns : 0);
+  }
+
+  for (int i = 0; i < num_threads; i++) {
+    load_thread_t *thread = &threads[i];
+    int first = i * num_conns / num_threads;
+    thread->conns = conns + first;
+    thread->conn_count = (i + 1) * num_conns / num_threads - first;
+    thread->seed = i + 1;
+    thread->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    thread->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    struct epoll_event event = { .events = EPOLLIN, .data.ptr = NULL };
+    if (thread->epoll_fd < 0 || thread->timer_fd < 0
+        || epoll_ctl(thread->epoll_fd, EPOLL_CTL_ADD, thread->timer_fd, &event) < 0
+        || pthread_create(&thread->thread, NULL, load_routine, thread) != 0) {
+      perror("Can't start load thread");
+      return 1;
+    }
+  }
+
+  histogram_t *latency = calloc(1, sizeof(histogram_t));
+  histogram_t *service = calloc(1, sizeof(histogram_t));
+  unsigned long statuses[6] = { 0 };
+  unsigned long long bytes = 0;
+  for (int i = 0; i < num_threads; i++) {
+    pthread_join(threads[i].thread, NULL);
+    histogram_merge(latency, &threads[i].latency);
+    histogram_merge(service, &threads[i].service);
+    for (int s = 0; s < 6; s++) {
+      statuses[s] += threads[i].statuses[s];
+    }
+    bytes += threads[i].bytes;
+    close(threads[i].epoll_fd);
+    close(threads[i].timer_fd);
+  }
+
+  double elapsed = (load_now_us() - start_us) / 1e6;
+  unsigned long errors = statuses[0] + statuses[5];
+  if (summary) {
+    printf("%10.1f %8.3f %8.3f %8.3f %8.3f %6lu\n", latency->count / elapsed,
+        histogram_percentile(latency, 50), histogram_percentile(latency, 99),
+        histogram_percentile(latency, 99.9), latency->max / 1000.0, errors);
+    return 0;
+  }
+
+  if (rate > 0) {
+    printf("open loop at %.0f/s", rate);
+  } else {
+    printf("closed loop");
+  }
+  printf(", %s, %d threads, %d connections, %.1fs\n",
+      keep_alive ? "keep-alive" : "a connection per request", num_threads, num_conns, elapsed);
+  printf("  %-14s %lu (%.1f/s), %.2f MB/s\n", "requests", latency->count,
+      latency->count / elapsed, bytes / elapsed / (1 << 20));
+  printf("  %-14s 1xx %lu  2xx %lu  3xx %lu  4xx %lu  5xx %lu  errors %lu\n", "responses",
+      statuses[1], statuses[2], statuses[3], statuses[4], statuses[5], statuses[0]);
+  print_latency("latency", latency);
+  if (rate > 0) {
+    print_latency("service time", service);
+  }
+  return 0;
+}
@@ -0,0 +1,139 @@
+/*
+ * Microbenchmark for the libhttp request parser.
+ *
+ * Usage: ./bench_parser [iterations]
+ *
+ * Feeds canned requests straight into a struct http_conn buffer (no
+ * sockets involved) and reports parses per second for each of them, both
+ * delivered whole and split into small segments.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "libhttp.h"
+
+struct canned_request {
+  char *name;
+  char *data;
+};
+
+static struct canned_request canned_requests[] = {
+  { "minimal",
+    "GET / HTTP/1.1\r\n\r\n" },
+  { "curl",
+    "GET /index.html HTTP/1.1\r\n"
+    "Host: localhost:8000\r\n"
+    "User-Agent: curl/7.88.1\r\n"
+    "Accept: */*\r\n"
+    "\r\n" },
+  { "browser",
+    "GET /my_documents/WEB_SCALE.jpg HTTP/1.1\r\n"
+    "Host: localhost:8000\r\n"
+    "Connection: keep-alive\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 "
+        "(KHTML, like Gecko) Chrome/120.0.0.0 Safari/537.36\r\n"
+    "Accept: image/avif,image/webp,image/apng,image/svg+xml,image/*,*/*;q=0.8\r\n"
+    "Referer: http://localhost:8000/my_documents/\r\n"
+    "Accept-Encoding: gzip, deflate, br\r\n"
+    "Accept-Language: en-US,en;q=0.9\r\n"
+    "Cookie: session=4f2c9a0b7d1e43f8a6c5b2e1d0f9a8b7; theme=dark\r\n"
+    "If-None-Match: \"5b2c-1a4f3e\"\r\n"
+    "If-Modified-Since: Thu, 21 Jun 2018 10:00:00 GMT\r\n"
+    "\r\n" },
+  { "post",
+    "POST /form HTTP/1.1\r\n"
+    "Host: localhost:8000\r\n"
+    "Content-Type: application/x-www-form-urlencoded\r\n"
+    "Content-Length: 27\r\n"
+    "\r\n"
+    "name=cs162&semester=sp18&x=" },
+};
+
+static double now_seconds(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Parses DATA ITERATIONS times, handing the parser SEGMENT bytes at a time
+ * (0 for everything at once). Returns parses per second, or -1 on error. */
+static double bench_request(char *data, long iterations, size_t segment) {
+  static struct http_conn conn;
+  struct http_request *request;
+  size_t size = strlen(data);
+
+  http_conn_init(&conn, -1);
+  conn.max_requests = iterations + 1;
+
+  double start = now_seconds();
+  for (long i = 0; i < iterations; i++) {
+    size_t fed = 0;
+    int status = 0;
+
+    /* Starting from an empty buffer mirrors one request per read() */
+    if (conn.parser.state == HTTP_PARSE_DONE) {
+      http_conn_parse(&conn, &request);
+    }
+    while (status == 0 && fed < size) {
+      size_t chunk = segment && size - fed > segment ? segment : size - fed;
+      memcpy(conn.buffer + conn.size, data + fed, chunk);
+      conn.size += chunk;
+      fed += chunk;
+      status = http_conn_parse(&conn, &request);
+    }
+    if (status != 1) {
+      return -1;
+    }
+  }
+  return iterations / (now_seconds() - start);
+}
+
+/* Parses a buffer holding as many back to back copies of DATA as fit. */
+static double bench_pipelined(char *data, long iterations) {
+  static struct http_conn conn;
+  struct http_request *request;
+  size_t size = strlen(data);
+  int per_buffer = LIBHTTP_REQUEST_MAX_SIZE / size;
+  long parsed = 0;
+
+  double start = now_seconds();
+  while (parsed < iterations) {
+    http_conn_init(&conn, -1);
+    conn.max_requests = per_buffer + 1;
+    for (int i = 0; i < per_buffer; i++) {
+      memcpy(conn.buffer + conn.size, data, size);
+      conn.size += size;
+    }
+    while (http_conn_parse(&conn, &request) == 1) {
+      parsed++;
+    }
+  }
+  return parsed / (now_seconds() - start);
+}
+
+int main(int argc, char **argv) {
+  long iterations = argc > 1 ? atol(argv[1]) : 2000000;
+  if (iterations <= 0) {
+    fprintf(stderr, "Usage: %s [iterations]\n", argv[0]);
+    return 1;
+  }
+
+  printf("%-10s %8s %16s %16s %16s\n", "request", "bytes", "whole/s",
+      "16B segments/s", "pipelined/s");
+  for (size_t i = 0; i < sizeof(canned_requests) / sizeof(canned_requests[0]); i++) {
+    struct canned_request *canned = &canned_requests[i];
+    double whole = bench_request(canned->data, iterations, 0);
+    double split = bench_request(canned->data, iterations, 16);
+    double pipelined = bench_pipelined(canned->data, iterations);
+    if (whole < 0 || split < 0) {
+      fprintf(stderr, "Failed to parse the %s request\n", canned->name);
+      return 1;
+    }
+    printf("%-10s %8zu %16.0f %16.0f %16.0f\n", canned->name, strlen(canned->data),
+        whole, split, pipelined);
+  }
+  return 0;
+}
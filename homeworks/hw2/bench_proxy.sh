@@ -0,0 +1,49 @@
+#!/bin/bash
+# Runs the proxy in front of local stub upstreams (httpserver --files, each
+# serving a file naming it) plus one address nobody listens on. Shows how
+# requests spread over the upstreams with each balancing policy, how many
+# 502s the dead one costs before it is ejected, and what happens when a live
+# one goes away mid-run.
+#
+# Usage: ./bench_proxy.sh [requests] [concurrency]
+REQUESTS=${1:-600}
+CONCURRENCY=${2:-20}
+PORT=8130
+ROOT=$(mktemp -d)
+trap 'pkill -f "httpserver --files $ROOT"; pkill -f "httpserver --proxy .* --port $PORT"; rm -rf "$ROOT"' EXIT
+
+targets=""
+for i in 1 2 3; do
+  mkdir "$ROOT/stub$i"
+  echo "stub$i" > "$ROOT/stub$i/whoami"
+  ./httpserver --files "$ROOT/stub$i" --port $((PORT + i)) --event-loop >/dev/null 2>&1 &
+  targets="$targets,localhost:$((PORT + i))"
+done
+# Nothing listens on PORT + 4
+targets="${targets#,},localhost:$((PORT + 4))"
+sleep 0.5
+
+tally() {
+  seq "$REQUESTS" | xargs -P "$CONCURRENCY" -I{} \
+    curl -s -m 5 "http://localhost:$PORT/whoami" -o - -w "\n" \
+    | awk '/^stub/ { n[$1]++ } /502 Bad Gateway/ { n["502"]++ }
+        END { for (k in n) printf "%s=%d ", k, n[k]; print "" }'
+}
+
+for balance in rr least; do
+  ./httpserver --proxy "$targets" --port $PORT --num-threads 2 \
+    --proxy-balance $balance >/dev/null 2>&1 &
+  sleep 0.5
+
+  start=$(date +%s.%N)
+  printf "%-6s all up:      %s\n" $balance "$(tally)"
+  end=$(date +%s.%N)
+  printf "%-6s %d requests in %.3fs\n" $balance "$REQUESTS" \
+    "$(awk "BEGIN { print $end - $start }")"
+
+  pkill -f "httpserver --files $ROOT/stub2"
+  printf "%-6s stub2 down:  %s\n" $balance "$(tally)"
+  pkill -f "httpserver --proxy .* --port $PORT"
+  ./httpserver --files "$ROOT/stub2" --port $((PORT + 2)) --event-loop >/dev/null 2>&1 &
+  sleep 0.5
+done
@@ -1,4 +1,5 @@
 #!/bin/bash
-# Install artillery:
-# npm install -g artillery
-artillery quick -k --count 10000 -n 200 http://localhost:8000
+# Hammers a server already listening on localhost:8000 with 200 keep-alive
+# connections for 10 seconds. Extra arguments go to bench_load, e.g. -r 5000
+# for an open loop or -k 0 for a connection per request.
+make -s bench_load && ./bench_load -c 200 -d 10 "$@" localhost:8000
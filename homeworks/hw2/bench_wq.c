@@ -0,0 +1,175 @@
+/*
+ * Microbenchmark for the work queue.
+ *
+ * Usage: ./bench_wq [items]
+ *
+ * Compares the lock-free ring in wq.c with the queue it replaced (a calloc'd
+ * list behind the pool mutex, woken with pthread_cond_signal()), at 1 to 64
+ * worker threads. Two shapes are measured: one producer feeding all workers
+ * like the accept loop does, and as many producers as workers.
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "utlist.h"
+#include "wq.h"
+
+/* The mutex + condvar queue, as thread_pool_add() and its workers used it */
+typedef struct locked_item {
+  int client_socket_fd;
+  struct locked_item *next;
+  struct locked_item *prev;
+} locked_item_t;
+
+typedef struct locked_queue {
+  pthread_mutex_t lock;
+  pthread_cond_t notify;
+  locked_item_t *head;
+  int size;
+  int closed;
+} locked_queue_t;
+
+static void locked_push(locked_queue_t *queue, int client_socket_fd) {
+  pthread_mutex_lock(&queue->lock);
+  locked_item_t *item = calloc(1, sizeof(locked_item_t));
+  item->client_socket_fd = client_socket_fd;
+  DL_APPEND(queue->head, item);
+  queue->size++;
+  pthread_cond_signal(&queue->notify);
+  pthread_mutex_unlock(&queue->lock);
+}
+
+static int locked_pop(locked_queue_t *queue) {
+  pthread_mutex_lock(&queue->lock);
+  while (queue->size == 0 && !queue->closed) {
+    pthread_cond_wait(&queue->notify, &queue->lock);
+  }
+  int client_socket_fd = -1;
+  locked_item_t *item = queue->head;
+  if (item != NULL) {
+    client_socket_fd = item->client_socket_fd;
+    queue->size--;
+    DL_DELETE(queue->head, item);
+    free(item);
+  }
+  pthread_mutex_unlock(&queue->lock);
+  return client_socket_fd;
+}
+
+static void locked_close(locked_queue_t *queue) {
+  pthread_mutex_lock(&queue->lock);
+  queue->closed = 1;
+  pthread_cond_broadcast(&queue->notify);
+  pthread_mutex_unlock(&queue->lock);
+}
+
+struct bench {
+  int lock_free;
+  wq_t ring;
+  locked_queue_t locked;
+  long items_per_producer;
+};
+
+static void *producer(void *arg) {
+  struct bench *bench = arg;
+  for (long i = 0; i < bench->items_per_producer; i++) {
+    if (bench->lock_free) {
+      while (wq_push(&bench->ring, (int) i) != 0) {
+        sched_yield();
+      }
+    } else {
+      locked_push(&bench->locked, (int) i);
+    }
+  }
+  return NULL;
+}
+
+static void *consumer(void *arg) {
+  struct bench *bench = arg;
+  long popped = 0;
+  while ((bench->lock_free ? wq_pop(&bench->ring) : locked_pop(&bench->locked)) >= 0) {
+    popped++;
+  }
+  return (void *) popped;
+}
+
+static double now_seconds(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Returns items moved through the queue per second, or -1 if any got lost */
+static double run(int lock_free, int producers, int consumers, long items) {
+  static struct bench bench;
+  pthread_t threads[128];
+
+  bench.lock_free = lock_free;
+  bench.items_per_producer = items / producers;
+  wq_init(&bench.ring, 65536);
+  pthread_mutex_init(&bench.locked.lock, NULL);
+  pthread_cond_init(&bench.locked.notify, NULL);
+  bench.locked.head = NULL;
+  bench.locked.size = 0;
+  bench.locked.closed = 0;
+
+  double start = now_seconds();
+  for (int i = 0; i < consumers; i++) {
+    pthread_create(&threads[i], NULL, consumer, &bench);
+  }
+  for (int i = 0; i < producers; i++) {
+    pthread_create(&threads[consumers + i], NULL, producer, &bench);
+  }
+  for (int i = 0; i < producers; i++) {
+    pthread_join(threads[consumers + i], NULL);
+  }
+  if (lock_free) {
+    wq_close(&bench.ring);
+  } else {
+    locked_close(&bench.locked);
+  }
+
+  long popped = 0;
+  for (int i = 0; i < consumers; i++) {
+    void *count;
+    pthread_join(threads[i], &count);
+    popped += (long) count;
+  }
+  double elapsed = now_seconds() - start;
+
+  free(bench.ring.cells);
+  pthread_mutex_destroy(&bench.locked.lock);
+  pthread_cond_destroy(&bench.locked.notify);
+  return popped == bench.items_per_producer * producers ? popped / elapsed : -1;
+}
+
+int main(int argc, char **argv) {
+  long items = argc > 1 ? atol(argv[1]) : 2000000;
+  if (items <= 0) {
+    fprintf(stderr, "Usage: %s [items]\n", argv[0]);
+    return 1;
+  }
+
+  printf("%8s %16s %16s %16s %16s\n", "threads", "locked 1:N/s", "ring 1:N/s",
+      "locked N:N/s", "ring N:N/s");
+  for (int threads = 1; threads <= 64; threads *= 2) {
+    double results[4] = {
+      run(0, 1, threads, items),
+      run(1, 1, threads, items),
+      run(0, threads, threads, items),
+      run(1, threads, threads, items),
+    };
+    for (int i = 0; i < 4; i++) {
+      if (results[i] < 0) {
+        fprintf(stderr, "Items lost at %d threads\n", threads);
+        return 1;
+      }
+    }
+    printf("%8d %16.0f %16.0f %16.0f %16.0f\n", threads, results[0], results[1],
+        results[2], results[3]);
+  }
+  return 0;
+}
@@ -0,0 +1,48 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "compress.h"
+
+int compress_gzip(int fd, size_t size, struct http_buffer *out) {
+  char *input = malloc(size ? size : 1);
+  if (input == NULL) {
+    return -1;
+  }
+
+  size_t done = 0;
+  while (done < size) {
+    ssize_t bytes_read = pread(fd, input + done, size - done, done);
+    if (bytes_read < 0 && errno == EINTR) continue;
+    if (bytes_read <= 0) {
+      free(input);
+      return -1;
+    }
+    done += bytes_read;
+  }
+
+  /* 16 + 15: a gzip wrapper around the largest window */
+  z_stream stream;
+  memset(&stream, 0, sizeof(stream));
+  if (deflateInit2(&stream, COMPRESS_LEVEL, Z_DEFLATED, 16 + 15, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+    free(input);
+    return -1;
+  }
+
+  /* One pass straight into OUT, deflateBound() leaves room for the worst case */
+  size_t bound = deflateBound(&stream, size);
+  size_t start = out->size;
+  http_buffer_append(out, NULL, bound);
+  stream.next_in = (Bytef *) input;
+  stream.avail_in = size;
+  stream.next_out = (Bytef *) out->data + start;
+  stream.avail_out = bound;
+
+  int status = deflate(&stream, Z_FINISH);
+  out->size = start + stream.total_out;
+  deflateEnd(&stream);
+  free(input);
+  return status == Z_STREAM_END ? 0 : -1;
+}
@@ -0,0 +1,23 @@
+#ifndef __COMPRESS__
+#define __COMPRESS__
+
+#include <stddef.h>
+
+#include "libhttp.h"
+
+/* COMPRESS gzips file bodies for clients that accept it. Only bodies
+ * between COMPRESS_MIN_SIZE (smaller ones gain nothing over the headers)
+ * and COMPRESS_MAX_SIZE are compressed on the fly, in the thread serving
+ * the request, or with event loops in a background thread while the
+ * identity is served; the result is meant to be cached, larger files should
+ * come with a precompressed .gz or .br sibling. */
+
+#define COMPRESS_MIN_SIZE 256
+#define COMPRESS_MAX_SIZE (1 << 20)
+#define COMPRESS_LEVEL 6
+
+/* Appends SIZE bytes of FD, gzipped, to OUT. Returns -1 if they can't be
+ * read or compressed. */
+int compress_gzip(int fd, size_t size, struct http_buffer *out);
+
+#endif
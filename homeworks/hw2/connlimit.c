@@ -0,0 +1,132 @@
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+
+#include "connlimit.h"
+
+/* Sentinel for descriptors counted only against the total */
+static conn_limit_entry_t unlimited_address;
+
+int conn_limit_init(conn_limit_t *limit, int max_total, int max_per_address) {
+  memset(limit, 0, sizeof(conn_limit_t));
+  limit->max_total = max_total;
+  limit->max_per_address = max_per_address;
+
+  /* Descriptors are below the open file limit */
+  struct rlimit rl;
+  if (getrlimit(RLIMIT_NOFILE, &rl) < 0) {
+    perror("getrlimit(): Error");
+    return -1;
+  }
+  limit->max_fds = rl.rlim_cur == RLIM_INFINITY || rl.rlim_cur > (1 << 20) ? 1 << 20 : rl.rlim_cur;
+  limit->fds = calloc(limit->max_fds, sizeof(conn_limit_entry_t *));
+  if (limit->fds == NULL) {
+    perror("Init connection limits error");
+    return -1;
+  }
+
+  for (int i = 0; i < CONN_LIMIT_STRIPES; i++) {
+    if (pthread_mutex_init(&limit->locks[i], NULL) != 0) {
+      perror("Init connection limit lock error");
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/* ADDRESS as 16 bytes, an IPv4 one mapped. Returns -1 if it's neither. */
+static int conn_limit_key(struct sockaddr *address, unsigned char *key) {
+  if (address->sa_family == AF_INET6) {
+    memcpy(key, &((struct sockaddr_in6 *) address)->sin6_addr, 16);
+    return 0;
+  }
+  if (address->sa_family == AF_INET) {
+    memset(key, 0, 10);
+    key[10] = key[11] = 0xff;
+    memcpy(key + 12, &((struct sockaddr_in *) address)->sin_addr, 4);
+    return 0;
+  }
+  return -1;
+}
+
+/* FNV-1a */
+static unsigned int conn_limit_hash(unsigned char *key) {
+  unsigned int hash = 2166136261u;
+  for (int i = 0; i < 16; i++) {
+    hash ^= key[i];
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+int conn_limit_acquire(conn_limit_t *limit, int fd, struct sockaddr *address) {
+  if (fd < 0 || fd >= limit->max_fds) {
+    return 0;
+  }
+
+  int total = __atomic_add_fetch(&limit->total, 1, __ATOMIC_RELAXED);
+  if (limit->max_total > 0 && total > limit->max_total) {
+    __atomic_sub_fetch(&limit->total, 1, __ATOMIC_RELAXED);
+    return -1;
+  }
+
+  unsigned char key[16];
+  if (limit->max_per_address <= 0 || address == NULL || conn_limit_key(address, key) < 0) {
+    __atomic_store_n(&limit->fds[fd], &unlimited_address, __ATOMIC_RELEASE);
+    return 0;
+  }
+
+  unsigned int hash = conn_limit_hash(key);
+  pthread_mutex_t *lock = &limit->locks[hash % CONN_LIMIT_STRIPES];
+  conn_limit_entry_t **link = &limit->buckets[hash % CONN_LIMIT_BUCKETS];
+
+  pthread_mutex_lock(lock);
+  conn_limit_entry_t *entry = *link;
+  while (entry != NULL && memcmp(entry->address, key, 16) != 0) {
+    entry = entry->next;
+  }
+  if (entry == NULL && (entry = calloc(1, sizeof(conn_limit_entry_t))) != NULL) {
+    memcpy(entry->address, key, 16);
+    entry->hash = hash;
+    entry->next = *link;
+    *link = entry;
+  }
+  int refused = entry == NULL || entry->count >= limit->max_per_address;
+  if (!refused) {
+    entry->count++;
+  }
+  pthread_mutex_unlock(lock);
+
+  if (refused) {
+    __atomic_sub_fetch(&limit->total, 1, __ATOMIC_RELAXED);
+    return -1;
+  }
+  __atomic_store_n(&limit->fds[fd], entry, __ATOMIC_RELEASE);
+  return 0;
+}
+
+void conn_limit_release(conn_limit_t *limit, int fd) {
+  if (fd < 0 || fd >= limit->max_fds) {
+    return;
+  }
+  conn_limit_entry_t *entry = __atomic_exchange_n(&limit->fds[fd], NULL, __ATOMIC_ACQ_REL);
+  if (entry == NULL) {
+    return;
+  }
+  __atomic_sub_fetch(&limit->total, 1, __ATOMIC_RELAXED);
+  if (entry == &unlimited_address) {
+    return;
+  }
+
+  pthread_mutex_t *lock = &limit->locks[entry->hash % CONN_LIMIT_STRIPES];
+  pthread_mutex_lock(lock);
+  if (--entry->count == 0) {
+    conn_limit_entry_t **link = &limit->buckets[entry->hash % CONN_LIMIT_BUCKETS];
+    while (*link != entry) link = &(*link)->next;
+    *link = entry->next;
+    free(entry);
+  }
+  pthread_mutex_unlock(lock);
+}
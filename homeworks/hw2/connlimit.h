@@ -0,0 +1,43 @@
+#ifndef __CONNLIMIT__
+#define __CONNLIMIT__
+
+#include <pthread.h>
+#include <sys/socket.h>
+
+/* CONNLIMIT caps the connections the server holds at once, overall and per
+ * client address, so a few clients opening many connections can't take
+ * every worker. Connections are counted by descriptor from accept to close:
+ * releasing a descriptor twice, or one never counted, is harmless. Counts
+ * per address live in a hash table with striped locks, an address is
+ * dropped once it has no connection left. */
+
+#define CONN_LIMIT_BUCKETS 4096
+#define CONN_LIMIT_STRIPES 64
+
+typedef struct conn_limit_entry {
+  unsigned char address[16];    // IPv4 addresses are mapped to IPv6.
+  unsigned int hash;
+  int count;
+  struct conn_limit_entry *next;
+} conn_limit_entry_t;
+
+typedef struct conn_limit {
+  int max_total;                // 0 for no limit.
+  int max_per_address;          // 0 for no limit.
+  int total;
+  conn_limit_entry_t *buckets[CONN_LIMIT_BUCKETS];
+  pthread_mutex_t locks[CONN_LIMIT_STRIPES];
+  conn_limit_entry_t **fds;     // The entry each descriptor counts against.
+  int max_fds;
+} conn_limit_t;
+
+int conn_limit_init(conn_limit_t *limit, int max_total, int max_per_address);
+
+/* Counts FD, accepted from ADDRESS, against the limits. Returns -1 if
+ * either is reached, the caller should turn it away. */
+int conn_limit_acquire(conn_limit_t *limit, int fd, struct sockaddr *address);
+
+/* Stops counting FD, before it is closed. */
+void conn_limit_release(conn_limit_t *limit, int fd);
+
+#endif
@@ -0,0 +1,96 @@
+#include <stdlib.h>
+
+#include "deque.h"
+
+/* A slot may be read by a thief while the owner refills it a lap later, the
+ * thief then loses the race on top and drops what it read. Access the
+ * fields atomically so such a read is merely stale, never undefined. */
+static void deque_store(task_t *slot, task_t *task) {
+  __atomic_store_n(&slot->function, task->function, __ATOMIC_RELAXED);
+  __atomic_store_n(&slot->arg, task->arg, __ATOMIC_RELAXED);
+  __atomic_store_n(&slot->client_socket_fd, task->client_socket_fd, __ATOMIC_RELAXED);
+  __atomic_store_n(&slot->accepted, task->accepted, __ATOMIC_RELAXED);
+}
+
+static void deque_load(task_t *slot, task_t *task) {
+  task->function = __atomic_load_n(&slot->function, __ATOMIC_RELAXED);
+  task->arg = __atomic_load_n(&slot->arg, __ATOMIC_RELAXED);
+  task->client_socket_fd = __atomic_load_n(&slot->client_socket_fd, __ATOMIC_RELAXED);
+  task->accepted = __atomic_load_n(&slot->accepted, __ATOMIC_RELAXED);
+}
+
+int deque_init(deque_t *deque, int capacity) {
+  long size = 2;
+  while (size < capacity) size *= 2;
+
+  deque->tasks = malloc(size * sizeof(task_t));
+  if (deque->tasks == NULL) {
+    return -1;
+  }
+  deque->mask = size - 1;
+  deque->top = 0;
+  deque->bottom = 0;
+  return 0;
+}
+
+int deque_push(deque_t *deque, task_t *task) {
+  long bottom = __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED);
+  long top = __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE);
+  if (bottom - top > deque->mask) {
+    return -1;
+  }
+
+  deque_store(&deque->tasks[bottom & deque->mask], task);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  __atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELAXED);
+  return 0;
+}
+
+int deque_pop(deque_t *deque, task_t *task) {
+  /* Reserve the bottom task before looking at top */
+  long bottom = __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED) - 1;
+  __atomic_store_n(&deque->bottom, bottom, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  long top = __atomic_load_n(&deque->top, __ATOMIC_RELAXED);
+
+  if (top > bottom) {
+    /* Empty */
+    __atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELAXED);
+    return -1;
+  }
+
+  deque_load(&deque->tasks[bottom & deque->mask], task);
+  if (top < bottom) {
+    return 0;
+  }
+
+  /* Last task, thieves may be after it too */
+  int won = __atomic_compare_exchange_n(&deque->top, &top, top + 1, 0,
+      __ATOMIC_SEQ_CST, __ATOMIC_RELAXED);
+  __atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELAXED);
+  return won ? 0 : -1;
+}
+
+int deque_steal(deque_t *deque, task_t *task) {
+  for (;;) {
+    long top = __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    long bottom = __atomic_load_n(&deque->bottom, __ATOMIC_ACQUIRE);
+    if (top >= bottom) {
+      return -1;
+    }
+
+    deque_load(&deque->tasks[top & deque->mask], task);
+    /* Losing means someone else made progress, try the next one */
+    if (__atomic_compare_exchange_n(&deque->top, &top, top + 1, 0,
+        __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+      return 0;
+    }
+  }
+}
+
+int deque_size(deque_t *deque) {
+  long bottom = __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED);
+  long top = __atomic_load_n(&deque->top, __ATOMIC_RELAXED);
+  return bottom > top ? (int) (bottom - top) : 0;
+}
@@ -0,0 +1,36 @@
+#ifndef __DEQUE__
+#define __DEQUE__
+
+#include "wq.h"
+
+/* DEQUE is a Chase-Lev work-stealing deque of tasks. Only its owner pushes
+ * and pops, at the bottom, so its own work is taken newest first while it
+ * is still warm in cache; any other thread may steal the oldest task from
+ * the top. Owner operations only synchronize with thieves when the deque is
+ * down to its last task. The capacity is fixed, a full deque refuses pushes.
+ *
+ * Follows "Correct and Efficient Work-Stealing for Weak Memory Models"
+ * (Le, Pop, Cohen, Zappa Nardelli, PPoPP 2013). */
+
+typedef struct deque {
+  long top __attribute__((aligned(WQ_CACHE_LINE)));
+  long bottom __attribute__((aligned(WQ_CACHE_LINE)));
+  task_t *tasks;
+  long mask;
+} deque_t;
+
+int deque_init(deque_t *deque, int capacity);
+
+/* Owner only. Returns -1 if DEQUE is full. */
+int deque_push(deque_t *deque, task_t *task);
+
+/* Owner only. Returns -1 if DEQUE is empty. */
+int deque_pop(deque_t *deque, task_t *task);
+
+/* Any thread. Returns -1 if DEQUE is empty. */
+int deque_steal(deque_t *deque, task_t *task);
+
+/* Approximate number of tasks in DEQUE. */
+int deque_size(deque_t *deque);
+
+#endif
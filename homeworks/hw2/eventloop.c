@@ -0,0 +1,338 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "affinity.h"
+#include "eventloop.h"
+#include "listener.h"
+#include "metrics.h"
+
+static void *event_loop_routine(void *event_loop);
+
+static long long now_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+/* Close CONN at the read deadline of its request, or while idle at the
+ * keep-alive timeout */
+static void conn_read_deadline(event_loop_t *loop, conn_t *conn) {
+  long long deadline = http_conn_deadline(&conn->in);
+  if (deadline < 0) {
+    timer_wheel_remove(&loop->deadlines, &conn->deadline);
+  } else {
+    timer_wheel_add(&loop->deadlines, &conn->deadline, (deadline + 999) / 1000);
+  }
+}
+
+/* Close CONN if the client takes none of its response for so long */
+static void conn_send_deadline(event_loop_t *loop, conn_t *conn) {
+  timer_wheel_add(&loop->deadlines, &conn->deadline, now_ms() + HTTP_SEND_TIMEOUT);
+}
+
+/* Turn a socket over the connection limits away */
+static void event_loop_refuse(int fd) {
+  struct http_response response;
+  http_response_init(&response, fd, 503);
+  http_response_header(&response, "Content-Length", "0");
+  http_response_send(&response);
+  close(fd);
+  metrics_count(METRIC_REFUSED, 1);
+}
+
+/* Accept every pending connection, the listening socket is edge-triggered */
+static void event_loop_accept(event_loop_t *loop) {
+  for (;;) {
+    struct sockaddr_storage address;
+    socklen_t address_size = sizeof(address);
+    int fd = accept4(loop->server_socket, (struct sockaddr *) &address, &address_size,
+        SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd < 0) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+        perror("Error accepting socket");
+      }
+      if (errno == EINTR) continue;
+      return;
+    }
+    if (loop->limit != NULL
+        && conn_limit_acquire(loop->limit, fd, (struct sockaddr *) &address) < 0) {
+      event_loop_refuse(fd);
+      continue;
+    }
+
+    conn_t *conn = calloc(1, sizeof(conn_t));
+    if (conn == NULL) {
+      perror("Can't allocate connection");
+      if (loop->limit != NULL) conn_limit_release(loop->limit, fd);
+      close(fd);
+      continue;
+    }
+    conn->state = CONN_READING;
+    conn->deadline.data = conn;
+    http_conn_init(&conn->in, fd);
+    http_buffer_init(&conn->out);
+
+    struct epoll_event event;
+    event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    event.data.ptr = conn;
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0) {
+      perror("epoll_ctl(): Can't add connection");
+      if (loop->limit != NULL) conn_limit_release(loop->limit, fd);
+      close(fd);
+      free(conn);
+      continue;
+    }
+    metrics_count(METRIC_OPENED, 1);
+    affinity_account(fd);
+    conn_read_deadline(loop, conn);
+  }
+}
+
+/* Run the request handler with the connection's output buffer attached */
+static void conn_handle_request(event_loop_t *loop, conn_t *conn,
+    struct http_request *request) {
+  http_buffer_attach(&conn->out);
+  http_set_keep_alive(request->keep_alive);
+  loop->request_handler(conn->in.fd, request);
+  http_flush(conn->in.fd);
+  http_set_keep_alive(0);
+  http_buffer_detach();
+  /* Only now, the handler may end the connection */
+  conn->keep_alive = request->keep_alive;
+
+  conn->out_sent = 0;
+  conn->write_start = metrics_now_us();
+  conn->state = CONN_WRITING;
+  conn_send_deadline(loop, conn);
+}
+
+/* Take the next buffered request, reading more only when none is complete */
+static void conn_read(event_loop_t *loop, conn_t *conn) {
+  struct http_request *request;
+  for (;;) {
+    int status = http_conn_parse(&conn->in, &request);
+    if (status > 0) {
+      metrics_record(METRIC_PARSE, metrics_now_us() - conn->in.arrived);
+      conn_handle_request(loop, conn, request);
+      return;
+    }
+    if (status < 0) {
+      conn->state = CONN_CLOSING;
+      return;
+    }
+
+    ssize_t nread = http_conn_fill(&conn->in);
+    if (nread < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      conn_read_deadline(loop, conn);
+      return;
+    }
+    if (nread <= 0) {
+      conn->state = CONN_CLOSING;
+      return;
+    }
+  }
+}
+
+/* Send as much of the response as the socket takes. The send deadline
+ * starts over whenever some of it was taken, not on every event: bytes
+ * coming in meanwhile don't keep a stalled client around. A streamed body
+ * is produced a chunk at a time, the next once the last one is sent. */
+static void conn_write(event_loop_t *loop, conn_t *conn) {
+  int fd = conn->in.fd;
+  int progress = 0;
+  for (;;) {
+    while (conn->out_sent < conn->out.size) {
+      /* Hold the headers back if a body follows them, and a chunk if
+       * another one does: partial segments would wait on delayed ACKs */
+      int more = conn->out.file_size > 0 || conn->out.stream != NULL;
+      ssize_t nsent = send(fd, conn->out.data + conn->out_sent,
+          conn->out.size - conn->out_sent, MSG_NOSIGNAL | (more ? MSG_MORE : 0));
+      if (nsent < 0) {
+        if (errno == EINTR) continue;
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+          if (progress) conn_send_deadline(loop, conn);
+          return;
+        }
+        conn->state = CONN_CLOSING;
+        return;
+      }
+      conn->out_sent += nsent;
+      progress = 1;
+    }
+
+    /* Then the file body, straight from the page cache */
+    while (conn->out.file_size > 0) {
+      ssize_t nsent = sendfile(fd, conn->out.file_fd, &conn->out.file_offset,
+          conn->out.file_size);
+      if (nsent < 0) {
+        if (errno == EINTR) continue;
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+          if (progress) conn_send_deadline(loop, conn);
+          return;
+        }
+        conn->state = CONN_CLOSING;
+        return;
+      }
+      if (nsent == 0) {
+        /* File shrank under us, the response can't be completed */
+        conn->state = CONN_CLOSING;
+        return;
+      }
+      conn->out.file_size -= nsent;
+      progress = 1;
+    }
+
+    if (conn->out.stream == NULL) {
+      break;
+    }
+    if (http_buffer_next_chunk(&conn->out) < 0) {
+      conn->state = CONN_CLOSING;
+      return;
+    }
+    conn->out_sent = 0;
+  }
+
+  http_buffer_free(&conn->out);
+  metrics_record(METRIC_SEND, metrics_now_us() - conn->write_start);
+  conn->state = conn->keep_alive ? CONN_READING : CONN_CLOSING;
+}
+
+static void conn_close(event_loop_t *loop, conn_t *conn) {
+  timer_wheel_remove(&loop->deadlines, &conn->deadline);
+  epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, conn->in.fd, NULL);
+  if (loop->limit != NULL) conn_limit_release(loop->limit, conn->in.fd);
+  close(conn->in.fd);
+  http_conn_free(&conn->in);
+  http_buffer_free(&conn->out);
+  free(conn);
+  metrics_count(METRIC_CLOSED, 1);
+}
+
+/* Advance the connection state machine as far as the socket allows. Reading
+ * resumes right after a response is flushed, so pipelined requests already
+ * in the buffer are answered without waiting for another edge. */
+static void conn_on_event(event_loop_t *loop, conn_t *conn, uint32_t events) {
+  if (events & EPOLLERR) {
+    conn->state = CONN_CLOSING;
+  }
+
+  for (;;) {
+    conn_state_t state = conn->state;
+    if (state == CONN_READING) {
+      conn_read(loop, conn);
+    } else if (state == CONN_WRITING) {
+      conn_write(loop, conn);
+    } else {
+      conn_close(loop, conn);
+      return;
+    }
+    if (conn->state == state) return;
+  }
+}
+
+static void conn_expire(timer_wheel_timer_t *deadline, void *event_loop) {
+  metrics_count(METRIC_TIMEOUTS, 1);
+  conn_close((event_loop_t *) event_loop, (conn_t *) deadline->data);
+}
+
+/* Close connections past their deadline, returns the epoll_wait() timeout
+ * until the wheel has to be looked at again */
+static int event_loop_expire(event_loop_t *loop) {
+  long long now = now_ms();
+  timer_wheel_advance(&loop->deadlines, now, conn_expire, loop);
+  return timer_wheel_timeout(&loop->deadlines, now);
+}
+
+/* Start NUM_LOOPS event loops on SERVER_SOCKETS and wait for them */
+int event_loop_run(int *server_sockets, int num_sockets, int num_loops,
+    conn_limit_t *limit, void (*request_handler)(int, struct http_request *)) {
+
+  if (num_loops <= 0 || num_sockets <= 0) {
+    return -1;
+  }
+
+  for (int i = 0; i < num_sockets; i++) {
+    int flags = fcntl(server_sockets[i], F_GETFL, 0);
+    if (flags < 0 || fcntl(server_sockets[i], F_SETFL, flags | O_NONBLOCK) < 0) {
+      perror("Can't make server socket non-blocking");
+      return -1;
+    }
+  }
+
+  event_loop_t *loops = calloc(num_loops, sizeof(event_loop_t));
+  if (loops == NULL) {
+    perror("Init event loops error");
+    return -1;
+  }
+
+  for (int i = 0; i < num_loops; i++) {
+    loops[i].server_socket = server_sockets[i % num_sockets];
+    loops[i].cpu = num_sockets > 1 || affinity_enabled() ? i : -1;
+    loops[i].request_handler = request_handler;
+    loops[i].limit = limit;
+    timer_wheel_init(&loops[i].deadlines, now_ms());
+    loops[i].epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (loops[i].epoll_fd < 0) {
+      perror("epoll_create1(): Error");
+      return -1;
+    }
+
+    /* Wake only one loop per incoming connection */
+    struct epoll_event event;
+    event.events = EPOLLIN | EPOLLET | EPOLLEXCLUSIVE;
+    event.data.ptr = NULL;
+    if (epoll_ctl(loops[i].epoll_fd, EPOLL_CTL_ADD, loops[i].server_socket, &event) < 0) {
+      perror("epoll_ctl(): Can't add server socket");
+      return -1;
+    }
+
+    if (pthread_create(&loops[i].thread, NULL, event_loop_routine, &loops[i]) != 0) {
+      perror("Error create event loop thread");
+      return -1;
+    }
+  }
+
+  for (int i = 0; i < num_loops; i++) {
+    pthread_join(loops[i].thread, NULL);
+  }
+  free(loops);
+  return 0;
+}
+
+static void *event_loop_routine(void *event_loop) {
+  event_loop_t *loop = (event_loop_t *) event_loop;
+  struct epoll_event events[EVENT_LOOP_MAX_EVENTS];
+
+  if (loop->cpu >= 0) {
+    listener_pin(loop->cpu);
+  }
+
+  for (;;) {
+    int timeout = event_loop_expire(loop);
+    int n = epoll_wait(loop->epoll_fd, events, EVENT_LOOP_MAX_EVENTS, timeout);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      perror("epoll_wait(): Error");
+      break;
+    }
+
+    for (int i = 0; i < n; i++) {
+      if (events[i].data.ptr == NULL) {
+        event_loop_accept(loop);
+      } else {
+        conn_on_event(loop, (conn_t *) events[i].data.ptr, events[i].events);
+      }
+    }
+  }
+
+  return NULL;
+}
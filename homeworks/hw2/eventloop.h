@@ -0,0 +1,50 @@
+#ifndef __EVENTLOOP__
+#define __EVENTLOOP__
+
+#include <pthread.h>
+
+#include "connlimit.h"
+#include "libhttp.h"
+#include "timerwheel.h"
+
+/* EVENTLOOP serves connections from non-blocking sockets with one
+ * edge-triggered epoll loop per thread, instead of a blocking worker per
+ * connection. Every loop accepts from its listening socket, shared by all
+ * the loops unless sharded, and keeps the connections it accepted. */
+
+#define EVENT_LOOP_MAX_EVENTS 256
+
+typedef enum conn_state {
+  CONN_READING,   // Waiting for the next complete request.
+  CONN_WRITING,   // Flushing the buffered response.
+  CONN_CLOSING
+} conn_state_t;
+
+typedef struct conn {
+  conn_state_t state;
+  struct http_conn in;
+  struct http_buffer out;
+  size_t out_sent;
+  int keep_alive;            // Read the next request once out is flushed.
+  long long write_start;     // Monotonic us the response was handed to out.
+  timer_wheel_timer_t deadline;   // Of the read or send it's waiting on.
+} conn_t;
+
+typedef struct event_loop {
+  int epoll_fd;
+  int server_socket;
+  int cpu;                   // Pinned to it if not -1.
+  pthread_t thread;
+  timer_wheel_t deadlines;
+  conn_limit_t *limit;       // NULL if connections aren't limited.
+  void (*request_handler)(int, struct http_request *);
+} event_loop_t;
+
+/* Runs NUM_LOOPS event loops on SERVER_SOCKETS, never returns on success.
+ * With several sockets, loop I accepts from socket I % NUM_SOCKETS and is
+ * pinned to CPU I. REQUEST_HANDLER writes its response with the libhttp
+ * send functions. Connections over LIMIT, if any, get a 503. */
+int event_loop_run(int *server_sockets, int num_sockets, int num_loops,
+    conn_limit_t *limit, void (*request_handler)(int, struct http_request *));
+
+#endif
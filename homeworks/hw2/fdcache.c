@@ -0,0 +1,184 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "fdcache.h"
+#include "utlist.h"
+
+/* FNV-1a */
+static unsigned int fd_cache_hash(const char *path) {
+  unsigned int hash = 2166136261u;
+  while (*path) {
+    hash ^= (unsigned char) *path++;
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+static fd_cache_shard_t *fd_cache_shard(fd_cache_t *cache, unsigned int hash) {
+  return &cache->shards[hash % FD_CACHE_SHARDS];
+}
+
+static fd_cache_entry_t **fd_cache_bucket(fd_cache_t *cache, fd_cache_shard_t *shard,
+    unsigned int hash) {
+  return &shard->buckets[(hash / FD_CACHE_SHARDS) % cache->num_buckets];
+}
+
+static void fd_cache_entry_free(fd_cache_entry_t *entry) {
+  close(entry->fd);
+  free(entry->path);
+  free(entry);
+}
+
+/* Drop ENTRY from its shard's hash table and LRU list, caller holds the
+ * shard's lock */
+static void fd_cache_unlink(fd_cache_t *cache, fd_cache_shard_t *shard,
+    fd_cache_entry_t *entry) {
+  fd_cache_entry_t **link = fd_cache_bucket(cache, shard, entry->hash);
+  while (*link != entry) link = &(*link)->hash_next;
+  *link = entry->hash_next;
+
+  DL_DELETE(shard->lru, entry);
+  entry->cached = 0;
+  shard->size--;
+
+  if (entry->refcount == 0) {
+    fd_cache_entry_free(entry);
+  }
+}
+
+/* The entry for PATH in its shard, caller holds the shard's lock */
+static fd_cache_entry_t *fd_cache_find(fd_cache_t *cache, fd_cache_shard_t *shard,
+    unsigned int hash, const char *path) {
+  fd_cache_entry_t *entry = *fd_cache_bucket(cache, shard, hash);
+  while (entry != NULL && (entry->hash != hash || strcmp(entry->path, path) != 0)) {
+    entry = entry->hash_next;
+  }
+  return entry;
+}
+
+int fd_cache_init(fd_cache_t *cache, int capacity) {
+  if (capacity <= 0) {
+    return -1;
+  }
+
+  int shard_capacity = (capacity + FD_CACHE_SHARDS - 1) / FD_CACHE_SHARDS;
+  cache->num_buckets = shard_capacity * 2;
+  for (int i = 0; i < FD_CACHE_SHARDS; i++) {
+    fd_cache_shard_t *shard = &cache->shards[i];
+    shard->buckets = calloc(cache->num_buckets, sizeof(fd_cache_entry_t *));
+    if (shard->buckets == NULL) {
+      perror("Init fd cache error");
+      return -1;
+    }
+    shard->lru = NULL;
+    shard->size = 0;
+    shard->capacity = shard_capacity;
+
+    if (pthread_mutex_init(&shard->lock, NULL) != 0) {
+      perror("Init fd cache lock error");
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/* Open PATH and fill in a fresh, uncached entry */
+static fd_cache_entry_t *fd_cache_open(const char *path, unsigned int hash) {
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return NULL;
+  }
+
+  fd_cache_entry_t *entry = calloc(1, sizeof(fd_cache_entry_t));
+  if (entry == NULL || fstat(fd, &entry->st) < 0 || (entry->path = strdup(path)) == NULL) {
+    close(fd);
+    free(entry);
+    return NULL;
+  }
+  entry->fd = fd;
+  entry->hash = hash;
+  entry->validated = time(NULL);
+  return entry;
+}
+
+/* PATH is still the file ENTRY has open */
+static int fd_cache_valid(fd_cache_entry_t *entry, const char *path) {
+  struct stat st;
+  return stat(path, &st) == 0 && st.st_ino == entry->st.st_ino
+      && st.st_dev == entry->st.st_dev && st.st_mtime == entry->st.st_mtime
+      && st.st_size == entry->st.st_size;
+}
+
+fd_cache_entry_t *fd_cache_get(fd_cache_t *cache, const char *path) {
+  unsigned int hash = fd_cache_hash(path);
+  fd_cache_shard_t *shard = fd_cache_shard(cache, hash);
+  time_t now = time(NULL);
+
+  pthread_mutex_lock(&shard->lock);
+  fd_cache_entry_t *entry = fd_cache_find(cache, shard, hash, path);
+  if (entry != NULL) {
+    /* Hit: move to the front of the LRU list */
+    DL_DELETE(shard->lru, entry);
+    DL_PREPEND(shard->lru, entry);
+    entry->refcount++;
+  }
+  int stale = entry != NULL && now - entry->validated >= FD_CACHE_TTL;
+  pthread_mutex_unlock(&shard->lock);
+
+  if (entry != NULL && !stale) {
+    return entry;
+  }
+
+  /* Re-validate outside the lock, holding our reference */
+  if (stale) {
+    if (fd_cache_valid(entry, path)) {
+      pthread_mutex_lock(&shard->lock);
+      entry->validated = now;
+      pthread_mutex_unlock(&shard->lock);
+      return entry;
+    }
+    pthread_mutex_lock(&shard->lock);
+    if (entry->cached) {
+      fd_cache_unlink(cache, shard, entry);
+    }
+    pthread_mutex_unlock(&shard->lock);
+    fd_cache_put(cache, entry);
+  }
+
+  /* Miss: open outside the lock, then publish unless another thread won */
+  entry = fd_cache_open(path, hash);
+  if (entry == NULL) {
+    return NULL;
+  }
+  entry->refcount = 1;
+
+  pthread_mutex_lock(&shard->lock);
+  if (fd_cache_find(cache, shard, hash, path) == NULL) {
+    if (shard->size == shard->capacity) {
+      fd_cache_unlink(cache, shard, shard->lru->prev);
+    }
+    fd_cache_entry_t **bucket = fd_cache_bucket(cache, shard, hash);
+    entry->hash_next = *bucket;
+    *bucket = entry;
+    DL_PREPEND(shard->lru, entry);
+    entry->cached = 1;
+    shard->size++;
+  }
+  pthread_mutex_unlock(&shard->lock);
+  return entry;
+}
+
+void fd_cache_put(fd_cache_t *cache, fd_cache_entry_t *entry) {
+  fd_cache_shard_t *shard = fd_cache_shard(cache, entry->hash);
+  pthread_mutex_lock(&shard->lock);
+  entry->refcount--;
+  int unused = entry->refcount == 0 && !entry->cached;
+  pthread_mutex_unlock(&shard->lock);
+
+  if (unused) {
+    fd_cache_entry_free(entry);
+  }
+}
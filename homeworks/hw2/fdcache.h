@@ -0,0 +1,57 @@
+#ifndef __FDCACHE__
+#define __FDCACHE__
+
+#include <pthread.h>
+#include <sys/stat.h>
+#include <time.h>
+
+/* FDCACHE keeps recently served files open together with their fstat()
+ * result, keyed by path, so a hit costs no open/stat/close. Entries are
+ * reference counted: an evicted entry is closed once its last user puts it
+ * back. Entries older than FD_CACHE_TTL seconds are re-validated with a
+ * stat() so replaced files are picked up.
+ *
+ * The table is split into shards, each with its own lock, LRU list and
+ * share of the capacity. The lock only guards the lookup: open() and the
+ * re-validating stat() run outside it, so a slow filesystem holds up the
+ * threads asking for that file alone. */
+
+#define FD_CACHE_CAPACITY 1024
+#define FD_CACHE_SHARDS 16
+#define FD_CACHE_TTL 2
+
+typedef struct fd_cache_entry {
+  char *path;
+  unsigned int hash;                 // Of the path, picks shard and bucket.
+  int fd;
+  struct stat st;
+  time_t validated;
+  int refcount;
+  int cached;                        // Still reachable from the cache.
+  struct fd_cache_entry *hash_next;
+  struct fd_cache_entry *next;       // LRU list, most recent first.
+  struct fd_cache_entry *prev;
+} fd_cache_entry_t;
+
+typedef struct fd_cache_shard {
+  pthread_mutex_t lock;
+  fd_cache_entry_t **buckets;
+  fd_cache_entry_t *lru;
+  int size;
+  int capacity;
+} fd_cache_shard_t;
+
+typedef struct fd_cache {
+  fd_cache_shard_t shards[FD_CACHE_SHARDS];
+  int num_buckets;                   // Per shard.
+} fd_cache_t;
+
+int fd_cache_init(fd_cache_t *cache, int capacity);
+
+/* Returns the open entry for PATH, or NULL if it can't be opened. */
+fd_cache_entry_t *fd_cache_get(fd_cache_t *cache, const char *path);
+
+/* Releases an entry returned by fd_cache_get(). */
+void fd_cache_put(fd_cache_t *cache, fd_cache_entry_t *entry);
+
+#endif
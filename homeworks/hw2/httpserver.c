@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <arpa/inet.h>
 #include <dirent.h>
 #include <errno.h>
@@ -15,37 +16,112 @@
 #include <unistd.h>
 #include <unistd.h>
 
+#include "accesslog.h"
+#include "affinity.h"
+#include "compress.h"
+#include "connlimit.h"
+#include "eventloop.h"
+#include "fdcache.h"
 #include "libhttp.h"
+#include "listener.h"
+#include "metrics.h"
+#include "pack.h"
+#include "proxy.h"
+#include "respcache.h"
 #include "threadpool.h"
+#include "uringloop.h"
 
-#define MAX_BUFF 8192
+#define MULTIRANGE_COPY_MAX (1 << 20)
 
 /*
  * Global configuration variables.
  * You need to use these in your implementation of handle_files_request and
- * handle_proxy_request. Their values are set up in main() using the
+ * serve_proxy. Their values are set up in main() using the
  * command line arguments (already implemented for you).
  */
 wq_t work_queue;
 int num_threads;
 int server_port;
 char *server_files_directory;
-char *server_proxy_hostname;
-int server_proxy_port;
-
-char buffer[MAX_BUFF];
-
-int cat(char* filename, char** result);
-int ls(char* dir, char** result);
-char* serve_directory(char* dir, char** result, int* size);
-
+char *server_pack_path;
+proxy_upstream_t server_proxy_upstreams[PROXY_MAX_UPSTREAMS];
+int server_proxy_count;
+proxy_balance_t server_proxy_balance;
+int event_loop_mode;
+int io_uring_mode;
+int work_stealing;
+thread_pool_distribution_t work_distribution;
+int max_threads;
+int queue_size = MAX_QUEUE;
+thread_pool_overload_t overload_policy = THREAD_POOL_REJECT;
+int proxy_warm = PROXY_WARM_CONNECTIONS;
+int num_listeners;
+int defer_accept;
+char *access_log_path;
+int metrics_endpoint;
+int max_connections;
+int max_client_connections;
+
+fd_cache_t file_cache;
+response_cache_t response_cache;
+int response_cache_enabled;
+conn_limit_t connection_limit;
+int connection_limit_enabled;
+int response_cache_mb = 32;
+pack_t server_pack;
+
+/* Event loops leave gzipping to this pool, see compress_later() */
+#define COMPRESS_PENDING_MAX 16
+threadpool* compress_pool;
+wq_t compress_queue;
+pthread_mutex_t compress_lock = PTHREAD_MUTEX_INITIALIZER;
+char* compress_pending[COMPRESS_PENDING_MAX];   // Keys of queued variants.
+
+void serve_directory(int fd, struct http_request* request, fd_cache_entry_t* dir);
+void serve_listing(int fd, struct http_request* request, fd_cache_entry_t* dir);
+void listing_append_entry(struct http_buffer* listing, char* name);
+int listing_produce(struct http_stream* stream, struct http_buffer* out);
+void listing_close(struct http_stream* stream);
+void serve_file(int fd, struct http_request* request, fd_cache_entry_t* file,
+    char* mime_type, char* key);
+int serve_ranges(int fd, struct http_request* request, fd_cache_entry_t* file,
+    char* mime_type, char* etag, struct http_range* ranges, int count);
+void file_validators(fd_cache_entry_t* file, char* etag, char* last_modified);
+int file_not_modified(struct http_request* request, time_t mtime, char* etag);
+int file_range_applies(struct http_request* request, time_t mtime, char* etag);
+int conditional_request(struct http_request* request);
+int accepted_codings(struct http_request* request, char* mime_type, char** codings);
+int serve_encoded(int fd, struct http_request* request, fd_cache_entry_t* file,
+    char* mime_type, char* key, char* coding);
+char* variant_key(struct http_request* request, char* coding, char* key);
+void compress_later(char* path, char* mime_type, char* key);
+void compress_variant(void* arg);
+response_cache_entry_t* cached_response(struct http_request* request);
+void serve_cached(int fd, response_cache_entry_t* entry);
+void serve_pack(int fd, struct http_request* request);
+void serve_pack_body(int fd, pack_body_t* body, off_t offset, size_t size,
+    struct http_response* response);
+void serve_metrics(int fd, struct http_request* request);
+void serve_files_request(int fd, struct http_request* request);
+void route_files_request(int fd, struct http_request* request);
+
+void http_content_headers(struct http_response* response, char* mime_type, off_t size);
+void http_validator_headers(struct http_response* response, char* etag,
+    char* last_modified);
+void http_file_headers(struct http_response* response, char* mime_type, off_t size,
+    char* etag, char* last_modified, char* coding);
+void http_response_start(struct http_response* response, int fd, int status_code,
+    char* mime_type, off_t size);
 void http200(int fd, char* message, char* mime_type, int size);
 void http404(int fd);
+void http405(int fd);
 void http500(int fd);
+void http503(int fd);
+void refuse_connection(int fd);
+void http304(int fd, char* etag, char* last_modified, char* mime_type);
+void http416(int fd, off_t size);
 
-static void* handle_proxy_routine(int is_client, struct sock_fd* sock_fd);
-static void* handle_proxy_routine_c(void* sock_fd);
-static void* handle_proxy_routine_p(void* sock_fd);
+void serve_proxy(int *server_sockets, int num_sockets);
 
 /*
  * Reads an HTTP request from stream (fd), and writes an HTTP response
@@ -59,327 +135,1094 @@ static void* handle_proxy_routine_p(void* sock_fd);
  *   4) Send a 404 Not Found response.
  */
 void handle_files_request(int fd) {
-  struct http_request *request = http_request_parse(fd);
+  struct http_conn conn;
+  struct http_request *request;
+  int keep_alive = 1;
+
+  /* Writes wait for room with a timeout then: SO_SNDTIMEO alone starts over
+   * whenever a stalled client lets a few more bytes in */
+  int flags = fcntl(fd, F_GETFL, 0);
+  if (flags >= 0) {
+    fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+  }
+
+  /* Answer requests in order until the client, the keep-alive limits or a
+   * deadline end it */
+  http_conn_init(&conn, fd);
+  /* An idle connection makes way for the sockets queued behind it */
+  conn.yield = thread_pool_backlog;
+  while (keep_alive && (request = http_conn_next_request(&conn)) != NULL) {
+    metrics_record(METRIC_PARSE, metrics_now_us() - conn.arrived);
+    keep_alive = request->keep_alive;
+    http_set_keep_alive(keep_alive);
+    serve_files_request(fd, request);
+    http_flush(fd);
+    metrics_record(METRIC_SEND, http_stats_send_us());
+    keep_alive = request->keep_alive;   // The handler may have ended it.
+
+    /* A response cut short ends the connection */
+    int send_error = http_stats_send_error();
+    if (send_error != 0) {
+      keep_alive = 0;
+      if (send_error == ETIMEDOUT) {
+        metrics_count(METRIC_TIMEOUTS, 1);
+      }
+    }
+  }
+  if (request == NULL && errno == ETIMEDOUT) {
+    metrics_count(METRIC_TIMEOUTS, 1);
+  }
+  http_set_keep_alive(0);
+  http_conn_free(&conn);
+  if (connection_limit_enabled) {
+    conn_limit_release(&connection_limit, fd);
+  }
+}
 
-  char* full_path = malloc(strlen(server_files_directory) + strlen(request->path) + 1);
-  sprintf(full_path, "%s%s", server_files_directory, request->path);
+/* Respond to an already parsed REQUEST, shared by the thread pool and the
+ * event loop, and log it */
+void serve_files_request(int fd, struct http_request* request) {
+  long long start = access_log_start();
+  long long handle_start = metrics_now_us();
+  http_stats_reset();
+
+  /* Nothing here takes a body or changes, a client sending one expects
+   * otherwise: turn it away and end the connection */
+  int head = strcmp(request->method, "HEAD") == 0;
+  if (head || strcmp(request->method, "GET") == 0) {
+    http_set_head_only(head);
+    route_files_request(fd, request);
+    http_set_head_only(0);
+  } else {
+    request->keep_alive = 0;
+    http_set_keep_alive(0);
+    http405(fd);
+  }
+  metrics_record(METRIC_HANDLE, metrics_now_us() - handle_start);
+  metrics_count(METRIC_REQUESTS, 1);
+  metrics_count(METRIC_BYTES, http_stats_bytes());
+  access_log_request(request, http_stats_status(), http_stats_bytes(), start);
+}
 
-  char* content = malloc(1);
-  int size = 0;
-  char* mime_type = serve_directory(full_path, &content, &size);
-  size = size ? size : strlen(content);
-  free(full_path);
+void route_files_request(int fd, struct http_request* request) {
+  if (metrics_endpoint && strcmp(request->path, "/metrics") == 0) {
+    serve_metrics(fd, request);
+    return;
+  }
 
-  if (content == NULL || strlen(content) == 0) {
-    http404(fd);
+  if (server_pack_path != NULL) {
+    serve_pack(fd, request);
     return;
   }
-  http200(fd, content, mime_type, size);
+
+  /* Cached responses are whole 200s, they can't answer these */
+  if (response_cache_enabled && !conditional_request(request)) {
+    response_cache_entry_t* entry = cached_response(request);
+    if (entry != NULL) {
+      serve_cached(fd, entry);
+      response_cache_put(&response_cache, entry);
+      return;
+    }
+  }
+
+  char* full_path = http_arena_printf(request->arena, "%s%s", server_files_directory,
+      request->path);
+
+  fd_cache_entry_t* file = fd_cache_get(&file_cache, full_path);
+  if (file == NULL) {
+    http404(fd);
+  } else if (S_ISDIR(file->st.st_mode)) {
+    serve_directory(fd, request, file);
+  } else {
+    serve_file(fd, request, file, http_get_mime_type(full_path), request->path);
+  }
+
+  if (file != NULL) {
+    fd_cache_put(&file_cache, file);
+  }
 }
 
 
-/* Display list files in directory, or server index.html, return mime type */
-char* serve_directory(char* dir, char** result, int* size) {
-  char* mime_type = http_get_mime_type("index.html");
+/* Send index.html if the directory has one, otherwise list files in it */
+void serve_directory(int fd, struct http_request* request, fd_cache_entry_t* dir) {
+  char* index_path = http_arena_printf(request->arena, "%s/index.html", dir->path);
+  fd_cache_entry_t* index = fd_cache_get(&file_cache, index_path);
 
-  /* If it's a file */
-  int is_dir = ls(dir, result);
-  if (is_dir == 0) {
-    *size = cat(dir, result);
-    if (*size) {
-      mime_type = http_get_mime_type(dir);
+  if (index != NULL) {
+    if (S_ISREG(index->st.st_mode)) {
+      serve_file(fd, request, index, http_get_mime_type("index.html"), request->path);
+      fd_cache_put(&file_cache, index);
+      return;
     }
-    return mime_type;
+    fd_cache_put(&file_cache, index);
   }
 
-  /* If directory contains no index.html */
-  if (strstr(*result, "index.html") == NULL) {
-    return mime_type;
+  /* Clients accepting compressed variants passed over the cached listing */
+  if (response_cache_enabled && !conditional_request(request)) {
+    response_cache_entry_t* entry = response_cache_get(&response_cache, request->path);
+    if (entry != NULL) {
+      serve_cached(fd, entry);
+      response_cache_put(&response_cache, entry);
+      return;
+    }
   }
 
-  /* If directory contains a index.html */
-  char* index = 0;
-  char* filename = malloc(strlen(server_files_directory) + strlen("index.html") + 2);
-  sprintf(filename, "%s/%s", server_files_directory, "index.html");
+  serve_listing(fd, request, dir);
+}
 
-  *size = cat(filename, &index);
-  if (*size) {
-    free(*result);
-    *result = index;
-  } else {
-    free(index);
+
+/* A listing produced as the client takes it, a chunk of entries at a time.
+ * Up to the response cache's max_rendered bytes of it are kept on the side,
+ * the whole of it is cached once complete, keyed on the directory's mtime
+ * from before it was read. */
+typedef struct listing_stream {
+  struct http_stream stream;
+  DIR* dir;
+  int started;
+  int complete;
+  int keep;
+  struct http_buffer kept;
+  struct timespec mtime;
+  char* key;
+  char path[];
+} listing_stream_t;
+
+int listing_produce(struct http_stream* stream, struct http_buffer* out) {
+  listing_stream_t* listing = (listing_stream_t*) stream;
+  size_t start = out->size;
+  if (!listing->started) {
+    http_buffer_append(out, "<h1>Index</h1>", strlen("<h1>Index</h1>"));
+    listing->started = 1;
+  }
+
+  struct dirent* de = NULL;
+  while (out->size - start < HTTP_STREAM_CHUNK_SIZE && (de = readdir(listing->dir)) != NULL) {
+    listing_append_entry(out, de->d_name);
+  }
+  listing->complete = de == NULL;
+
+  /* Too big to cache, stop holding on to it */
+  if (listing->keep && listing->kept.size + out->size - start > response_cache.max_rendered) {
+    listing->keep = 0;
+    http_buffer_free(&listing->kept);
+  }
+  if (listing->keep) {
+    http_buffer_append(&listing->kept, out->data + start, out->size - start);
   }
-  free(filename);
-  return mime_type;
+  return listing->complete ? 0 : 1;
 }
 
+void listing_close(struct http_stream* stream) {
+  listing_stream_t* listing = (listing_stream_t*) stream;
+  if (listing->keep && listing->complete) {
+    struct http_response headers;
+    http_response_init(&headers, -1, 0);
+    http_content_headers(&headers, http_get_mime_type("index.html"), listing->kept.size);
+    response_cache_insert(&response_cache, listing->key, listing->path, &listing->mtime,
+        headers.headers, headers.headers_size, listing->kept.data, listing->kept.size);
+  }
+  http_buffer_free(&listing->kept);
+  closedir(listing->dir);
+  free(listing);
+}
 
-/* Get content of filename then put to result, return file size if it's a file, 0 otherwise */
-int cat(char* filename, char** result) {
-  int length = 1 << 17; /* Max file size allowed */
-  int size = 0;
-  FILE* f = fopen(filename, "rb");
+/* List files & sub directories in DIR. HTTP/1.1 clients get the listing
+ * streamed in chunks, produced only as fast as they take them, HTTP/1.0
+ * ones all of it at once. */
+void serve_listing(int fd, struct http_request* request, fd_cache_entry_t* dir) {
+  struct stat st;
+  if (fstat(dir->fd, &st) < 0) {
+    http500(fd);
+    return;
+  }
 
-  if (f == NULL) {
-    return 0;
+  /* The stream outlives the request, it keeps its own copies */
+  size_t path_size = strlen(dir->path) + 1;
+  listing_stream_t* listing = calloc(1, sizeof(listing_stream_t) + path_size
+      + strlen(request->path) + 1);
+  if (listing == NULL) {
+    http500(fd);
+    return;
+  }
+  listing->dir = opendir(dir->path);
+  if (listing->dir == NULL) {
+    free(listing);
+    http404(fd);
+    return;
+  }
+  listing->stream.produce = listing_produce;
+  listing->stream.close = listing_close;
+  listing->keep = response_cache_enabled;
+  listing->mtime = st.st_mtim;
+  memcpy(listing->path, dir->path, path_size);
+  listing->key = listing->path + path_size;
+  strcpy(listing->key, request->path);
+  http_buffer_init(&listing->kept);
+
+  if (request->minor_version >= 1) {
+    struct http_response response;
+    http_response_init(&response, fd, 200);
+    http_response_header(&response, "Content-Type", http_get_mime_type("index.html"));
+    http_response_header(&response, "Server", "httpserver/1.0");
+    http_response_stream(&response, &listing->stream);
+    http_response_send(&response);
+    return;
   }
 
-  *result = malloc(length);
-  if (*result) {
-    size = fread(*result, 1, length, f);
+  struct http_buffer body;
+  http_buffer_init_arena(&body, request->arena);
+  while (listing_produce(&listing->stream, &body) > 0) {
   }
-  fclose(f);
-  return size;
+  http200(fd, body.data, http_get_mime_type("index.html"), body.size);
+  http_buffer_free(&body);
+  listing_close(&listing->stream);
 }
 
-/* List files & sub directories in a directory, return 1 if it's a directory, 0 otherwise */
-int ls(char* dir, char** result) {
-    struct dirent *de;
-    size_t size = 0;
+/* Append a link to NAME, escaped for both the attribute and the text */
+void listing_append_entry(struct http_buffer* listing, char* name) {
+  char escaped[6 * sizeof(((struct dirent*) 0)->d_name)];
+  size_t size = 0;
+  for (char* c = name; *c; c++) {
+    char* entity = NULL;
+    switch (*c) {
+      case '&': entity = "&amp;"; break;
+      case '<': entity = "&lt;"; break;
+      case '>': entity = "&gt;"; break;
+      case '\'': entity = "&#39;"; break;
+      case '"': entity = "&quot;"; break;
+    }
+    if (entity != NULL) {
+      memcpy(escaped + size, entity, strlen(entity));
+      size += strlen(entity);
+    } else {
+      escaped[size++] = *c;
+    }
+  }
 
-    DIR *dr = opendir(dir);
+  http_buffer_append(listing, "<a href='", strlen("<a href='"));
+  http_buffer_append(listing, escaped, size);
+  http_buffer_append(listing, "'>", strlen("'>"));
+  http_buffer_append(listing, escaped, size);
+  http_buffer_append(listing, "</a><br />", strlen("</a><br />"));
+}
 
-    if (dr == NULL) {
-      return 0;
+/* Send a regular file from its cached descriptor, the body goes out with
+ * sendfile(). Conditional requests get a 304 if the client's copy is
+ * current, Range requests the parts they ask for, and clients accepting a
+ * compressed variant get one if there is or can be one. Small whole files
+ * are also put in the response cache under KEY. */
+void serve_file(int fd, struct http_request* request, fd_cache_entry_t* file,
+    char* mime_type, char* key) {
+  char etag[64];
+  char last_modified[HTTP_DATE_SIZE];
+  file_validators(file, etag, last_modified);
+
+  /* Ranges are served from the identity, whatever the client accepts */
+  char* range = http_request_header(request, "Range");
+  if (range == NULL) {
+    char* codings[2];
+    int count = accepted_codings(request, mime_type, codings);
+    for (int i = 0; i < count; i++) {
+      if (serve_encoded(fd, request, file, mime_type, key, codings[i]) == 0) {
+        return;
+      }
     }
+  }
 
-    /* Header part */
-    char* header = "<h1>Index</h1>";
-    size = strlen(header)+1;
-    *result = realloc(*result, size);
-    strcat(*result, header);
+  if (file_not_modified(request, file->st.st_mtim.tv_sec, etag)) {
+    http304(fd, etag, last_modified, mime_type);
+    return;
+  }
 
-    char* line_template = "<a href='%s'>%s</a>";
-    char* name = malloc(1);
-    while ((de = readdir(dr)) != NULL) {
-      size += 2*(de->d_namlen)+strlen(line_template)+strlen("<br />")+1;
-      *result = realloc(*result, size);
-      if (*result == NULL) {
-        break;
+  if (range != NULL && file_range_applies(request, file->st.st_mtim.tv_sec, etag)) {
+    struct http_range ranges[HTTP_MAX_RANGES];
+    int count = http_parse_ranges(range, file->st.st_size, ranges);
+    if (count < 0) {
+      http416(fd, file->st.st_size);
+      return;
+    }
+    if (count > 0 && serve_ranges(fd, request, file, mime_type, etag, ranges, count) == 0) {
+      return;
+    }
+  }
+
+  if (response_cache_enabled) {
+    struct http_response headers;
+    http_response_init(&headers, fd, 0);
+    http_file_headers(&headers, mime_type, file->st.st_size, etag, last_modified, NULL);
+
+    response_cache_entry_t* entry = response_cache_fill(&response_cache, key, file->path,
+        headers.headers, headers.headers_size, file->fd, file->st.st_size);
+    if (entry != NULL) {
+      serve_cached(fd, entry);
+      response_cache_put(&response_cache, entry);
+      return;
+    }
+  }
+
+  struct http_response response;
+  http_response_init(&response, fd, 200);
+  http_file_headers(&response, mime_type, file->st.st_size, etag, last_modified, NULL);
+  http_response_file(&response, file->fd, 0, file->st.st_size);
+  http_response_send(&response);
+}
+
+/* Send FILE with Content-Encoding CODING: from a precompressed .br or .gz
+ * sibling no older than the file, or for gzip compressed right here. Either
+ * way the variant is cached under the coding and KEY. Returns -1 if there
+ * is no such variant worth sending. */
+int serve_encoded(int fd, struct http_request* request, fd_cache_entry_t* file,
+    char* mime_type, char* key, char* coding) {
+  int gzip = strcmp(coding, "gzip") == 0;
+  char* sibling_path = http_arena_printf(request->arena, "%s.%s", file->path,
+      gzip ? "gz" : "br");
+  fd_cache_entry_t* sibling = fd_cache_get(&file_cache, sibling_path);
+
+  if (sibling != NULL && (!S_ISREG(sibling->st.st_mode)
+      || sibling->st.st_mtim.tv_sec < file->st.st_mtim.tv_sec
+      || (sibling->st.st_mtim.tv_sec == file->st.st_mtim.tv_sec
+          && sibling->st.st_mtim.tv_nsec < file->st.st_mtim.tv_nsec))) {
+    fd_cache_put(&file_cache, sibling);
+    sibling = NULL;
+  }
+  if (sibling == NULL && (!gzip || file->st.st_size < COMPRESS_MIN_SIZE
+      || file->st.st_size > COMPRESS_MAX_SIZE)) {
+    return -1;
+  }
+
+  /* The variant's own validators: the sibling's, or the file's tagged */
+  char etag[72];
+  char last_modified[HTTP_DATE_SIZE];
+  fd_cache_entry_t* source = sibling != NULL ? sibling : file;
+  file_validators(source, etag, last_modified);
+  if (sibling == NULL) {
+    sprintf(etag + strlen(etag) - 1, "-%s\"", coding);
+  }
+  if (file_not_modified(request, source->st.st_mtim.tv_sec, etag)) {
+    http304(fd, etag, last_modified, mime_type);
+    if (sibling != NULL) fd_cache_put(&file_cache, sibling);
+    return 0;
+  }
+
+  /* An event loop can't stall its other connections on zlib: the variant
+   * is made for the cache in the background, the identity goes out now */
+  if (sibling == NULL && event_loop_mode) {
+    if (compress_pool != NULL) {
+      compress_later(file->path, mime_type, variant_key(request, coding, key));
+    }
+    return -1;
+  }
+
+  struct http_buffer compressed;
+  http_buffer_init_arena(&compressed, request->arena);
+  if (sibling == NULL && (compress_gzip(file->fd, file->st.st_size, &compressed) < 0
+      || compressed.size >= (size_t) file->st.st_size)) {
+    http_buffer_free(&compressed);
+    return -1;
+  }
+  off_t size = sibling != NULL ? sibling->st.st_size : (off_t) compressed.size;
+
+  struct http_response response;
+  http_response_init(&response, fd, 200);
+  http_file_headers(&response, mime_type, size, etag, last_modified, coding);
+
+  if (response_cache_enabled) {
+    /* The status line isn't part of a cached response */
+    struct http_response headers;
+    http_response_init(&headers, fd, 0);
+    http_file_headers(&headers, mime_type, size, etag, last_modified, coding);
+    char* cache_key = variant_key(request, coding, key);
+
+    if (sibling != NULL) {
+      response_cache_entry_t* entry = response_cache_fill(&response_cache, cache_key,
+          sibling->path, headers.headers, headers.headers_size, sibling->fd, size);
+      if (entry != NULL) {
+        serve_cached(fd, entry);
+        response_cache_put(&response_cache, entry);
+        fd_cache_put(&file_cache, sibling);
+        return 0;
       }
-      name = realloc(name, 2*(de->d_namlen)+strlen(line_template));
-      sprintf(name, line_template, de->d_name, de->d_name);
-      strcat(*result, name);
-      strcat(*result, "<br />");
+    } else {
+      response_cache_insert_file(&response_cache, cache_key, file->path, &file->st,
+          headers.headers, headers.headers_size, compressed.data, compressed.size);
     }
-    closedir(dr);
+  }
 
-    free(name);
-    return 1;
+  if (sibling != NULL) {
+    http_response_file(&response, sibling->fd, 0, size);
+    http_response_send(&response);
+    fd_cache_put(&file_cache, sibling);
+  } else {
+    http_response_body(&response, compressed.data, compressed.size);
+    http_response_send(&response);
+    http_buffer_free(&compressed);
+  }
+  return 0;
 }
 
-void http200(int fd, char* message, char* mime_type, int size) {
-  char content_length[64];
-  sprintf(content_length, "%d", size);
-  http_start_response(fd, 200);
-  http_send_header(fd, "Content-type", mime_type);
-  http_send_header(fd, "Content-Length", content_length);
-  http_send_header(fd, "Server", "httpserver/1.0");
-  http_end_headers(fd);
-  http_send_data(fd, message, size);
+typedef struct compress_job {
+  char* path;
+  char* mime_type;
+  char* key;
+} compress_job_t;
+
+/* Queues gzipping the file at PATH into the response cache under KEY,
+ * unless it is queued already or too many are */
+void compress_later(char* path, char* mime_type, char* key) {
+  int slot = -1;
+  pthread_mutex_lock(&compress_lock);
+  for (int i = 0; i < COMPRESS_PENDING_MAX; i++) {
+    if (compress_pending[i] != NULL && strcmp(compress_pending[i], key) == 0) {
+      pthread_mutex_unlock(&compress_lock);
+      return;
+    }
+    if (compress_pending[i] == NULL && slot < 0) {
+      slot = i;
+    }
+  }
+  compress_job_t* job = slot >= 0 ? malloc(sizeof(compress_job_t)) : NULL;
+  if (job != NULL) {
+    job->path = strdup(path);
+    job->mime_type = mime_type;
+    job->key = strdup(key);
+    compress_pending[slot] = job->key;
+  }
+  pthread_mutex_unlock(&compress_lock);
+
+  if (job != NULL && (job->path == NULL || job->key == NULL
+      || thread_pool_submit(compress_pool, compress_variant, job) != 0)) {
+    job->path = NULL;
+    compress_variant(job);
+  }
 }
 
-void http500(int fd) {
-  http_start_response(fd, 500);
-  http_send_header(fd, "Content-Type", "text/html");
-  http_send_header(fd, "Server", "httpserver/1.0");
-  http_end_headers(fd);
-  http_send_string(fd, "Internal server error.");
+/* Runs a job of compress_later(), or just drops it without a path */
+void compress_variant(void* arg) {
+  compress_job_t* job = (compress_job_t*) arg;
+  fd_cache_entry_t* file = job->path ? fd_cache_get(&file_cache, job->path) : NULL;
+
+  if (file != NULL && S_ISREG(file->st.st_mode) && file->st.st_size >= COMPRESS_MIN_SIZE
+      && file->st.st_size <= COMPRESS_MAX_SIZE) {
+    char etag[72];
+    char last_modified[HTTP_DATE_SIZE];
+    file_validators(file, etag, last_modified);
+    sprintf(etag + strlen(etag) - 1, "-gzip\"");
+
+    struct http_buffer compressed;
+    http_buffer_init(&compressed);
+    if (compress_gzip(file->fd, file->st.st_size, &compressed) == 0
+        && compressed.size < (size_t) file->st.st_size) {
+      struct http_response headers;
+      http_response_init(&headers, -1, 0);
+      http_file_headers(&headers, job->mime_type, compressed.size, etag, last_modified,
+          "gzip");
+      response_cache_insert_file(&response_cache, job->key, file->path, &file->st,
+          headers.headers, headers.headers_size, compressed.data, compressed.size);
+    }
+    http_buffer_free(&compressed);
+  }
+  if (file != NULL) {
+    fd_cache_put(&file_cache, file);
+  }
+
+  pthread_mutex_lock(&compress_lock);
+  for (int i = 0; i < COMPRESS_PENDING_MAX; i++) {
+    if (compress_pending[i] == job->key) {
+      compress_pending[i] = NULL;
+    }
+  }
+  pthread_mutex_unlock(&compress_lock);
+  free(job->path);
+  free(job->key);
+  free(job);
 }
 
-void http404(int fd) {
-  http_start_response(fd, 404);
-  http_send_header(fd, "Content-Type", "text/html");
-  http_send_header(fd, "Server", "httpserver/1.0");
-  http_end_headers(fd);
-  http_send_string(fd,
-      "<center>"
-      "<h1>404 - Not found!</h1>"
-      "</center>");
+/* The codings REQUEST accepts that bodies of MIME_TYPE may get, best first;
+ * brotli wins a tie, it compresses better */
+int accepted_codings(struct http_request* request, char* mime_type, char** codings) {
+  char* accept_encoding = http_request_header(request, "Accept-Encoding");
+  if (accept_encoding == NULL || !http_mime_compressible(mime_type)) {
+    return 0;
+  }
+
+  double br = http_encoding_quality(accept_encoding, "br");
+  double gzip = http_encoding_quality(accept_encoding, "gzip");
+  int count = 0;
+  if (br > 0 && br >= gzip) codings[count++] = "br";
+  if (gzip > 0) codings[count++] = "gzip";
+  if (br > 0 && br < gzip) codings[count++] = "br";
+  return count;
 }
 
+/* Compressed variants are cached as "CODING:KEY" */
+char* variant_key(struct http_request* request, char* coding, char* key) {
+  return http_arena_printf(request->arena, "%s:%s", coding, key);
+}
 
-/*
- * Opens a connection to the proxy target (hostname=server_proxy_hostname and
- * port=server_proxy_port) and relays traffic to/from the stream fd and the
- * proxy target. HTTP requests from the client (fd) should be sent to the
- * proxy target, and HTTP responses from the proxy target should be sent to
- * the client (fd).
- *
- *   +--------+     +------------+     +--------------+
- *   | client | <-> | httpserver | <-> | proxy target |
- *   +--------+     +------------+     +--------------+
- */
-void handle_proxy_request(int fd) {
+/* The cached response for REQUEST. Clients accepting a compressed variant
+ * only get one of those: the identity would keep shadowing a variant not
+ * cached yet. Listings are looked up again once known to be one. */
+response_cache_entry_t* cached_response(struct http_request* request) {
+  char* codings[2];
+  int count = accepted_codings(request, http_get_mime_type(request->path), codings);
+  if (count == 0) {
+    return response_cache_get(&response_cache, request->path);
+  }
 
-  /*
-  * The code below does a DNS lookup of server_proxy_hostname and 
-  * opens a connection to it. Please do not modify.
-  */
+  for (int i = 0; i < count; i++) {
+    char* key = variant_key(request, codings[i], request->path);
+    response_cache_entry_t* entry = response_cache_get(&response_cache, key);
+    if (entry != NULL) {
+      return entry;
+    }
+  }
+  return NULL;
+}
 
-  struct sockaddr_in target_address;
-  memset(&target_address, 0, sizeof(target_address));
-  target_address.sin_family = AF_INET;
-  target_address.sin_port = htons(server_proxy_port);
+/* Send RANGES of FILE, a single one as is, several as multipart/byteranges
+ * with a sendfile() per part. The event loop's output buffer only holds one
+ * file body, so there the parts are copied in, up to MULTIRANGE_COPY_MAX.
+ * Returns -1 if the whole file should be sent instead. */
+int serve_ranges(int fd, struct http_request* request, fd_cache_entry_t* file,
+    char* mime_type, char* etag, struct http_range* ranges, int count) {
+  char last_modified[HTTP_DATE_SIZE];
+  char content_range[96];
+  struct http_response response;
+  off_t size = file->st.st_size;
+
+  http_format_date(file->st.st_mtim.tv_sec, last_modified);
+  if (count == 1) {
+    sprintf(content_range, "bytes %lld-%lld/%lld", (long long) ranges[0].offset,
+        (long long) (ranges[0].offset + ranges[0].size - 1), (long long) size);
+    http_response_start(&response, fd, 206, mime_type, ranges[0].size);
+    http_validator_headers(&response, etag, last_modified);
+    http_response_header(&response, "Content-Range", content_range);
+    http_response_file(&response, file->fd, ranges[0].offset, ranges[0].size);
+    http_response_send(&response);
+    return 0;
+  }
 
-  struct hostent *target_dns_entry = gethostbyname2(server_proxy_hostname, AF_INET);
+  /* Part headers first, the total length goes in the response headers */
+  char boundary[40];
+  char parts[HTTP_MAX_RANGES][192];
+  char closing[64];
+  size_t part_sizes[HTTP_MAX_RANGES];
+  off_t total = 0;
+  off_t copied = 0;
+
+  sprintf(boundary, "%llx%llx", (unsigned long long) file->st.st_ino,
+      (unsigned long long) metrics_now_us());
+  for (int i = 0; i < count; i++) {
+    part_sizes[i] = snprintf(parts[i], sizeof(parts[i]),
+        "\r\n--%s\r\nContent-Type: %s\r\nContent-Range: bytes %lld-%lld/%lld\r\n\r\n",
+        boundary, mime_type, (long long) ranges[i].offset,
+        (long long) (ranges[i].offset + ranges[i].size - 1), (long long) size);
+    total += part_sizes[i] + ranges[i].size;
+    copied += ranges[i].size;
+  }
+  size_t closing_size = sprintf(closing, "\r\n--%s--\r\n", boundary);
+  total += closing_size;
 
-  int client_socket_fd = socket(PF_INET, SOCK_STREAM, 0);
-  if (client_socket_fd == -1) {
-    fprintf(stderr, "Failed to create a new socket: error %d: %s\n", errno, strerror(errno));
-    exit(errno);
+  int buffered = http_buffer_attached();
+  if (buffered && copied > MULTIRANGE_COPY_MAX) {
+    return -1;
   }
 
-  if (target_dns_entry == NULL) {
-    fprintf(stderr, "Cannot find host: %s\n", server_proxy_hostname);
-    exit(ENXIO);
+  char content_type[96];
+  sprintf(content_type, "multipart/byteranges; boundary=%s", boundary);
+  http_response_start(&response, fd, 206, content_type, total);
+  http_validator_headers(&response, etag, last_modified);
+
+  if (!buffered) {
+    for (int i = 0; i < count; i++) {
+      http_response_body(&response, parts[i], part_sizes[i]);
+      http_response_file(&response, file->fd, ranges[i].offset, ranges[i].size);
+      if (http_response_send(&response) < 0) {
+        return 0;
+      }
+    }
+    http_response_body(&response, closing, closing_size);
+    http_response_send(&response);
+    return 0;
   }
 
-  char *dns_address = target_dns_entry->h_addr_list[0];
+  struct http_buffer body;
+  http_buffer_init_arena(&body, request->arena);
+  for (int i = 0; i < count; i++) {
+    http_buffer_append(&body, parts[i], part_sizes[i]);
+    size_t start = body.size;
+    http_buffer_append(&body, NULL, ranges[i].size);
+    if (pread(file->fd, body.data + start, ranges[i].size, ranges[i].offset) != ranges[i].size) {
+      http_buffer_free(&body);
+      http500(fd);
+      return 0;
+    }
+  }
+  http_buffer_append(&body, closing, closing_size);
+  http_response_body(&response, body.data, body.size);
+  http_response_send(&response);
+  http_buffer_free(&body);
+  return 0;
+}
 
-  memcpy(&target_address.sin_addr, dns_address, sizeof(target_address.sin_addr));
-  int connection_status = connect(client_socket_fd, (struct sockaddr*) &target_address,
-      sizeof(target_address));
+/* A strong ETag from the inode, size and mtime, and Last-Modified */
+void file_validators(fd_cache_entry_t* file, char* etag, char* last_modified) {
+  sprintf(etag, "\"%llx-%llx-%llx\"", (unsigned long long) file->st.st_ino,
+      (unsigned long long) file->st.st_size,
+      (unsigned long long) file->st.st_mtim.tv_sec * 1000000000ULL + file->st.st_mtim.tv_nsec);
+  http_format_date(file->st.st_mtim.tv_sec, last_modified);
+}
 
-  if (connection_status < 0) {
-    /* Dummy request parsing, just to be compliant. */
-    http_request_parse(fd);
+/* Whether the entity tag list VALUE names ETAG, weakly compared, or is "*" */
+static int etag_list_matches(char* value, char* etag) {
+  size_t etag_size = strlen(etag);
+  char* p = value;
+  while (*p != '\0') {
+    p += strspn(p, " \t,");
+    if (*p == '*') return 1;
+    if (strncmp(p, "W/", 2) == 0) p += 2;
+    char* end = *p == '"' ? strchr(p + 1, '"') : NULL;
+    if (end == NULL) return 0;
+    end++;
+    if ((size_t) (end - p) == etag_size && strncmp(p, etag, etag_size) == 0) return 1;
+    p = end;
+  }
+  return 0;
+}
 
-    http_start_response(fd, 502);
-    http_send_header(fd, "Content-Type", "text/html");
-    http_end_headers(fd);
-    http_send_string(fd, "<center><h1>502 Bad Gateway</h1><hr></center>");
-    return;
+/* If-None-Match wins over If-Modified-Since, as RFC 7232 has it */
+int file_not_modified(struct http_request* request, time_t mtime, char* etag) {
+  char* none_match = http_request_header(request, "If-None-Match");
+  if (none_match != NULL) {
+    return etag_list_matches(none_match, etag);
+  }
+  char* modified_since = http_request_header(request, "If-Modified-Since");
+  if (modified_since != NULL) {
+    time_t since = http_parse_date(modified_since);
+    return since >= 0 && mtime <= since;
   }
+  return 0;
+}
 
-  /* Our code here */
-  pthread_t client_to_proxy_t;
-  pthread_t proxy_to_client_t;
+/* A Range is only honoured if If-Range, when sent, still names the file:
+ * the same strong ETag, or exactly its Last-Modified date */
+int file_range_applies(struct http_request* request, time_t mtime, char* etag) {
+  char* if_range = http_request_header(request, "If-Range");
+  if (if_range == NULL) {
+    return 1;
+  }
+  if (if_range[0] == '"') {
+    return strcmp(if_range, etag) == 0;
+  }
+  return http_parse_date(if_range) == mtime;
+}
 
-  struct sock_fd* s;
+int conditional_request(struct http_request* request) {
+  return http_request_header(request, "Range") != NULL
+      || http_request_header(request, "If-None-Match") != NULL
+      || http_request_header(request, "If-Modified-Since") != NULL;
+}
 
-  s = (struct sock_fd*) malloc(sizeof(struct sock_fd*));
+/* A cached response already carries everything after the status line */
+void serve_cached(int fd, response_cache_entry_t* entry) {
+  struct http_response response;
+  http_response_init(&response, fd, 200);
+  http_response_headers(&response, entry->data, entry->header_size);
+  http_response_body(&response, entry->data + entry->header_size,
+      entry->size - entry->header_size);
+  http_response_send(&response);
+}
 
-  s->p_fd = fd;
-  s->c_fd = client_socket_fd;
+/* Answer from the pack: a hash lookup, then the prebuilt headers and the
+ * body straight from the mapping, with the same variants, validators and
+ * ranges as serve_file(). Listings were rendered when packing and, like
+ * live ones, carry no validators. */
+void serve_pack(int fd, struct http_request* request) {
+  pack_entry_t* entry = pack_lookup(&server_pack, request->path, strlen(request->path));
+  if (entry == NULL) {
+    http404(fd);
+    return;
+  }
 
-  if (pthread_create(&client_to_proxy_t, NULL, handle_proxy_routine_c, (void*) s) != 0) {
-    perror("Error create client_to_proxy thread");
+  char* mime_type = pack_string(&server_pack, entry->mime_offset);
+  pack_body_t* body = &entry->bodies[PACK_IDENTITY];
+  char* range = http_request_header(request, "Range");
+  if (range == NULL) {
+    char* codings[2];
+    int count = accepted_codings(request, mime_type, codings);
+    for (int i = 0; i < count; i++) {
+      pack_body_t* variant = &entry->bodies[strcmp(codings[i], "br") == 0 ? PACK_BR : PACK_GZIP];
+      if (variant->headers_size > 0) {
+        body = variant;
+        break;
+      }
+    }
   }
 
-  if (pthread_create(&proxy_to_client_t, NULL, handle_proxy_routine_p, (void*) s) != 0) {
-    perror("Error create proxy_to_client thread");
+  char* etag = pack_string(&server_pack, body->etag_offset);
+  char* last_modified = pack_string(&server_pack, body->last_modified_offset);
+  if (!(entry->flags & PACK_LISTING)) {
+    if (file_not_modified(request, body->mtime, etag)) {
+      http304(fd, etag, last_modified, mime_type);
+      return;
+    }
+
+    /* Several ranges get the whole body, one is sent as is */
+    struct http_range ranges[HTTP_MAX_RANGES];
+    int count;
+    if (range != NULL && file_range_applies(request, body->mtime, etag)
+        && (count = http_parse_ranges(range, body->size, ranges)) != 0) {
+      if (count < 0) {
+        http416(fd, body->size);
+        return;
+      }
+      if (count == 1) {
+        char content_range[96];
+        sprintf(content_range, "bytes %lld-%lld/%lld", (long long) ranges[0].offset,
+            (long long) (ranges[0].offset + ranges[0].size - 1), (long long) body->size);
+        struct http_response response;
+        http_response_start(&response, fd, 206, mime_type, ranges[0].size);
+        http_validator_headers(&response, etag, last_modified);
+        http_response_header(&response, "Content-Range", content_range);
+        serve_pack_body(fd, body, ranges[0].offset, ranges[0].size, &response);
+        return;
+      }
+    }
   }
 
-  pthread_join(proxy_to_client_t, NULL);
-  pthread_join(client_to_proxy_t, NULL);
-  free(s);
+  /* The prebuilt headers already end with the blank line */
+  struct http_response response;
+  http_response_init(&response, fd, 200);
+  http_response_headers(&response, pack_string(&server_pack, body->headers_offset),
+      body->headers_size);
+  serve_pack_body(fd, body, 0, body->size, &response);
 }
 
-static void* handle_proxy_routine_c(void* sock) {
-  struct sock_fd *s = (struct sock_fd *) sock;
-  return handle_proxy_routine(1, s);
+/* Ends RESPONSE with SIZE bytes of BODY from OFFSET and sends it: copied
+ * from the mapping if small, with sendfile() from the pack if not */
+void serve_pack_body(int fd, pack_body_t* body, off_t offset, size_t size,
+    struct http_response* response) {
+  if (size < PACK_SENDFILE_MIN) {
+    http_response_body(response, pack_string(&server_pack, body->offset + offset), size);
+  } else {
+    http_response_file(response, server_pack.fd, body->offset + offset, size);
+  }
+  http_response_send(response);
 }
 
-static void* handle_proxy_routine_p(void* sock) {
-  struct sock_fd *s = (struct sock_fd *) sock;
-  return handle_proxy_routine(0, s);
+/* Every counter and histogram, merged across threads */
+void serve_metrics(int fd, struct http_request* request) {
+  struct http_buffer metrics;
+  http_buffer_init_arena(&metrics, request->arena);
+  metrics_render(&metrics);
+  http200(fd, metrics.data, "text/plain; version=0.0.4", metrics.size);
+  http_buffer_free(&metrics);
 }
 
+/* Start a response carrying the headers every response from us has */
+void http_response_start(struct http_response* response, int fd, int status_code,
+    char* mime_type, off_t size) {
+  http_response_init(response, fd, status_code);
+  http_content_headers(response, mime_type, size);
+}
 
-static void* handle_proxy_routine(int is_client, struct sock_fd* s) {
-  int nread;
-  int c_fd;
-  int p_fd;
+void http_content_headers(struct http_response* response, char* mime_type, off_t size) {
+  char content_length[64];
+  sprintf(content_length, "%lld", (long long) size);
+  http_response_header(response, "Content-Type", mime_type);
+  http_response_header(response, "Content-Length", content_length);
+  http_response_header(response, "Server", "httpserver/1.0");
+}
 
-  if (is_client) {
-    c_fd = s->c_fd;
-    p_fd = s->p_fd;
-  } else {
-    p_fd = s->c_fd;
-    c_fd = s->p_fd;
+/* Headers of a whole file, CODING is its Content-Encoding or NULL. Types
+ * that may be compressed vary with Accept-Encoding even when they aren't. */
+void http_file_headers(struct http_response* response, char* mime_type, off_t size,
+    char* etag, char* last_modified, char* coding) {
+  http_content_headers(response, mime_type, size);
+  http_validator_headers(response, etag, last_modified);
+  if (coding != NULL) {
+    http_response_header(response, "Content-Encoding", coding);
   }
+  if (http_mime_compressible(mime_type)) {
+    http_response_header(response, "Vary", "Accept-Encoding");
+  }
+}
 
-  do {
-    if ((nread = read(p_fd, buffer, MAX_BUFF)) < 0) {
-      perror("Can't not read");
-      break;
-    }
-    printf("Send to %d\n", c_fd);
-
-    http_send_data(c_fd, buffer, nread);
-  } while (0);
+void http_validator_headers(struct http_response* response, char* etag,
+    char* last_modified) {
+  http_response_header(response, "ETag", etag);
+  http_response_header(response, "Last-Modified", last_modified);
+  http_response_header(response, "Accept-Ranges", "bytes");
+}
 
-  return NULL;
+void http200(int fd, char* message, char* mime_type, int size) {
+  struct http_response response;
+  http_response_start(&response, fd, 200, mime_type, size);
+  http_response_body(&response, message, size);
+  http_response_send(&response);
 }
 
-/*
- * Opens a TCP stream socket on all interfaces with port number PORTNO. Saves
- * the fd number of the server socket in *socket_number. For each accepted
- * connection, calls request_handler with the accepted fd number.
- */
-void serve_forever(int *socket_number, void (*request_handler)(int)) {
+void http500(int fd) {
+  char* message = "Internal server error.";
+  struct http_response response;
+  http_response_start(&response, fd, 500, "text/html", strlen(message));
+  http_response_body(&response, message, strlen(message));
+  http_response_send(&response);
+}
 
-  struct sockaddr_in server_address, client_address;
-  size_t client_address_length = sizeof(client_address);
-  int client_socket_number;
+/* Sent to clients turned away by the thread pool when it is overloaded */
+void http503(int fd) {
+  char* message = "Server busy, try again later.";
+  struct http_response response;
+  http_response_start(&response, fd, 503, "text/html", strlen(message));
+  http_response_header(&response, "Retry-After", "1");
+  http_response_body(&response, message, strlen(message));
+  http_response_send(&response);
+}
 
-  *socket_number = socket(PF_INET, SOCK_STREAM, 0);
-  if (*socket_number == -1) {
-    perror("Failed to create a new socket");
-    exit(errno);
+/* Turn away a socket the thread pool has no room for, or one over the
+ * connection limits */
+void refuse_connection(int fd) {
+  http503(fd);
+  if (connection_limit_enabled) {
+    conn_limit_release(&connection_limit, fd);
   }
+}
 
-  int socket_option = 1;
-  if (setsockopt(*socket_number, SOL_SOCKET, SO_REUSEADDR, &socket_option,
-        sizeof(socket_option)) == -1) {
-    perror("Failed to set socket options");
-    exit(errno);
+/* The client's copy is current, only the validators go back */
+void http304(int fd, char* etag, char* last_modified, char* mime_type) {
+  struct http_response response;
+  http_response_init(&response, fd, 304);
+  http_response_header(&response, "Server", "httpserver/1.0");
+  http_validator_headers(&response, etag, last_modified);
+  if (http_mime_compressible(mime_type)) {
+    http_response_header(&response, "Vary", "Accept-Encoding");
   }
+  http_response_send(&response);
+}
 
-  memset(&server_address, 0, sizeof(server_address));
-  server_address.sin_family = AF_INET;
-  server_address.sin_addr.s_addr = INADDR_ANY;
-  server_address.sin_port = htons(server_port);
+void http416(int fd, off_t size) {
+  char content_range[64];
+  sprintf(content_range, "bytes */%lld", (long long) size);
+  struct http_response response;
+  http_response_start(&response, fd, 416, "text/html", 0);
+  http_response_header(&response, "Content-Range", content_range);
+  http_response_send(&response);
+}
 
-  if (bind(*socket_number, (struct sockaddr *) &server_address,
-        sizeof(server_address)) == -1) {
-    perror("Failed to bind on socket");
-    exit(errno);
+void http404(int fd) {
+  char* message =
+      "<center>"
+      "<h1>404 - Not found!</h1>"
+      "</center>";
+  struct http_response response;
+  http_response_start(&response, fd, 404, "text/html", strlen(message));
+  http_response_body(&response, message, strlen(message));
+  http_response_send(&response);
+}
+
+void http405(int fd) {
+  char* message = "Method not allowed.";
+  struct http_response response;
+  http_response_start(&response, fd, 405, "text/html", strlen(message));
+  http_response_header(&response, "Allow", "GET, HEAD");
+  http_response_body(&response, message, strlen(message));
+  http_response_send(&response);
+}
+
+
+/*
+ * Relays every connection accepted on SERVER_SOCKETS to one of the proxy
+ * targets (server_proxy_upstreams). HTTP requests from the client are sent to
+ * the proxy target, and HTTP responses from the proxy target are sent back to
+ * the client. Targets are looked up here, then refreshed in the background.
+ *
+ *   +--------+     +------------+     +--------------+
+ *   | client | <-> | httpserver | <-> | proxy target |
+ *   +--------+     +------------+     +--------------+
+ */
+void serve_proxy(int *server_sockets, int num_sockets) {
+  for (int i = 0; i < server_proxy_count; i++) {
+    proxy_upstream_t *upstream = &server_proxy_upstreams[i];
+    if (proxy_upstream_init(upstream, upstream->hostname, upstream->port) < 0) {
+      fprintf(stderr, "Cannot find host: %s\n", upstream->hostname);
+      exit(ENXIO);
+    }
   }
 
-  if (listen(*socket_number, 1024) == -1) {
-    perror("Failed to listen on socket");
+  /* The warm connections of a loop are shared by all the targets */
+  if (proxy_warm * server_proxy_count > PROXY_MAX_WARM) {
+    proxy_warm = PROXY_MAX_WARM / server_proxy_count;
+  }
+
+  proxy_t proxy = {
+    server_proxy_upstreams, server_proxy_count, server_proxy_balance, 0, proxy_warm
+  };
+  int num_loops = num_sockets > 1 ? num_sockets : num_threads;
+  printf("Proxying port %d to %d upstreams with %d loops...\n", server_port,
+      server_proxy_count, num_loops);
+  if (proxy_run(server_sockets, num_sockets, num_loops, &proxy) < 0) {
+    perror("Can't run proxy loops");
     exit(errno);
   }
+}
 
-  printf("Listening on port %d with %d threads...\n", server_port, num_threads);
+/*
+ * Accepts connections on SERVER_SOCKET forever and hands them to a new
+ * thread pool, using QUEUE if it is a shared-queue one.
+ */
+void accept_forever(int server_socket, wq_t *queue, void (*request_handler)(int)) {
+  int client_socket_number;
 
-  threadpool* thpool = thread_pool_init(num_threads, &work_queue, request_handler);
+  thread_pool_config_t config = {
+    num_threads, max_threads > num_threads ? max_threads : num_threads, queue_size,
+    THREAD_POOL_TARGET_LATENCY, THREAD_POOL_IDLE_TIMEOUT, overload_policy, refuse_connection
+  };
+  threadpool* thpool = work_stealing
+      ? thread_pool_init_stealing(num_threads, work_distribution, request_handler)
+      : thread_pool_init_dynamic(&config, queue, request_handler);
   if (thpool == NULL) {
     perror("Can't init threadpool");
     exit(errno);
   }
+  /* A work-stealing pool refuses too, once every inbox is full */
+  thpool->config.reject_handler = refuse_connection;
+
+  /* Pinned after starting the pool, whose workers take the CPUs in turn */
+  if (affinity_enabled() && affinity_current() < 0) {
+    listener_pin(0);
+  }
 
   while (1) {
-    client_socket_number = accept(*socket_number,
-        (struct sockaddr *) &client_address,
-        (socklen_t *) &client_address_length);
+    struct sockaddr_storage address;
+    socklen_t address_size = sizeof(address);
+    client_socket_number = accept4(server_socket, (struct sockaddr *) &address,
+        &address_size, SOCK_CLOEXEC);
     if (client_socket_number < 0) {
       perror("Error accepting socket");
       continue;
     }
 
-    printf("Accepted connection from %s on port %d\n",
-        inet_ntoa(client_address.sin_addr),
-        client_address.sin_port);
+    if (connection_limit_enabled && conn_limit_acquire(&connection_limit,
+          client_socket_number, (struct sockaddr *) &address) < 0) {
+      http503(client_socket_number);
+      close(client_socket_number);
+      metrics_count(METRIC_REFUSED, 1);
+      continue;
+    }
 
     thread_pool_add(thpool, client_socket_number);
   }
 
   thread_pool_shutdown(thpool);
-  shutdown(*socket_number, SHUT_RDWR);
-  close(*socket_number);
+}
+
+/* One listener of a sharded thread pool server */
+typedef struct shard {
+  int id;
+  int socket;
+  pthread_t thread;
+  wq_t queue;
+  void (*request_handler)(int);
+} shard_t;
+
+/* Threads inherit the affinity of their creator, so pinning the acceptor
+ * before it starts its pool keeps the whole shard on one CPU */
+static void* shard_routine(void* shard_ptr) {
+  shard_t *shard = (shard_t *) shard_ptr;
+  listener_pin(shard->id);
+  accept_forever(shard->socket, &shard->queue, shard->request_handler);
+  return NULL;
+}
+
+/*
+ * Opens TCP stream sockets on all interfaces with port number PORTNO, one
+ * unless sharded with --listeners. Saves the fd number of the first server
+ * socket in *socket_number. For each accepted connection, calls
+ * request_handler with the accepted fd number.
+ */
+void serve_forever(int *socket_number, void (*request_handler)(int)) {
+
+  int server_sockets[MAX_LISTENERS];
+  int num_sockets = num_listeners > 0 ? num_listeners : 1;
+
+  for (int i = 0; i < num_sockets; i++) {
+    server_sockets[i] = listener_open(server_port, num_listeners > 0, defer_accept);
+    if (server_sockets[i] < 0) {
+      exit(errno);
+    }
+  }
+  *socket_number = server_sockets[0];
+
+  /* Each listener gets the connections whose packets its CPU processes */
+  for (int i = 0; i < num_sockets && num_listeners > 0 && affinity_enabled(); i++) {
+    listener_steer(server_sockets[i], affinity_cpu(i));
+  }
+
+  if (server_proxy_count > 0) {
+    serve_proxy(server_sockets, num_sockets);
+  } else if (event_loop_mode) {
+    int num_loops = sysconf(_SC_NPROCESSORS_ONLN);
+    if (num_loops < 1) {
+      num_loops = 1;
+    }
+    if (num_listeners > 0) {
+      num_loops = num_listeners;
+    }
+
+    conn_limit_t *limit = connection_limit_enabled ? &connection_limit : NULL;
+    if (response_cache_enabled) {
+      compress_pool = thread_pool_init(1, &compress_queue, NULL);
+      if (compress_pool == NULL) {
+        perror("Can't start the compression thread, variants are only precompressed");
+      }
+    }
+    if (io_uring_mode) {
+      printf("Listening on port %d with %d io_uring loops...\n", server_port, num_loops);
+      if (uring_loop_run(server_sockets, num_sockets, num_loops, limit,
+          serve_files_request) == 0) {
+        return;
+      }
+      perror("Can't use io_uring, falling back to epoll");
+    }
+
+    printf("Listening on port %d with %d event loops...\n", server_port, num_loops);
+    if (event_loop_run(server_sockets, num_sockets, num_loops,
+        limit, serve_files_request) < 0) {
+      perror("Can't run event loops");
+      exit(errno);
+    }
+  } else if (num_listeners > 0) {
+    printf("Listening on port %d with %d listeners of %d threads...\n", server_port,
+        num_listeners, num_threads);
+
+    shard_t *shards = calloc(num_listeners, sizeof(shard_t));
+    if (shards == NULL) {
+      perror("Can't allocate listeners");
+      exit(ENOMEM);
+    }
+    for (int i = 0; i < num_listeners; i++) {
+      shards[i].id = i;
+      shards[i].socket = server_sockets[i];
+      shards[i].request_handler = request_handler;
+      if (pthread_create(&shards[i].thread, NULL, shard_routine, &shards[i]) != 0) {
+        perror("Error create listener thread");
+        exit(errno);
+      }
+    }
+    for (int i = 0; i < num_listeners; i++) {
+      pthread_join(shards[i].thread, NULL);
+    }
+    free(shards);
+  } else {
+    printf("Listening on port %d with %d threads...\n", server_port, num_threads);
+    accept_forever(server_sockets[0], &work_queue, request_handler);
+  }
+
+  for (int i = 0; i < num_sockets; i++) {
+    shutdown(server_sockets[i], SHUT_RDWR);
+    close(server_sockets[i]);
+  }
 }
 
 int server_fd;
@@ -390,9 +1233,20 @@ void signal_callback_handler(int signum) {
   exit(0);
 }
 
+/* SIGUSR1 switches the access log on and off */
+void access_log_signal_handler(int signum) {
+  access_log_toggle();
+}
+
 char *USAGE =
-  "Usage: ./httpserver --files www_directory/ --port 8000 [--num-threads 5]\n"
-  "       ./httpserver --proxy inst.eecs.berkeley.edu:80 --port 8000 [--num-threads 5]\n";
+  "Usage: ./httpserver --files www_directory/ | --pack site.pack --port 8000\n"
+  "                    [--num-threads 5] [--event-loop]\n"
+  "                    [--io-uring] [--cache-size 32] [--work-stealing rr|least|cpu]\n"
+  "                    [--max-threads 64] [--queue-size 65536] [--overload 503|block|shed]\n"
+  "                    [--listeners 4] [--cpus 0-3,8] [--defer-accept] [--access-log file|-]\n"
+  "                    [--metrics] [--max-connections 10000] [--max-client-connections 16]\n"
+  "       ./httpserver --proxy inst.eecs.berkeley.edu:80[,host2:port2...] --port 8000\n"
+  "                    [--num-threads 5] [--proxy-balance rr|least] [--proxy-warm 4]\n";
 
 void exit_with_usage() {
   fprintf(stderr, "%s", USAGE);
@@ -401,6 +1255,8 @@ void exit_with_usage() {
 
 int main(int argc, char **argv) {
   signal(SIGINT, signal_callback_handler);
+  /* A client gone mid-sendfile() must cost its connection, not the server */
+  signal(SIGPIPE, SIG_IGN);
 
   /* Default settings */
   server_port = 8000;
@@ -416,23 +1272,39 @@ int main(int argc, char **argv) {
         fprintf(stderr, "Expected argument after --files\n");
         exit_with_usage();
       }
+    } else if (strcmp("--pack", argv[i]) == 0) {
+      request_handler = handle_files_request;
+      server_pack_path = argv[++i];
+      if (!server_pack_path) {
+        fprintf(stderr, "Expected argument after --pack\n");
+        exit_with_usage();
+      }
     } else if (strcmp("--proxy", argv[i]) == 0) {
-      request_handler = handle_proxy_request;
-
-      char *proxy_target = argv[++i];
-      if (!proxy_target) {
+      char *proxy_targets = argv[++i];
+      if (!proxy_targets) {
         fprintf(stderr, "Expected argument after --proxy\n");
         exit_with_usage();
       }
 
-      char *colon_pointer = strchr(proxy_target, ':');
-      if (colon_pointer != NULL) {
-        *colon_pointer = '\0';
-        server_proxy_hostname = proxy_target;
-        server_proxy_port = atoi(colon_pointer + 1);
-      } else {
-        server_proxy_hostname = proxy_target;
-        server_proxy_port = 80;
+      /* HOSTNAME[:PORT], several of them separated by commas */
+      char *save_pointer;
+      char *proxy_target = strtok_r(proxy_targets, ",", &save_pointer);
+      for (server_proxy_count = 0; proxy_target != NULL; server_proxy_count++) {
+        if (server_proxy_count == PROXY_MAX_UPSTREAMS) {
+          fprintf(stderr, "At most %d targets after --proxy\n", PROXY_MAX_UPSTREAMS);
+          exit_with_usage();
+        }
+        proxy_upstream_t *upstream = &server_proxy_upstreams[server_proxy_count];
+        char *colon_pointer = strchr(proxy_target, ':');
+        if (colon_pointer != NULL) {
+          *colon_pointer = '\0';
+          upstream->hostname = proxy_target;
+          upstream->port = atoi(colon_pointer + 1);
+        } else {
+          upstream->hostname = proxy_target;
+          upstream->port = 80;
+        }
+        proxy_target = strtok_r(NULL, ",", &save_pointer);
       }
     } else if (strcmp("--port", argv[i]) == 0) {
       char *server_port_string = argv[++i];
@@ -447,6 +1319,107 @@ int main(int argc, char **argv) {
         fprintf(stderr, "Expected positive integer after --num-threads\n");
         exit_with_usage();
       }
+    } else if (strcmp("--max-threads", argv[i]) == 0) {
+      char *max_threads_str = argv[++i];
+      if (!max_threads_str || (max_threads = atoi(max_threads_str)) < 1
+          || max_threads > MAX_THREADS) {
+        fprintf(stderr, "Expected 1 to %d after --max-threads\n", MAX_THREADS);
+        exit_with_usage();
+      }
+    } else if (strcmp("--queue-size", argv[i]) == 0) {
+      char *queue_size_str = argv[++i];
+      if (!queue_size_str || (queue_size = atoi(queue_size_str)) < 1) {
+        fprintf(stderr, "Expected positive integer after --queue-size\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--overload", argv[i]) == 0) {
+      char *policy = argv[++i];
+      if (policy && strcmp(policy, "503") == 0) {
+        overload_policy = THREAD_POOL_REJECT;
+      } else if (policy && strcmp(policy, "block") == 0) {
+        overload_policy = THREAD_POOL_BLOCK;
+      } else if (policy && strcmp(policy, "shed") == 0) {
+        overload_policy = THREAD_POOL_SHED_OLDEST;
+      } else {
+        fprintf(stderr, "Expected 503, block or shed after --overload\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--cache-size", argv[i]) == 0) {
+      char *cache_size_str = argv[++i];
+      if (!cache_size_str || (response_cache_mb = atoi(cache_size_str)) < 0) {
+        fprintf(stderr, "Expected megabytes (0 disables) after --cache-size\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--work-stealing", argv[i]) == 0) {
+      char *distribution = argv[++i];
+      if (distribution && strcmp(distribution, "rr") == 0) {
+        work_distribution = THREAD_POOL_ROUND_ROBIN;
+      } else if (distribution && strcmp(distribution, "least") == 0) {
+        work_distribution = THREAD_POOL_LEAST_LOADED;
+      } else if (distribution && strcmp(distribution, "cpu") == 0) {
+        work_distribution = THREAD_POOL_INCOMING_CPU;
+      } else {
+        fprintf(stderr, "Expected rr, least or cpu after --work-stealing\n");
+        exit_with_usage();
+      }
+      work_stealing = 1;
+    } else if (strcmp("--proxy-balance", argv[i]) == 0) {
+      char *balance = argv[++i];
+      if (balance && strcmp(balance, "rr") == 0) {
+        server_proxy_balance = PROXY_ROUND_ROBIN;
+      } else if (balance && strcmp(balance, "least") == 0) {
+        server_proxy_balance = PROXY_LEAST_CONNECTIONS;
+      } else {
+        fprintf(stderr, "Expected rr or least after --proxy-balance\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--proxy-warm", argv[i]) == 0) {
+      char *proxy_warm_str = argv[++i];
+      if (!proxy_warm_str || (proxy_warm = atoi(proxy_warm_str)) < 0
+          || proxy_warm > PROXY_MAX_WARM) {
+        fprintf(stderr, "Expected 0 to %d after --proxy-warm\n", PROXY_MAX_WARM);
+        exit_with_usage();
+      }
+    } else if (strcmp("--listeners", argv[i]) == 0) {
+      char *listeners_str = argv[++i];
+      if (!listeners_str || (num_listeners = atoi(listeners_str)) < 1
+          || num_listeners > MAX_LISTENERS) {
+        fprintf(stderr, "Expected 1 to %d after --listeners\n", MAX_LISTENERS);
+        exit_with_usage();
+      }
+    } else if (strcmp("--access-log", argv[i]) == 0) {
+      access_log_path = argv[++i];
+      if (!access_log_path) {
+        fprintf(stderr, "Expected a file (or - for stdout) after --access-log\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--metrics", argv[i]) == 0) {
+      metrics_endpoint = 1;
+    } else if (strcmp("--max-connections", argv[i]) == 0) {
+      char *max_connections_str = argv[++i];
+      if (!max_connections_str || (max_connections = atoi(max_connections_str)) < 1) {
+        fprintf(stderr, "Expected positive integer after --max-connections\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--max-client-connections", argv[i]) == 0) {
+      char *max_client_str = argv[++i];
+      if (!max_client_str || (max_client_connections = atoi(max_client_str)) < 1) {
+        fprintf(stderr, "Expected positive integer after --max-client-connections\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--cpus", argv[i]) == 0) {
+      char *cpu_list = argv[++i];
+      if (!cpu_list || affinity_init(cpu_list) < 0) {
+        fprintf(stderr, "Expected a list of usable CPUs, like 0-3,8, after --cpus\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--defer-accept", argv[i]) == 0) {
+      defer_accept = 1;
+    } else if (strcmp("--event-loop", argv[i]) == 0) {
+      event_loop_mode = 1;
+    } else if (strcmp("--io-uring", argv[i]) == 0) {
+      event_loop_mode = 1;
+      io_uring_mode = 1;
     } else if (strcmp("--help", argv[i]) == 0) {
       exit_with_usage();
     } else {
@@ -459,12 +1432,52 @@ int main(int argc, char **argv) {
     num_threads = 1;
   }
 
-  if (server_files_directory == NULL && server_proxy_hostname == NULL) {
-    fprintf(stderr, "Please specify either \"--files [DIRECTORY]\" or \n"
+  if (server_files_directory == NULL && server_pack_path == NULL && server_proxy_count == 0) {
+    fprintf(stderr, "Please specify either \"--files [DIRECTORY]\", \"--pack [FILE]\" or \n"
                     "                      \"--proxy [HOSTNAME:PORT]\"\n");
     exit_with_usage();
   }
 
+  /* A pack answers without the filesystem, it needs neither cache */
+  if (server_pack_path != NULL) {
+    if (pack_open(&server_pack, server_pack_path) < 0) {
+      exit(EXIT_FAILURE);
+    }
+    server_files_directory = NULL;
+  }
+
+  if (server_files_directory != NULL && fd_cache_init(&file_cache, FD_CACHE_CAPACITY) < 0) {
+    exit(ENOMEM);
+  }
+
+  if (server_files_directory != NULL && response_cache_mb > 0) {
+    response_cache_enabled =
+        response_cache_init(&response_cache, (size_t) response_cache_mb << 20) == 0;
+  }
+
+  if (request_handler == handle_files_request
+      && (max_connections > 0 || max_client_connections > 0)) {
+    if (conn_limit_init(&connection_limit, max_connections, max_client_connections) < 0) {
+      exit(ENOMEM);
+    }
+    connection_limit_enabled = 1;
+  }
+
+  if (access_log_path != NULL) {
+    int log_fd = strcmp(access_log_path, "-") == 0 ? STDOUT_FILENO
+        : open(access_log_path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (log_fd < 0 || access_log_init(log_fd, 1) < 0) {
+      perror("Can't open access log");
+      exit(errno);
+    }
+    signal(SIGUSR1, access_log_signal_handler);
+  }
+
+  if (event_loop_mode && request_handler != handle_files_request) {
+    fprintf(stderr, "--event-loop and --io-uring are only supported with --files\n");
+    exit_with_usage();
+  }
+
   serve_forever(&server_fd, request_handler);
 
   return EXIT_SUCCESS;
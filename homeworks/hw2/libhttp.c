@@ -1,70 +1,421 @@
+#define _GNU_SOURCE
 #include <errno.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <poll.h>
 #include <string.h>
+#include <strings.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "libhttp.h"
 
-#define LIBHTTP_REQUEST_MAX_SIZE 8192
+static long long http_now_us(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
 
 void http_fatal_error(char *message) {
   fprintf(stderr, "%s\n", message);
   exit(ENOBUFS);
 }
 
+#define HTTP_ARENA_ALIGN 16
+
+struct http_arena_block {
+  struct http_arena_block *next;
+  char data[] __attribute__((aligned(HTTP_ARENA_ALIGN)));
+};
+
+void http_arena_init(struct http_arena *arena) {
+  arena->data = arena->initial;
+  arena->size = HTTP_ARENA_SIZE;
+  arena->used = 0;
+  arena->blocks = NULL;
+}
+
+void *http_arena_alloc(struct http_arena *arena, size_t size) {
+  size = (size + HTTP_ARENA_ALIGN - 1) & ~(size_t) (HTTP_ARENA_ALIGN - 1);
+  if (arena->size - arena->used < size) {
+    /* Spill into a new block, what's left of this one is wasted */
+    size_t block_size = size > HTTP_ARENA_SIZE ? size : HTTP_ARENA_SIZE;
+    struct http_arena_block *block = malloc(sizeof(struct http_arena_block) + block_size);
+    if (!block) http_fatal_error("Malloc failed");
+    block->next = arena->blocks;
+    arena->blocks = block;
+    arena->data = block->data;
+    arena->size = block_size;
+    arena->used = 0;
+  }
+
+  void *ptr = arena->data + arena->used;
+  arena->used += size;
+  return ptr;
+}
+
+void *http_arena_realloc(struct http_arena *arena, void *ptr, size_t size, size_t new_size) {
+  size_t aligned = (size + HTTP_ARENA_ALIGN - 1) & ~(size_t) (HTTP_ARENA_ALIGN - 1);
+  if (ptr != NULL && (char *) ptr + aligned == arena->data + arena->used
+      && arena->size - arena->used + aligned >= new_size) {
+    arena->used -= aligned;
+    return http_arena_alloc(arena, new_size);
+  }
+
+  void *grown = http_arena_alloc(arena, new_size);
+  if (ptr != NULL) memcpy(grown, ptr, size < new_size ? size : new_size);
+  return grown;
+}
+
+char *http_arena_printf(struct http_arena *arena, const char *format, ...) {
+  va_list args;
+  va_start(args, format);
+  int size = vsnprintf(NULL, 0, format, args);
+  va_end(args);
+
+  char *string = http_arena_alloc(arena, size + 1);
+  va_start(args, format);
+  vsnprintf(string, size + 1, format, args);
+  va_end(args);
+  return string;
+}
+
+void http_arena_reset(struct http_arena *arena) {
+  while (arena->blocks != NULL) {
+    struct http_arena_block *block = arena->blocks;
+    arena->blocks = block->next;
+    free(block);
+  }
+  arena->data = arena->initial;
+  arena->size = HTTP_ARENA_SIZE;
+  arena->used = 0;
+}
+
+/* Reads a single request from FD. The request lives in a per-thread
+ * connection buffer and stays valid until the next call on this thread. */
 struct http_request *http_request_parse(int fd) {
-  struct http_request *request = malloc(sizeof(struct http_request));
-  if (!request) http_fatal_error("Malloc failed");
+  static __thread struct http_conn conn;
+  http_conn_free(&conn);
+  http_conn_init(&conn, fd);
+  conn.timeout = -1;
+  return http_conn_next_request(&conn);
+}
+
+/* Returns 1 if the comma separated header VALUE (up to END) contains TOKEN. */
+static int http_header_has_token(char *value, char *end, char *token) {
+  size_t token_size = strlen(token);
+  while (value < end) {
+    while (value < end && (*value == ' ' || *value == '\t' || *value == ',')) value++;
+    char *token_end = value;
+    while (token_end < end && *token_end != ',') token_end++;
+    char *trimmed = token_end;
+    while (trimmed > value && (trimmed[-1] == ' ' || trimmed[-1] == '\t')) trimmed--;
+    if (trimmed - value == token_size && strncasecmp(value, token, token_size) == 0) {
+      return 1;
+    }
+    value = token_end;
+  }
+  return 0;
+}
 
-  char *read_buffer = malloc(LIBHTTP_REQUEST_MAX_SIZE + 1);
-  if (!read_buffer) http_fatal_error("Malloc failed");
+/* Parses "METHOD SP PATH [SP HTTP/1.x]" from the SIZE bytes at LINE (line
+ * feed excluded). Every part is null-terminated in place. */
+static int http_parse_request_line(struct http_request *request, char *line, size_t size) {
+  char *end = line + size;
+  if (end > line && end[-1] == '\r') end--;
 
-  int bytes_read = read(fd, read_buffer, LIBHTTP_REQUEST_MAX_SIZE);
-  read_buffer[bytes_read] = '\0'; /* Always null-terminate. */
+  /* Read in the HTTP method: "[A-Z]*" */
+  char *read_end = line;
+  while (read_end < end && *read_end >= 'A' && *read_end <= 'Z') read_end++;
+  if (read_end == line || read_end == end || *read_end != ' ') return -1;
+  request->method = line;
+  request->method_size = read_end - line;
+  *read_end++ = '\0';
 
-  char *read_start, *read_end;
-  size_t read_size;
+  /* Read in the path: "[^ ]*" */
+  char *path = read_end;
+  while (read_end < end && *read_end != ' ') read_end++;
+  if (read_end == path) return -1;
+  request->path = path;
+  request->path_size = read_end - path;
 
-  do {
-    /* Read in the HTTP method: "[A-Z]*" */
-    read_start = read_end = read_buffer;
-    while (*read_end >= 'A' && *read_end <= 'Z') read_end++;
-    read_size = read_end - read_start;
-    if (read_size == 0) break;
-    request->method = malloc(read_size + 1);
-    memcpy(request->method, read_start, read_size);
-    request->method[read_size] = '\0';
-
-    /* Read in a space character. */
-    read_start = read_end;
-    if (*read_end != ' ') break;
-    read_end++;
-
-    /* Read in the path: "[^ \n]*" */
-    read_start = read_end;
-    while (*read_end != '\0' && *read_end != ' ' && *read_end != '\n') read_end++;
-    read_size = read_end - read_start;
-    if (read_size == 0) break;
-    request->path = malloc(read_size + 1);
-    memcpy(request->path, read_start, read_size);
-    request->path[read_size] = '\0';
-
-    /* Read in HTTP version and rest of request line: ".*" */
-    read_start = read_end;
-    while (*read_end != '\0' && *read_end != '\n') read_end++;
-    if (*read_end != '\n') break;
-    read_end++;
-
-    free(read_buffer);
-    return request;
-  } while (0);
-
-  /* An error occurred. */
-  free(request);
-  free(read_buffer);
+  /* Read in the HTTP version, a bare "GET /path" is taken as HTTP/1.0 */
+  if (read_end == end) {
+    *end = '\0';
+    request->version = end;
+    request->version_size = 0;
+  } else {
+    *read_end++ = '\0';
+    request->version = read_end;
+    request->version_size = end - read_end;
+    *end = '\0';
+    if (strncmp(request->version, "HTTP/1.", 7) != 0) return -1;
+    request->minor_version = request->version[7] >= '1' ? 1 : 0;
+  }
+
+  /* HTTP/1.1 connections are persistent unless the client says otherwise */
+  request->keep_alive = request->minor_version;
+  return 0;
+}
+
+/* Parses a "Name: value" header line, keeping both null-terminated slices. */
+static int http_parse_header_line(struct http_request *request, char *line, size_t size) {
+  char *end = line + size;
+  if (end > line && end[-1] == '\r') end--;
+
+  char *colon = memchr(line, ':', end - line);
+  if (colon == NULL || colon == line || request->num_headers == HTTP_MAX_HEADERS) {
+    return -1;
+  }
+
+  char *value = colon + 1;
+  while (value < end && (*value == ' ' || *value == '\t')) value++;
+  char *value_end = end;
+  while (value_end > value && (value_end[-1] == ' ' || value_end[-1] == '\t')) value_end--;
+
+  struct http_header *header = &request->headers[request->num_headers++];
+  header->name = line;
+  header->name_size = colon - line;
+  header->value = value;
+  header->value_size = value_end - value;
+  *colon = '\0';
+  *value_end = '\0';
+
+  if (strcasecmp(header->name, "Connection") == 0) {
+    if (http_header_has_token(value, value_end, "close")) {
+      request->keep_alive = 0;
+    } else if (http_header_has_token(value, value_end, "keep-alive")) {
+      request->keep_alive = 1;
+    }
+  } else if (strcasecmp(header->name, "Content-Length") == 0) {
+    char *number_end;
+    request->content_length = strtoul(value, &number_end, 10);
+    if (number_end == value || *number_end != '\0') return -1;
+  } else if (strcasecmp(header->name, "Transfer-Encoding") == 0) {
+    /* Chunked request bodies are not supported */
+    return -1;
+  }
+  return 0;
+}
+
+/* Returns the value of header NAME (case-insensitive), or NULL. */
+char *http_request_header(struct http_request *request, char *name) {
+  for (int i = 0; i < request->num_headers; i++) {
+    if (strcasecmp(request->headers[i].name, name) == 0) {
+      return request->headers[i].value;
+    }
+  }
   return NULL;
+}
+
+/* Start parsing a new request at conn->start. */
+static void http_parser_reset(struct http_conn *conn) {
+  conn->parser.state = HTTP_PARSE_REQUEST_LINE;
+  conn->parser.offset = 0;
+  conn->parser.scan = 0;
+  memset(&conn->request, 0, offsetof(struct http_request, headers));
+}
+
+void http_conn_init(struct http_conn *conn, int fd) {
+  conn->fd = fd;
+  conn->start = 0;
+  conn->size = 0;
+  conn->requests = 0;
+  conn->max_requests = HTTP_KEEP_ALIVE_MAX;
+  conn->timeout = HTTP_KEEP_ALIVE_TIMEOUT;
+  conn->idle_since = http_now_us();
+  conn->yield = NULL;
+  http_arena_init(&conn->arena);
+  conn->request.arena = &conn->arena;
+  http_parser_reset(conn);
+}
 
+/* Releases what the connection's requests allocated, not the socket. */
+void http_conn_free(struct http_conn *conn) {
+  http_arena_reset(&conn->arena);
+}
+
+/* Moves the request being parsed to the front of the buffer. The parser
+ * keeps offsets relative to conn->start, only the slices need rebasing. */
+static void http_conn_compact(struct http_conn *conn) {
+  size_t delta = conn->start;
+  struct http_request *request = &conn->request;
+
+  memmove(conn->buffer, conn->buffer + delta, conn->size - delta);
+  conn->size -= delta;
+  conn->start = 0;
+
+  if (request->method) request->method -= delta;
+  if (request->path) request->path -= delta;
+  if (request->version) request->version -= delta;
+  for (int i = 0; i < request->num_headers; i++) {
+    request->headers[i].name -= delta;
+    request->headers[i].value -= delta;
+  }
+}
+
+/* Reads once from the connection into the free part of its buffer. Returns
+ * the number of bytes read, 0 on end of stream and -1 on error. */
+ssize_t http_conn_fill(struct http_conn *conn) {
+  if (conn->start > 0) {
+    http_conn_compact(conn);
+  }
+
+  size_t space = LIBHTTP_REQUEST_MAX_SIZE - conn->size;
+  if (space == 0) {
+    errno = ENOBUFS;
+    return -1;
+  }
+
+  ssize_t bytes_read;
+  do {
+    bytes_read = read(conn->fd, conn->buffer + conn->size, space);
+  } while (bytes_read < 0 && errno == EINTR);
+
+  if (bytes_read > 0) {
+    if (conn->size == conn->start) {
+      conn->arrived = http_now_us();
+    }
+    conn->size += bytes_read;
+  }
+  return bytes_read;
+}
+
+/* Buffers SIZE bytes read from the connection by someone else, as
+ * http_conn_fill() would have. Returns -1 if they don't all fit. */
+int http_conn_append(struct http_conn *conn, const char *data, size_t size) {
+  if (conn->start > 0 && conn->size + size > LIBHTTP_REQUEST_MAX_SIZE) {
+    http_conn_compact(conn);
+  }
+  if (conn->size + size > LIBHTTP_REQUEST_MAX_SIZE) {
+    errno = ENOBUFS;
+    return -1;
+  }
+
+  if (conn->size == conn->start) {
+    conn->arrived = http_now_us();
+  }
+  memcpy(conn->buffer + conn->size, data, size);
+  conn->size += size;
+  return 0;
+}
+
+/* Continues parsing the buffered bytes where the previous call stopped, one
+ * complete line at a time. Returns 1 and sets *REQUEST once the request
+ * (and its Content-Length body) is buffered, 0 when more data is needed and
+ * -1 when the data can't be a valid request. The request's slices point
+ * into the buffer and stay valid until the next call. */
+int http_conn_parse(struct http_conn *conn, struct http_request **request) {
+  struct http_parser *parser = &conn->parser;
+
+  if (parser->state == HTTP_PARSE_DONE) {
+    /* The previous request has been answered, drop it and its memory */
+    conn->start += parser->offset;
+    http_parser_reset(conn);
+    http_arena_reset(&conn->arena);
+    conn->idle_since = http_now_us();
+    /* A pipelined request starts when we get to it */
+    if (conn->start < conn->size) {
+      conn->arrived = http_now_us();
+    }
+  }
+  if (conn->start == conn->size) {
+    conn->start = conn->size = 0;
+  }
+
+  char *data = conn->buffer + conn->start;
+  size_t size = conn->size - conn->start;
+
+  while (parser->state != HTTP_PARSE_BODY) {
+    char *newline = memchr(data + parser->scan, '\n', size - parser->scan);
+    if (newline == NULL) {
+      parser->scan = size;
+      return size == LIBHTTP_REQUEST_MAX_SIZE ? -1 : 0;
+    }
+
+    char *line = data + parser->offset;
+    size_t line_size = newline - line;
+    int blank = line_size == 0 || (line_size == 1 && line[0] == '\r');
+    parser->offset = parser->scan = newline + 1 - data;
+
+    if (parser->state == HTTP_PARSE_REQUEST_LINE) {
+      /* Skip stray line breaks between pipelined requests */
+      if (blank) continue;
+      if (http_parse_request_line(&conn->request, line, line_size) < 0) return -1;
+      parser->state = HTTP_PARSE_HEADERS;
+    } else if (blank) {
+      parser->state = HTTP_PARSE_BODY;
+      conn->body_started = http_now_us();
+    } else if (http_parse_header_line(&conn->request, line, line_size) < 0) {
+      return -1;
+    }
+  }
+
+  size_t content_length = conn->request.content_length;
+  if (size - parser->offset < content_length) {
+    return content_length > LIBHTTP_REQUEST_MAX_SIZE - parser->offset ? -1 : 0;
+  }
+  conn->request.body = data + parser->offset;
+  conn->request.body_size = content_length;
+  parser->offset += content_length;
+  parser->state = HTTP_PARSE_DONE;
+
+  conn->requests++;
+  if (conn->requests >= conn->max_requests) {
+    conn->request.keep_alive = 0;
+  }
+  *request = &conn->request;
+  return 1;
+}
+
+long long http_conn_deadline(struct http_conn *conn) {
+  if (conn->parser.state == HTTP_PARSE_BODY) {
+    return conn->body_started + HTTP_BODY_TIMEOUT * 1000LL;
+  }
+  if (conn->size > conn->start) {
+    return conn->arrived + HTTP_HEADER_TIMEOUT * 1000LL;
+  }
+  return conn->timeout < 0 ? -1 : conn->idle_since + conn->timeout * 1000LL;
+}
+
+/* Blocks until the next request on the connection is buffered. Returns NULL
+ * when the client closes, sends garbage or misses a deadline, with errno
+ * ETIMEDOUT for the latter. While no byte of it came in, conn->yield is
+ * checked every HTTP_YIELD_INTERVAL ms and ends the wait, with errno 0. */
+struct http_request *http_conn_next_request(struct http_conn *conn) {
+  struct http_request *request;
+  for (;;) {
+    int status = http_conn_parse(conn, &request);
+    if (status > 0) return request;
+    if (status < 0) return NULL;
+
+    struct pollfd pfd = { .fd = conn->fd, .events = POLLIN };
+    int ready, sliced;
+    do {
+      int idle = conn->yield != NULL && conn->size == conn->start;
+      if (idle && conn->yield()) {
+        errno = 0;
+        return NULL;
+      }
+      long long deadline = http_conn_deadline(conn);
+      long long timeout = deadline < 0 ? -1 : (deadline - http_now_us() + 999) / 1000;
+      sliced = idle && (timeout < 0 || timeout > HTTP_YIELD_INTERVAL);
+      if (sliced) timeout = HTTP_YIELD_INTERVAL;
+      ready = timeout < 0 && deadline >= 0 ? 0 : poll(&pfd, 1, timeout);
+    } while ((ready < 0 && errno == EINTR) || (ready == 0 && sliced));
+    if (ready == 0) errno = ETIMEDOUT;
+    if (ready <= 0) return NULL;
+
+    ssize_t bytes_read = http_conn_fill(conn);
+    if (bytes_read < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) continue;
+    if (bytes_read <= 0) return NULL;
+  }
 }
 
 char* http_get_response_message(int status_code) {
@@ -73,6 +424,8 @@ char* http_get_response_message(int status_code) {
       return "Continue";
     case 200:
       return "OK";
+    case 206:
+      return "Partial Content";
     case 301:
       return "Moved Permanently";
     case 302:
@@ -89,22 +442,431 @@ char* http_get_response_message(int status_code) {
       return "Not Found";
     case 405:
       return "Method Not Allowed";
+    case 416:
+      return "Range Not Satisfiable";
+    case 503:
+      return "Service Unavailable";
     default:
       return "Internal Server Error";
   }
 }
 
+/* Buffer the calling thread's responses go to, see http_buffer_attach(). */
+static __thread struct http_buffer *attached_buffer;
+
+/* Whether the response being sent by the calling thread keeps the connection open. */
+static __thread int response_keep_alive;
+
+void http_set_keep_alive(int keep_alive) {
+  response_keep_alive = keep_alive;
+}
+
+/* Whether the response being sent by the calling thread answers a HEAD. */
+static __thread int response_head_only;
+
+void http_set_head_only(int head_only) {
+  response_head_only = head_only;
+}
+
+static __thread int stats_status;
+static __thread size_t stats_bytes;
+static __thread long long stats_send_us;
+static __thread int stats_send_error;
+
+void http_stats_reset(void) {
+  stats_status = 0;
+  stats_bytes = 0;
+  stats_send_us = 0;
+  stats_send_error = 0;
+}
+
+int http_stats_status(void) {
+  return stats_status;
+}
+
+size_t http_stats_bytes(void) {
+  return stats_bytes;
+}
+
+long long http_stats_send_us(void) {
+  return stats_send_us;
+}
+
+int http_stats_send_error(void) {
+  return stats_send_error;
+}
+
+void http_buffer_init(struct http_buffer *buffer) {
+  memset(buffer, 0, sizeof(struct http_buffer));
+  buffer->file_fd = -1;
+}
+
+void http_buffer_attach(struct http_buffer *buffer) {
+  attached_buffer = buffer;
+}
+
+void http_buffer_detach(void) {
+  attached_buffer = NULL;
+}
+
+int http_buffer_attached(void) {
+  return attached_buffer != NULL;
+}
+
+void http_buffer_init_arena(struct http_buffer *buffer, struct http_arena *arena) {
+  http_buffer_init(buffer);
+  buffer->arena = arena;
+}
+
+void http_buffer_append(struct http_buffer *buffer, char *data, size_t size) {
+  if (buffer->size + size > buffer->capacity) {
+    size_t capacity = buffer->capacity ? buffer->capacity : 1024;
+    while (capacity < buffer->size + size) capacity *= 2;
+    if (buffer->arena) {
+      buffer->data = http_arena_realloc(buffer->arena, buffer->data, buffer->capacity, capacity);
+    } else {
+      buffer->data = realloc(buffer->data, capacity);
+    }
+    if (!buffer->data) http_fatal_error("Malloc failed");
+    buffer->capacity = capacity;
+  }
+  if (data) memcpy(buffer->data + buffer->size, data, size);
+  buffer->size += size;
+}
+
+void http_buffer_free(struct http_buffer *buffer) {
+  struct http_arena *arena = buffer->arena;
+  if (!arena) free(buffer->data);
+  if (buffer->file_fd >= 0) close(buffer->file_fd);
+  if (buffer->stream) buffer->stream->close(buffer->stream);
+  http_buffer_init(buffer);
+  buffer->arena = arena;
+}
+
+/* Appends to the status line and headers, a response that overflows them
+ * is marked broken and won't be sent. */
+static void http_response_append(struct http_response *response, char *data, size_t size) {
+  if (response->headers_size + size > HTTP_RESPONSE_HEADERS_SIZE) {
+    response->error = 1;
+    return;
+  }
+  memcpy(response->headers + response->headers_size, data, size);
+  response->headers_size += size;
+}
+
+void http_response_init(struct http_response *response, int fd, int status_code) {
+  response->fd = fd;
+  response->error = 0;
+  response->terminated = 0;
+  response->headers_size = 0;
+  response->body_count = 0;
+  response->header_parts = 0;
+  response->file_fd = -1;
+  response->file_offset = 0;
+  response->file_size = 0;
+  response->stream = NULL;
+
+  if (status_code > 0) {
+    stats_status = status_code;
+    int size = snprintf(response->headers, HTTP_RESPONSE_HEADERS_SIZE,
+        "HTTP/1.1 %d %s\r\nConnection: %s\r\n", status_code,
+        http_get_response_message(status_code),
+        response_keep_alive ? "keep-alive" : "close");
+    response->headers_size = size;
+  }
+}
+
+void http_response_header(struct http_response *response, char *key, char *value) {
+  http_response_append(response, key, strlen(key));
+  http_response_append(response, ": ", 2);
+  http_response_append(response, value, strlen(value));
+  http_response_append(response, "\r\n", 2);
+}
+
+/* Adds SIZE bytes at DATA to the body. DATA is not copied and must stay
+ * valid until http_response_send(). */
+void http_response_body(struct http_response *response, char *data, size_t size) {
+  if (size == 0) return;
+  if (response->body_count == HTTP_RESPONSE_MAX_BODIES || response->file_size > 0) {
+    response->error = 1;
+    return;
+  }
+  response->body[response->body_count].iov_base = data;
+  response->body[response->body_count].iov_len = size;
+  response->body_count++;
+}
+
+void http_response_headers(struct http_response *response, char *data, size_t size) {
+  if (response->terminated || response->body_count > 0) {
+    response->error = 1;
+    return;
+  }
+  http_response_body(response, data, size);
+  response->header_parts = response->body_count;
+  response->terminated = 1;
+}
+
+/* Ends the body with SIZE bytes of FILE_FD from OFFSET, sent with sendfile(). */
+void http_response_file(struct http_response *response, int file_fd, off_t offset, size_t size) {
+  response->file_fd = file_fd;
+  response->file_offset = offset;
+  response->file_size = size;
+}
+
+void http_response_stream(struct http_response *response, struct http_stream *stream) {
+  if (response->stream != NULL || response->file_size > 0) {
+    stream->close(stream);
+    response->error = 1;
+    return;
+  }
+  http_response_header(response, "Transfer-Encoding", "chunked");
+  response->stream = stream;
+}
+
+/* Appends the next chunk of STREAM to OUT, followed by the last chunk once
+ * the stream has ended. The size line is written ahead of the data with a
+ * fixed width and filled in after. Returns 1 if more chunks follow, 0 after
+ * the last one, -1 if the stream failed. */
+#define HTTP_CHUNK_SIZE_LINE 10
+
+static int http_stream_chunk(struct http_stream *stream, struct http_buffer *out) {
+  size_t start = out->size;
+  http_buffer_append(out, NULL, HTTP_CHUNK_SIZE_LINE);
+  int status = stream->produce(stream, out);
+  if (status < 0) {
+    out->size = start;
+    return -1;
+  }
+
+  size_t size = out->size - start - HTTP_CHUNK_SIZE_LINE;
+  if (size == 0) {
+    out->size = start;
+  } else {
+    char size_line[32];
+    sprintf(size_line, "%08zx\r\n", size);
+    memcpy(out->data + start, size_line, HTTP_CHUNK_SIZE_LINE);
+    http_buffer_append(out, "\r\n", 2);
+  }
+  if (status == 0) {
+    http_buffer_append(out, "0\r\n\r\n", 5);
+  }
+  return status;
+}
+
+int http_buffer_next_chunk(struct http_buffer *buffer) {
+  buffer->size = 0;
+  struct http_stream *stream = buffer->stream;
+  int status = http_stream_chunk(stream, buffer);
+  if (status <= 0) {
+    buffer->stream = NULL;
+    stream->close(stream);
+  }
+  return status < 0 ? -1 : 0;
+}
+
+/* Waits for room on a non-blocking socket, up to the send timeout. Returns
+ * -1 with errno ETIMEDOUT if none came. */
+static int http_wait_writable(int fd) {
+  struct pollfd pfd = { .fd = fd, .events = POLLOUT };
+  int ready;
+  do {
+    ready = poll(&pfd, 1, HTTP_SEND_TIMEOUT);
+  } while (ready < 0 && errno == EINTR);
+  if (ready == 0) errno = ETIMEDOUT;
+  return ready > 0 ? 0 : -1;
+}
+
+/* Writes every iovec with as few syscalls as the socket allows. MORE tells
+ * the kernel a file body follows, so the headers aren't pushed out in a
+ * segment of their own (the per-call equivalent of TCP_CORK). */
+static int http_writev(int fd, struct iovec *iov, int count, int more) {
+  long long start = http_now_us();
+  struct msghdr message;
+  memset(&message, 0, sizeof(message));
+  message.msg_iov = iov;
+  message.msg_iovlen = count;
+
+  while (message.msg_iovlen > 0) {
+    ssize_t bytes_sent = sendmsg(fd, &message, MSG_NOSIGNAL | (more ? MSG_MORE : 0));
+    if (bytes_sent < 0 && errno == ENOTSOCK)
+      bytes_sent = writev(fd, message.msg_iov, message.msg_iovlen);
+    if (bytes_sent < 0 && errno == EINTR)
+      continue;
+    if (bytes_sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) && http_wait_writable(fd) == 0)
+      continue;
+    if (bytes_sent < 0)
+      break;
+
+    /* Skip what was written, partially written iovecs are advanced */
+    while (message.msg_iovlen > 0 && bytes_sent >= message.msg_iov->iov_len) {
+      bytes_sent -= message.msg_iov->iov_len;
+      message.msg_iov++;
+      message.msg_iovlen--;
+    }
+    if (message.msg_iovlen > 0) {
+      message.msg_iov->iov_base = (char *) message.msg_iov->iov_base + bytes_sent;
+      message.msg_iov->iov_len -= bytes_sent;
+    }
+  }
+  stats_send_us += http_now_us() - start;
+  if (message.msg_iovlen > 0 && !stats_send_error) stats_send_error = errno;
+  return message.msg_iovlen > 0 ? -1 : 0;
+}
+
+static int http_sendfile(int fd, int file_fd, off_t offset, size_t size) {
+  long long start = http_now_us();
+  ssize_t bytes_sent;
+  while (size > 0) {
+    bytes_sent = sendfile(fd, file_fd, &offset, size);
+    if (bytes_sent < 0 && errno == EINTR)
+      continue;
+    if (bytes_sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) && http_wait_writable(fd) == 0)
+      continue;
+    if (bytes_sent == 0)
+      errno = EIO;
+    if (bytes_sent <= 0)
+      break;
+    size -= bytes_sent;
+  }
+  stats_send_us += http_now_us() - start;
+  if (size > 0 && !stats_send_error) stats_send_error = errno;
+  return size > 0 ? -1 : 0;
+}
+
+/* Writes STREAM a chunk at a time, each once the last one is out, then
+ * closes it. A stream that fails can't end the body: the connection is
+ * failed like a write would. */
+static int http_send_stream(int fd, struct http_stream *stream) {
+  struct http_buffer chunk;
+  http_buffer_init(&chunk);
+  int status;
+  do {
+    chunk.size = 0;
+    status = http_stream_chunk(stream, &chunk);
+    if (status < 0 && !stats_send_error) stats_send_error = EIO;
+    if (status < 0) break;
+
+    /* Only the last chunk pushes out a segment that isn't full */
+    struct iovec iov = { .iov_base = chunk.data, .iov_len = chunk.size };
+    stats_bytes += chunk.size;
+    if (http_writev(fd, &iov, 1, status > 0) < 0) status = -1;
+  } while (status > 0);
+  http_buffer_free(&chunk);
+  stream->close(stream);
+  return status;
+}
+
+/* Sends the headers and every body part with one writev(), then the file
+ * body or the stream if there is one. A buffered response copies them into
+ * the attached buffer instead, keeping its own descriptor for the file and
+ * the stream for the connection to pull chunks from as it sends. */
+int http_response_send(struct http_response *response) {
+  struct http_stream *stream = response->stream;
+  response->stream = NULL;
+  if (response->error) {
+    if (stream != NULL) stream->close(stream);
+    return -1;
+  }
+  if (!response->terminated) {
+    http_response_append(response, "\r\n", 2);
+    response->terminated = 1;
+  }
+  if (response_head_only) {
+    response->body_count = response->header_parts;
+    response->file_size = 0;
+    if (stream != NULL) stream->close(stream);
+    stream = NULL;
+  }
+
+  struct iovec iov[HTTP_RESPONSE_MAX_BODIES + 1];
+  iov[0].iov_base = response->headers;
+  iov[0].iov_len = response->headers_size;
+  memcpy(iov + 1, response->body, response->body_count * sizeof(struct iovec));
+  int count = response->body_count + 1;
+  int status = 0;
+
+  for (int i = 0; i < count; i++) {
+    stats_bytes += iov[i].iov_len;
+  }
+  stats_bytes += response->file_size;
+
+  if (attached_buffer) {
+    for (int i = 0; i < count; i++) {
+      http_buffer_append(attached_buffer, iov[i].iov_base, iov[i].iov_len);
+    }
+    if (response->file_size > 0) {
+      if (attached_buffer->file_fd >= 0) close(attached_buffer->file_fd);
+      attached_buffer->file_fd = dup(response->file_fd);
+      attached_buffer->file_offset = response->file_offset;
+      attached_buffer->file_size = attached_buffer->file_fd >= 0 ? response->file_size : 0;
+    }
+    if (stream != NULL) {
+      if (attached_buffer->stream != NULL) attached_buffer->stream->close(attached_buffer->stream);
+      attached_buffer->stream = stream;
+    }
+  } else {
+    status = http_writev(response->fd, iov, count, response->file_size > 0 || stream != NULL);
+    if (status == 0 && response->file_size > 0) {
+      status = http_sendfile(response->fd, response->file_fd, response->file_offset,
+          response->file_size);
+    }
+    if (stream != NULL && status == 0) {
+      status = http_send_stream(response->fd, stream);
+    } else if (stream != NULL) {
+      stream->close(stream);
+    }
+  }
+
+  /* Anything added from here on goes out as a new batch */
+  response->headers_size = 0;
+  response->body_count = 0;
+  response->file_size = 0;
+  return status;
+}
+
+/*
+ * Compatibility shim: the status line and headers written with the calls
+ * below are held in a per-thread response and go out in the same writev()
+ * as the first piece of body that follows them, or on http_flush().
+ */
+static __thread struct http_response pending;
+static __thread int pending_active;
+
+void http_flush(int fd) {
+  if (!pending_active) return;
+  pending_active = 0;
+
+  /* Send exactly what the caller wrote, without a terminating blank line */
+  pending.terminated = 1;
+  http_response_send(&pending);
+}
+
+/* Starts holding output for FD, flushing whatever was held for another one */
+static void http_pending_start(int fd, int status_code) {
+  if (pending_active) {
+    http_flush(pending.fd);
+  }
+  http_response_init(&pending, fd, status_code);
+  pending_active = 1;
+}
+
 void http_start_response(int fd, int status_code) {
-  dprintf(fd, "HTTP/1.0 %d %s\r\n", status_code,
-      http_get_response_message(status_code));
+  http_pending_start(fd, status_code);
 }
 
 void http_send_header(int fd, char *key, char *value) {
-  dprintf(fd, "%s: %s\r\n", key, value);
+  if (!pending_active || pending.fd != fd) {
+    http_pending_start(fd, 0);
+  }
+  http_response_header(&pending, key, value);
 }
 
 void http_end_headers(int fd) {
-  dprintf(fd, "\r\n");
+  if (!pending_active || pending.fd != fd) {
+    http_pending_start(fd, 0);
+  }
+  http_response_append(&pending, "\r\n", 2);
+  pending.terminated = 1;
 }
 
 void http_send_string(int fd, char *data) {
@@ -112,14 +874,40 @@ void http_send_string(int fd, char *data) {
 }
 
 void http_send_data(int fd, char *data, size_t size) {
-  ssize_t bytes_sent;
-  while (size > 0) {
-    bytes_sent = write(fd, data, size);
-    if (bytes_sent < 0)
+  if (pending_active && pending.fd == fd) {
+    if (!pending.terminated) {
+      /* Still inside the headers, keep the bytes in order with them */
+      http_response_append(&pending, data, size);
       return;
-    size -= bytes_sent;
-    data += bytes_sent;
+    }
+    pending_active = 0;
+    http_response_body(&pending, data, size);
+    http_response_send(&pending);
+    return;
   }
+
+  if (response_head_only) {
+    return;
+  }
+  stats_bytes += size;
+  if (attached_buffer) {
+    http_buffer_append(attached_buffer, data, size);
+    return;
+  }
+  struct iovec iov = { .iov_base = data, .iov_len = size };
+  http_writev(fd, &iov, 1, 0);
+}
+
+/* Sends SIZE bytes of FILE_FD from OFFSET without copying them through
+ * userspace. A buffered response keeps its own descriptor for the body. */
+void http_send_file(int fd, int file_fd, off_t offset, size_t size) {
+  if (!pending_active || pending.fd != fd) {
+    http_pending_start(fd, 0);
+    pending.terminated = 1;
+  }
+  pending_active = 0;
+  http_response_file(&pending, file_fd, offset, size);
+  http_response_send(&pending);
 }
 
 char *http_get_mime_type(char *file_name) {
@@ -144,3 +932,101 @@ char *http_get_mime_type(char *file_name) {
     return "text/plain";
   }
 }
+
+int http_mime_compressible(char *mime_type) {
+  return strncmp(mime_type, "text/", 5) == 0
+      || strcmp(mime_type, "application/javascript") == 0
+      || strcmp(mime_type, "application/json") == 0
+      || strcmp(mime_type, "image/svg+xml") == 0;
+}
+
+double http_encoding_quality(char *value, char *coding) {
+  size_t coding_size = strlen(coding);
+  double wildcard = 0;
+  char *p = value;
+
+  while (*p != '\0') {
+    p += strspn(p, " \t,");
+    char *token = p;
+    size_t token_size = strcspn(p, " \t,;");
+    p += token_size;
+
+    /* An optional ;q=, anything else up to the comma is skipped */
+    double quality = 1;
+    p += strspn(p, " \t");
+    if (*p == ';') {
+      p += 1 + strspn(p + 1, " \t");
+      if (strncasecmp(p, "q=", 2) == 0) quality = strtod(p + 2, NULL);
+    }
+    p += strcspn(p, ",");
+
+    if (token_size == coding_size && strncasecmp(token, coding, coding_size) == 0) {
+      return quality;
+    }
+    if (token_size == 1 && token[0] == '*') {
+      wildcard = quality;
+    }
+  }
+  return wildcard;
+}
+
+/* Reads a decimal offset at *P, advancing it. Returns -1 if there is none. */
+static off_t http_parse_offset(char **p) {
+  off_t value = 0;
+  char *start = *p;
+  while (**p >= '0' && **p <= '9') {
+    if (value > (LLONG_MAX - 9) / 10) return -1;
+    value = value * 10 + (*(*p)++ - '0');
+  }
+  return *p == start ? -1 : value;
+}
+
+int http_parse_ranges(char *value, off_t size, struct http_range *ranges) {
+  char *p = value + strspn(value, " \t");
+  if (strncasecmp(p, "bytes=", 6) != 0) return 0;
+  p += 6;
+
+  int count = 0;
+  int specs = 0;
+  for (;;) {
+    p += strspn(p, " \t");
+    off_t first = -1, last = -1;
+    if (*p != '-' && (first = http_parse_offset(&p)) < 0) return 0;
+    if (*p++ != '-') return 0;
+    if (*p >= '0' && *p <= '9' && (last = http_parse_offset(&p)) < 0) return 0;
+    if ((first < 0 && last < 0) || (first >= 0 && last >= 0 && last < first)) return 0;
+    if (++specs > HTTP_MAX_RANGES) return 0;
+
+    /* A suffix takes the last LAST bytes, an open range runs to the end */
+    if (first < 0) {
+      first = last < size ? size - last : 0;
+      last = size - 1;
+    } else if (last < 0 || last >= size) {
+      last = size - 1;
+    }
+    if (first < size && first <= last) {
+      ranges[count].offset = first;
+      ranges[count].size = last - first + 1;
+      count++;
+    }
+
+    p += strspn(p, " \t");
+    if (*p == '\0') break;
+    if (*p++ != ',') return 0;
+  }
+  return count > 0 ? count : -1;
+}
+
+void http_format_date(time_t time, char *date) {
+  struct tm tm;
+  gmtime_r(&time, &tm);
+  strftime(date, HTTP_DATE_SIZE, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+}
+
+time_t http_parse_date(char *value) {
+  struct tm tm;
+  memset(&tm, 0, sizeof(tm));
+  char *end = strptime(value, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+  if (end == NULL || *end != '\0') return -1;
+  return timegm(&tm);
+}
@@ -20,33 +20,286 @@
 #ifndef LIBHTTP_H
 #define LIBHTTP_H
 
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <time.h>
+
+#define LIBHTTP_REQUEST_MAX_SIZE 8192
+#define HTTP_MAX_HEADERS 32
+
+/* Persistent connection defaults, see struct http_conn. */
+#define HTTP_KEEP_ALIVE_TIMEOUT 5000
+#define HTTP_KEEP_ALIVE_MAX 100
+#define HTTP_YIELD_INTERVAL 100   // ms between checks of conn->yield.
+
+/* Deadlines in ms, see http_conn_deadline(). A request's headers and body
+ * each get a fixed time however slowly they trickle in, a response may go
+ * so long without the socket taking any more of it. */
+#define HTTP_HEADER_TIMEOUT 10000
+#define HTTP_BODY_TIMEOUT 10000
+#define HTTP_SEND_TIMEOUT 10000
+
 /*
- * Functions for parsing an HTTP request.
+ * Request-scoped memory. Allocations bump a pointer through a block held by
+ * the connection, and are all dropped together when the next request on it
+ * is parsed; nothing is freed on its own. Requests that outgrow the block
+ * spill into malloc()ed ones, released by the same reset.
  */
+#define HTTP_ARENA_SIZE 2048
+
+struct http_arena_block;
+
+struct http_arena {
+  char *data;          // Block being carved up.
+  size_t size;
+  size_t used;
+  struct http_arena_block *blocks;    // Spilled blocks, newest first.
+  char initial[HTTP_ARENA_SIZE];
+};
+
+void http_arena_init(struct http_arena *arena);
+void *http_arena_alloc(struct http_arena *arena, size_t size);
+/* Grows PTR, the SIZE bytes allocated last, in place when there's room. */
+void *http_arena_realloc(struct http_arena *arena, void *ptr, size_t size, size_t new_size);
+char *http_arena_printf(struct http_arena *arena, const char *format, ...)
+    __attribute__((format(printf, 2, 3)));
+void http_arena_reset(struct http_arena *arena);
+
+/*
+ * Functions for parsing an HTTP request. Every string in a request is a
+ * slice of the connection buffer, null-terminated in place, so parsing
+ * allocates nothing.
+ */
+struct http_header {
+  char *name;
+  char *value;
+  size_t name_size;
+  size_t value_size;
+};
+
 struct http_request {
   char *method;
   char *path;
+  char *version;       // "HTTP/1.1", empty for a bare request line.
+  char *body;          // Content-Length bytes following the headers.
+  size_t method_size;
+  size_t path_size;
+  size_t version_size;
+  size_t body_size;
+  size_t content_length;
+  int minor_version;   // 0 for HTTP/1.0, 1 for HTTP/1.1.
+  int keep_alive;      // Connection stays open after the response.
+  int num_headers;
+  struct http_header headers[HTTP_MAX_HEADERS];
+  struct http_arena *arena;    // Memory for handling this request.
 };
 
 struct http_request *http_request_parse(int fd);
+char *http_request_header(struct http_request *request, char *name);
+
+/*
+ * Functions for reading requests from a persistent connection. The parser
+ * resumes where it stopped when more bytes arrive, so a request split over
+ * several reads costs no rescanning. Pipelined bytes after a request stay
+ * buffered for the next call, so requests are answered in order.
+ */
+enum http_parser_state {
+  HTTP_PARSE_REQUEST_LINE,
+  HTTP_PARSE_HEADERS,
+  HTTP_PARSE_BODY,
+  HTTP_PARSE_DONE
+};
+
+struct http_parser {
+  enum http_parser_state state;
+  size_t offset;       // Start of the next line, relative to conn->start.
+  size_t scan;         // Bytes already searched for a line feed.
+};
+
+struct http_conn {
+  int fd;
+  char buffer[LIBHTTP_REQUEST_MAX_SIZE];
+  size_t start;        // First byte of the request being parsed.
+  size_t size;         // Bytes buffered.
+  struct http_parser parser;
+  struct http_request request;
+  int requests;        // Requests taken so far.
+  int max_requests;    // The last one allowed is answered with "close".
+  int timeout;         // Idle timeout in milliseconds, -1 waits forever.
+  long long idle_since;      // Monotonic us, the previous request was answered.
+  long long arrived;   // Monotonic us when the request's first bytes came in.
+  long long body_started;    // Monotonic us, the headers were complete.
+  int (*yield)(void);  // If set, an idle connection is given up once it's nonzero.
+  struct http_arena arena;
+};
+
+void http_conn_init(struct http_conn *conn, int fd);
+void http_conn_free(struct http_conn *conn);
+ssize_t http_conn_fill(struct http_conn *conn);
+int http_conn_append(struct http_conn *conn, const char *data, size_t size);
+int http_conn_parse(struct http_conn *conn, struct http_request **request);
+struct http_request *http_conn_next_request(struct http_conn *conn);
+
+/* When the connection stops waiting for the rest of its request, in
+ * monotonic us: the keep-alive timeout while no byte of it came in, then
+ * the header and the body deadlines. -1 if it waits forever. */
+long long http_conn_deadline(struct http_conn *conn);
+
+/*
+ * Functions for building an HTTP response. The status line and headers are
+ * formatted into the struct, body parts are only referenced, and
+ * http_response_send() writes everything with a single writev() (plus a
+ * sendfile() for a file body).
+ *
+ *     struct http_response response;
+ *     http_response_init(&response, fd, 200);
+ *     http_response_header(&response, "Content-Type", "text/html");
+ *     http_response_body(&response, data, size);
+ *     http_response_send(&response);
+ */
+#define HTTP_RESPONSE_HEADERS_SIZE 2048
+#define HTTP_RESPONSE_MAX_BODIES 4
+
+struct http_buffer;
 
 /*
- * Functions for sending an HTTP response.
+ * Streamed bodies, for responses generated as they go out. The producer is
+ * only asked for the next piece once the socket has taken the last one, so
+ * a body of any size costs one chunk of memory per connection and a slow
+ * client holds its producer back. Sent with Transfer-Encoding: chunked, the
+ * request must be HTTP/1.1.
+ */
+#define HTTP_STREAM_CHUNK_SIZE 16384
+
+struct http_stream {
+  /* Appends the next piece of the body to OUT, about HTTP_STREAM_CHUNK_SIZE
+   * bytes. Returns 1 if more follows, 0 if that was the end of it, -1 if
+   * the body can't be completed (the connection is closed then). */
+  int (*produce)(struct http_stream *stream, struct http_buffer *out);
+  /* Releases the stream, whether the body was sent to the end or not */
+  void (*close)(struct http_stream *stream);
+};
+
+struct http_response {
+  int fd;
+  int error;           // Something didn't fit, the response won't be sent.
+  int terminated;      // The blank line after the headers is already in.
+  size_t headers_size;
+  int body_count;
+  int header_parts;    // Leading body parts holding prebuilt headers.
+  struct iovec body[HTTP_RESPONSE_MAX_BODIES];
+  int file_fd;         // Sent with sendfile() after the body parts.
+  off_t file_offset;
+  size_t file_size;
+  struct http_stream *stream;   // The rest of the body, after the parts.
+  char headers[HTTP_RESPONSE_HEADERS_SIZE];
+};
+
+void http_set_keep_alive(int keep_alive);
+/* While set, the calling thread answers a HEAD request: bodies are left out,
+ * the headers (Content-Length included) go out as they would for a GET. */
+void http_set_head_only(int head_only);
+void http_response_init(struct http_response *response, int fd, int status_code);
+void http_response_header(struct http_response *response, char *key, char *value);
+/* Ends the headers with SIZE bytes of prebuilt header lines at DATA, blank
+ * line included. Not copied, like a body part, but sent in HEAD answers. */
+void http_response_headers(struct http_response *response, char *data, size_t size);
+void http_response_body(struct http_response *response, char *data, size_t size);
+void http_response_file(struct http_response *response, int file_fd, off_t offset, size_t size);
+/* Ends the body with STREAM, which the response owns from here on, even if
+ * it's never sent */
+void http_response_stream(struct http_response *response, struct http_stream *stream);
+int http_response_send(struct http_response *response);
+
+/* Status of the last response the calling thread started, the bytes it
+ * sent (or buffered) and the microseconds it spent blocked writing them to
+ * the socket since the last http_stats_reset(), for logging. The send error
+ * is the errno of the first write that failed, 0 if none did. Non-blocking
+ * sockets are waited on for HTTP_SEND_TIMEOUT at most, then fail with
+ * ETIMEDOUT. */
+void http_stats_reset(void);
+int http_stats_status(void);
+size_t http_stats_bytes(void);
+long long http_stats_send_us(void);
+int http_stats_send_error(void);
+
+/*
+ * Functions for sending an HTTP response piece by piece. The headers are
+ * held until the first piece of body (or http_flush()) and then sent
+ * together with it.
  */
 void http_start_response(int fd, int status_code);
 void http_send_header(int fd, char *key, char *value);
 void http_end_headers(int fd);
 void http_send_string(int fd, char *data);
 void http_send_data(int fd, char *data, size_t size);
+void http_send_file(int fd, int file_fd, off_t offset, size_t size);
+void http_flush(int fd);
+
+/*
+ * Response buffering. While a buffer is attached to the calling thread,
+ * responses are appended to it instead of written to fd, so a non-blocking
+ * caller (the event loop) can send the response when the socket is ready.
+ */
+struct http_buffer {
+  char *data;
+  size_t size;
+  size_t capacity;
+  int file_fd;         // Body sent with sendfile() after data, -1 if none.
+  off_t file_offset;
+  size_t file_size;
+  struct http_stream *stream;   // Sent after the file, a chunk at a time.
+  struct http_arena *arena;   // Grows in it rather than with realloc(), if set.
+};
+
+void http_buffer_init(struct http_buffer *buffer);
+void http_buffer_init_arena(struct http_buffer *buffer, struct http_arena *arena);
+void http_buffer_attach(struct http_buffer *buffer);
+void http_buffer_detach(void);
+int http_buffer_attached(void);
+/* A NULL DATA only makes room for SIZE bytes at the end, to be filled in. */
+void http_buffer_append(struct http_buffer *buffer, char *data, size_t size);
+void http_buffer_free(struct http_buffer *buffer);
+/* Replaces the data of BUFFER, all sent, with the next chunk of its stream,
+ * the last chunk once the stream has ended. Returns -1 if the stream
+ * failed, the response can't be completed then. */
+int http_buffer_next_chunk(struct http_buffer *buffer);
 
 /*
  * Helper function: gets the Content-Type based on a file name.
  */
 char *http_get_mime_type(char *file_name);
 
-struct sock_fd {
-  int c_fd;
-  int p_fd;
+/* Whether bodies of MIME_TYPE are worth compressing, text is; images and
+ * PDFs already are compressed. */
+int http_mime_compressible(char *mime_type);
+
+/* The quality (0 to 1) the Accept-Encoding header VALUE gives CODING, 0 if
+ * it isn't acceptable. */
+double http_encoding_quality(char *value, char *coding);
+
+/*
+ * Byte ranges and dates, for conditional and partial responses.
+ */
+#define HTTP_MAX_RANGES 16
+#define HTTP_DATE_SIZE 32
+
+struct http_range {
+  off_t offset;
+  off_t size;
 };
 
+/* Parses the Range header VALUE for a SIZE byte body into RANGES. Returns
+ * how many ranges there are, 0 if the header is to be ignored (not bytes,
+ * malformed, or more than HTTP_MAX_RANGES of them) and -1 if none of them
+ * is satisfiable. */
+int http_parse_ranges(char *value, off_t size, struct http_range *ranges);
+
+/* Formats TIME as an HTTP-date into DATE (HTTP_DATE_SIZE bytes). */
+void http_format_date(time_t time, char *date);
+
+/* Returns the time an HTTP-date stands for, or -1. */
+time_t http_parse_date(char *value);
+
 #endif
@@ -0,0 +1,72 @@
+#define _GNU_SOURCE
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "affinity.h"
+#include "listener.h"
+
+int listener_open(int port, int reuseport, int defer_accept) {
+  struct sockaddr_in server_address;
+
+  int fd = socket(PF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd == -1) {
+    perror("Failed to create a new socket");
+    return -1;
+  }
+
+  int socket_option = 1;
+  if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &socket_option,
+        sizeof(socket_option)) == -1
+      || (reuseport && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &socket_option,
+        sizeof(socket_option)) == -1)) {
+    perror("Failed to set socket options");
+    close(fd);
+    return -1;
+  }
+
+  socket_option = LISTENER_DEFER_ACCEPT;
+  if (defer_accept && setsockopt(fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &socket_option,
+        sizeof(socket_option)) == -1) {
+    perror("Failed to set TCP_DEFER_ACCEPT");
+    close(fd);
+    return -1;
+  }
+
+  memset(&server_address, 0, sizeof(server_address));
+  server_address.sin_family = AF_INET;
+  server_address.sin_addr.s_addr = INADDR_ANY;
+  server_address.sin_port = htons(port);
+
+  if (bind(fd, (struct sockaddr *) &server_address,
+        sizeof(server_address)) == -1) {
+    perror("Failed to bind on socket");
+    close(fd);
+    return -1;
+  }
+
+  if (listen(fd, LISTENER_BACKLOG) == -1) {
+    perror("Failed to listen on socket");
+    close(fd);
+    return -1;
+  }
+
+  return fd;
+}
+
+int listener_pin(int cpu) {
+  return affinity_pin(affinity_cpu(cpu));
+}
+
+int listener_steer(int fd, int cpu) {
+  if (setsockopt(fd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, sizeof(cpu)) == -1) {
+    perror("Failed to set SO_INCOMING_CPU");
+    return -1;
+  }
+  return 0;
+}
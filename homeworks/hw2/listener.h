@@ -0,0 +1,27 @@
+#ifndef __LISTENER__
+#define __LISTENER__
+
+/* LISTENER opens the server's listening sockets. Sharded, every listener is
+ * its own socket on the same port with SO_REUSEPORT, and the kernel spreads
+ * incoming connections over them by hash; each has its own acceptor and
+ * workers, so nothing is shared between shards. */
+
+#define MAX_LISTENERS 64
+#define LISTENER_BACKLOG 1024
+#define LISTENER_DEFER_ACCEPT 5   // s a connection may wait for its request.
+
+/* Returns a socket listening on all interfaces on PORT, or -1. REUSEPORT
+ * allows more of them on the port. With DEFER_ACCEPT, connections are only
+ * accepted once their first bytes arrived. */
+int listener_open(int port, int reuseport, int defer_accept);
+
+/* Pins the calling thread to the CPU-th CPU of --cpus, or without a list to
+ * CPU modulo the online CPUs. Threads it creates afterwards inherit the
+ * affinity. */
+int listener_pin(int cpu);
+
+/* Has the kernel prefer listener FD, among those sharing its port, for
+ * connections whose packets are processed on CPU */
+int listener_steer(int fd, int cpu);
+
+#endif
@@ -0,0 +1,214 @@
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "metrics.h"
+#include "threadslots.h"
+
+static thread_slot_t thread_slots[METRICS_MAX_THREADS];
+static thread_slots_t threads = THREAD_SLOTS_INITIALIZER(thread_slots, sizeof(metrics_thread_t));
+
+static __thread metrics_thread_t *current;
+
+static const char *histogram_names[METRIC_HISTOGRAMS] = {
+  "httpserver_queue_wait_seconds",
+  "httpserver_parse_seconds",
+  "httpserver_handle_seconds",
+  "httpserver_send_seconds",
+};
+
+static const char *histogram_help[METRIC_HISTOGRAMS] = {
+  "Time from accept to a pool worker taking the connection.",
+  "Time from the first byte of a request to the whole request.",
+  "Time from a parsed request to its response written or buffered.",
+  "Time spent writing responses to the socket.",
+};
+
+static const double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+
+long long metrics_now_us(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+/* The calling thread's block, an exited thread's counts stay in the totals
+ * when it's reused */
+static metrics_thread_t *metrics_thread(void) {
+  if (current == NULL) {
+    current = thread_slots_claim(&threads);
+  }
+  return current;
+}
+
+/* Only the owner writes, a plain increment published atomically is enough */
+static void metrics_add(unsigned long *value, unsigned long n) {
+  __atomic_store_n(value, *value + n, __ATOMIC_RELAXED);
+}
+
+static int metrics_bucket(unsigned long long us) {
+  if (us < METRICS_SUB_BUCKETS) {
+    return us;
+  }
+  int exponent = 63 - __builtin_clzll(us);
+  if (exponent > 35) {
+    return METRICS_BUCKETS - 1;
+  }
+  return METRICS_SUB_BUCKETS + (exponent - 4) * METRICS_SUB_BUCKETS
+      + ((us >> (exponent - 4)) & (METRICS_SUB_BUCKETS - 1));
+}
+
+/* Values in bucket I are below this */
+static unsigned long long metrics_bucket_bound(int i) {
+  if (i < METRICS_SUB_BUCKETS) {
+    return i + 1;
+  }
+  int exponent = (i - METRICS_SUB_BUCKETS) / METRICS_SUB_BUCKETS + 4;
+  int sub_bucket = (i - METRICS_SUB_BUCKETS) % METRICS_SUB_BUCKETS;
+  return (unsigned long long) (METRICS_SUB_BUCKETS + sub_bucket + 1) << (exponent - 4);
+}
+
+void metrics_record(metric_histogram_t histogram, long long us) {
+  metrics_thread_t *block = metrics_thread();
+  if (block == NULL) {
+    return;
+  }
+  if (us < 0) {
+    us = 0;
+  }
+
+  metrics_histogram_t *h = &block->histograms[histogram];
+  metrics_add(&h->buckets[metrics_bucket(us)], 1);
+  metrics_add(&h->count, 1);
+  __atomic_store_n(&h->sum, h->sum + us, __ATOMIC_RELAXED);
+}
+
+void metrics_count(metric_counter_t counter, unsigned long n) {
+  metrics_thread_t *block = metrics_thread();
+  if (block != NULL) {
+    metrics_add(&block->counters[counter], n);
+  }
+}
+
+/* Sum every thread's blocks into COUNTERS and HISTOGRAMS */
+static void metrics_merge(unsigned long *counters, metrics_histogram_t *histograms) {
+  int count = thread_slots_count(&threads);
+  for (int i = 0; i < count; i++) {
+    metrics_thread_t *block = thread_slots_get(&threads, i);
+    if (block == NULL) {
+      continue;
+    }
+    for (int c = 0; c < METRIC_COUNTERS; c++) {
+      counters[c] += __atomic_load_n(&block->counters[c], __ATOMIC_RELAXED);
+    }
+    for (int h = 0; h < METRIC_HISTOGRAMS; h++) {
+      metrics_histogram_t *from = &block->histograms[h];
+      for (int b = 0; b < METRICS_BUCKETS; b++) {
+        histograms[h].buckets[b] += __atomic_load_n(&from->buckets[b], __ATOMIC_RELAXED);
+      }
+      histograms[h].count += __atomic_load_n(&from->count, __ATOMIC_RELAXED);
+      histograms[h].sum += __atomic_load_n(&from->sum, __ATOMIC_RELAXED);
+    }
+  }
+}
+
+static void metrics_printf(struct http_buffer *out, const char *format, ...)
+    __attribute__((format(printf, 2, 3)));
+
+static void metrics_printf(struct http_buffer *out, const char *format, ...) {
+  char line[256];
+  va_list args;
+  va_start(args, format);
+  int size = vsnprintf(line, sizeof(line), format, args);
+  va_end(args);
+  if (size > 0) {
+    http_buffer_append(out, line, size < (int) sizeof(line) ? size : (int) sizeof(line) - 1);
+  }
+}
+
+static void metrics_render_value(struct http_buffer *out, const char *name,
+    const char *type, const char *help, long long value) {
+  metrics_printf(out, "# HELP %s %s\n# TYPE %s %s\n%s %lld\n", name, help, name, type,
+      name, value);
+}
+
+/* A histogram with a bucket per power of two microseconds. Values are
+ * whole microseconds and each bucket counts those below its bound, which
+ * falls on an HDR bucket boundary, so the counts are exact. The HDR
+ * quantiles follow as a gauge. */
+static void metrics_render_histogram(struct http_buffer *out, int index,
+    metrics_histogram_t *h) {
+  const char *name = histogram_names[index];
+  unsigned long cumulative = 0;
+  int bucket = 0;
+
+  metrics_printf(out, "# HELP %s %s\n# TYPE %s histogram\n", name, histogram_help[index], name);
+  for (int power = 0; power <= 25; power++) {
+    unsigned long long bound = 1ULL << power;
+    while (bucket < METRICS_BUCKETS && metrics_bucket_bound(bucket) <= bound) {
+      cumulative += h->buckets[bucket++];
+    }
+    metrics_printf(out, "%s_bucket{le=\"%.9g\"} %lu\n", name, bound / 1e6, cumulative);
+  }
+  metrics_printf(out, "%s_bucket{le=\"+Inf\"} %lu\n", name, h->count);
+  metrics_printf(out, "%s_sum %.6f\n%s_count %lu\n", name, h->sum / 1e6, name, h->count);
+
+  metrics_printf(out, "# HELP %s_quantile %s\n# TYPE %s_quantile gauge\n", name,
+      "Quantiles of the above, to within 6%.", name);
+  for (int q = 0; q < (int) (sizeof(quantiles) / sizeof(quantiles[0])); q++) {
+    unsigned long rank = (unsigned long) (quantiles[q] * h->count + 0.999999);
+    unsigned long seen = 0;
+    unsigned long long value = 0;
+    for (int b = 0; b < METRICS_BUCKETS && h->count > 0; b++) {
+      seen += h->buckets[b];
+      if (seen >= rank) {
+        value = metrics_bucket_bound(b) - 1;
+        break;
+      }
+    }
+    metrics_printf(out, "%s_quantile{quantile=\"%g\"} %g\n", name, quantiles[q], value / 1e6);
+  }
+}
+
+void metrics_render(struct http_buffer *out) {
+  unsigned long counters[METRIC_COUNTERS];
+  metrics_histogram_t *histograms = calloc(METRIC_HISTOGRAMS, sizeof(metrics_histogram_t));
+  if (histograms == NULL) {
+    return;
+  }
+  memset(counters, 0, sizeof(counters));
+  metrics_merge(counters, histograms);
+
+  /* Blocks are read one after another, a gauge may be off for a moment */
+  long long queued = (long long) counters[METRIC_ENQUEUED] - (long long) counters[METRIC_DEQUEUED];
+  long long active = (long long) counters[METRIC_OPENED] - (long long) counters[METRIC_CLOSED];
+
+  metrics_render_value(out, "httpserver_requests_total", "counter",
+      "Requests answered.", counters[METRIC_REQUESTS]);
+  metrics_render_value(out, "httpserver_response_bytes_total", "counter",
+      "Response bytes, headers included.", counters[METRIC_BYTES]);
+  metrics_render_value(out, "httpserver_rejected_total", "counter",
+      "Connections turned away by an overloaded thread pool.", counters[METRIC_REJECTED]);
+  metrics_render_value(out, "httpserver_timeouts_total", "counter",
+      "Connections closed for missing a read or send deadline.", counters[METRIC_TIMEOUTS]);
+  metrics_render_value(out, "httpserver_refused_total", "counter",
+      "Connections refused by the global or per-client limit.", counters[METRIC_REFUSED]);
+  metrics_render_value(out, "httpserver_remote_cpu_connections_total", "counter",
+      "Connections served on another CPU than their packets are processed on.",
+      counters[METRIC_REMOTE_CPU]);
+  metrics_render_value(out, "httpserver_remote_node_connections_total", "counter",
+      "Connections served on another NUMA node than their packets are processed on.",
+      counters[METRIC_REMOTE_NODE]);
+  metrics_render_value(out, "httpserver_queue_depth", "gauge",
+      "Connections waiting for a pool worker.", queued > 0 ? queued : 0);
+  metrics_render_value(out, "httpserver_connections_active", "gauge",
+      "Connections held by a worker or event loop.", active > 0 ? active : 0);
+
+  for (int h = 0; h < METRIC_HISTOGRAMS; h++) {
+    metrics_render_histogram(out, h, &histograms[h]);
+  }
+  free(histograms);
+}
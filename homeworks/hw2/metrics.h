@@ -0,0 +1,61 @@
+#ifndef __METRICS__
+#define __METRICS__
+
+#include "libhttp.h"
+
+/* METRICS keeps latency histograms and counters per thread, so recording
+ * costs no atomic read-modify-write and no shared cache line; only the
+ * owner writes its block. They are merged when rendered.
+ *
+ * Histograms are HDR-style log-linear: exact below 16 us, then 16 buckets
+ * per power of two, so any value is off by at most 1/16 (6%) up to
+ * 2^36 us. */
+
+#define METRICS_SUB_BUCKETS 16
+#define METRICS_BUCKETS (METRICS_SUB_BUCKETS + 32 * METRICS_SUB_BUCKETS)
+#define METRICS_MAX_THREADS 256
+
+typedef enum {
+  METRIC_QUEUE_WAIT,    // Accept to dequeue by a pool worker.
+  METRIC_PARSE,         // First byte of a request to the request complete.
+  METRIC_HANDLE,        // Request to response written or buffered.
+  METRIC_SEND,          // Writing the response to the socket.
+  METRIC_HISTOGRAMS
+} metric_histogram_t;
+
+typedef enum {
+  METRIC_REQUESTS,
+  METRIC_BYTES,         // Response bytes.
+  METRIC_ENQUEUED,      // Sockets queued to a thread pool.
+  METRIC_DEQUEUED,
+  METRIC_REJECTED,      // Sockets turned away by an overloaded pool.
+  METRIC_OPENED,        // Connections being served, in a worker or loop.
+  METRIC_CLOSED,
+  METRIC_TIMEOUTS,      // Connections closed at a read or send deadline.
+  METRIC_REFUSED,       // Sockets over a connection limit.
+  METRIC_REMOTE_CPU,    // Connections served off the CPU their packets arrive on,
+  METRIC_REMOTE_NODE,   // and off its NUMA node.
+  METRIC_COUNTERS
+} metric_counter_t;
+
+typedef struct metrics_histogram {
+  unsigned long buckets[METRICS_BUCKETS];
+  unsigned long count;
+  unsigned long long sum;   // us
+} metrics_histogram_t;
+
+typedef struct metrics_thread {
+  unsigned long counters[METRIC_COUNTERS];
+  metrics_histogram_t histograms[METRIC_HISTOGRAMS];
+} metrics_thread_t;
+
+/* Microseconds on the monotonic clock. */
+long long metrics_now_us(void);
+
+void metrics_record(metric_histogram_t histogram, long long us);
+void metrics_count(metric_counter_t counter, unsigned long n);
+
+/* Appends every metric to OUT in the Prometheus text format. */
+void metrics_render(struct http_buffer *out);
+
+#endif
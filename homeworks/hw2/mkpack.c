@@ -0,0 +1,372 @@
+/*
+ * Builds a pack of a files root for httpserver --pack, see pack.h.
+ *
+ * Usage: ./mkpack www_directory/ site.pack
+ *
+ * Every regular file is packed under its request path with the headers
+ * httpserver would send for it, and with a gzip variant if its type is
+ * compressible and gzip makes it smaller; a .gz or .br sibling no older
+ * than the file is packed as that variant instead. A directory answers with
+ * its index.html, or a listing rendered here. ETags hash the content, so
+ * repacking an unchanged file keeps its ETag. The pack is written next to
+ * its final name and renamed over it, a server starting meanwhile maps
+ * either the old pack or the new one.
+ */
+
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "compress.h"
+#include "libhttp.h"
+#include "pack.h"
+
+typedef struct pack_writer {
+  int fd;
+  uint64_t offset;           // End of what's written so far.
+  pack_entry_t *entries;
+  int count;
+  int capacity;
+  uint64_t empty_string;
+} pack_writer_t;
+
+static void die(const char *message) {
+  perror(message);
+  exit(EXIT_FAILURE);
+}
+
+/* Appends SIZE bytes of DATA to the pack, returns their offset */
+static uint64_t pack_write(pack_writer_t *writer, const void *data, size_t size) {
+  uint64_t offset = writer->offset;
+  const char *p = data;
+  while (size > 0) {
+    ssize_t written = write(writer->fd, p, size);
+    if (written < 0 && errno == EINTR) continue;
+    if (written < 0) die("Can't write pack");
+    p += written;
+    size -= written;
+    writer->offset += written;
+  }
+  return offset;
+}
+
+static uint64_t pack_write_string(pack_writer_t *writer, const char *string) {
+  return pack_write(writer, string, strlen(string) + 1);
+}
+
+/* Pads the pack to the next page, for the body that follows */
+static void pack_align(pack_writer_t *writer) {
+  static const char zeros[PACK_ALIGN];
+  size_t padding = (PACK_ALIGN - writer->offset % PACK_ALIGN) % PACK_ALIGN;
+  pack_write(writer, zeros, padding);
+}
+
+static pack_entry_t *pack_add_entry(pack_writer_t *writer, const char *path, uint32_t flags,
+    const char *mime_type) {
+  if (writer->count == writer->capacity) {
+    writer->capacity = writer->capacity ? writer->capacity * 2 : 256;
+    writer->entries = realloc(writer->entries, writer->capacity * sizeof(pack_entry_t));
+    if (writer->entries == NULL) die("Can't allocate entries");
+  }
+  pack_entry_t *entry = &writer->entries[writer->count++];
+  memset(entry, 0, sizeof(pack_entry_t));
+  entry->hash = pack_hash(path, strlen(path));
+  entry->path_offset = pack_write_string(writer, path);
+  entry->path_size = strlen(path);
+  entry->flags = flags;
+  entry->mime_offset = pack_write_string(writer, mime_type);
+  return entry;
+}
+
+/* The headers httpserver's http_file_headers() sends, and the blank line */
+static void pack_file_headers(struct http_response *headers, char *mime_type, size_t size,
+    char *etag, char *last_modified, char *coding) {
+  char content_length[32];
+  sprintf(content_length, "%zu", size);
+  http_response_init(headers, -1, 0);
+  http_response_header(headers, "Content-Type", mime_type);
+  http_response_header(headers, "Content-Length", content_length);
+  http_response_header(headers, "Server", "httpserver/1.0");
+  if (etag != NULL) {
+    http_response_header(headers, "ETag", etag);
+    http_response_header(headers, "Last-Modified", last_modified);
+    http_response_header(headers, "Accept-Ranges", "bytes");
+    if (coding != NULL) {
+      http_response_header(headers, "Content-Encoding", coding);
+    }
+    if (http_mime_compressible(mime_type)) {
+      http_response_header(headers, "Vary", "Accept-Encoding");
+    }
+  }
+  memcpy(headers->headers + headers->headers_size, "\r\n", 2);
+  headers->headers_size += 2;
+  if (headers->error) {
+    fprintf(stderr, "Headers too large\n");
+    exit(EXIT_FAILURE);
+  }
+}
+
+/* Writes SIZE bytes of DATA as ENTRY's body in CODING, with its headers
+ * and validators in the gap before the page it starts on. A listing has no
+ * ETAG. */
+static void pack_add_body(pack_writer_t *writer, pack_entry_t *entry, enum pack_coding coding,
+    char *mime_type, const char *data, size_t size, char *etag, time_t mtime) {
+  static char *codings[PACK_CODINGS] = { NULL, "gzip", "br" };
+  pack_body_t *body = &entry->bodies[coding];
+  char last_modified[HTTP_DATE_SIZE];
+  http_format_date(mtime, last_modified);
+
+  struct http_response headers;
+  pack_file_headers(&headers, mime_type, size, etag, last_modified, codings[coding]);
+  body->headers_offset = pack_write(writer, headers.headers, headers.headers_size);
+  body->headers_size = headers.headers_size;
+  body->etag_offset = etag != NULL ? pack_write_string(writer, etag) : writer->empty_string;
+  body->last_modified_offset = pack_write_string(writer, last_modified);
+  body->mtime = mtime;
+
+  pack_align(writer);
+  body->offset = pack_write(writer, data, size);
+  body->size = size;
+}
+
+/* A strong ETag from the content, the same wherever and whenever packed */
+static void content_etag(const char *data, size_t size, char *etag) {
+  sprintf(etag, "\"%016llx-%zx\"", (unsigned long long) pack_hash(data, size), size);
+}
+
+/* Maps the regular file FD of SIZE bytes, an empty one to "" */
+static char *map_file(int fd, size_t size) {
+  if (size == 0) {
+    return "";
+  }
+  char *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  return data == MAP_FAILED ? NULL : data;
+}
+
+static void unmap_file(char *data, size_t size) {
+  if (size > 0) munmap(data, size);
+}
+
+/* Packs the .gz or .br sibling of the file at PATH as ENTRY's CODING, if it
+ * is no older than the file. Returns -1 if there's none. */
+static int pack_sibling(pack_writer_t *writer, pack_entry_t *entry, enum pack_coding coding,
+    char *mime_type, char *path, struct stat *file_st) {
+  char sibling_path[PATH_MAX];
+  snprintf(sibling_path, sizeof(sibling_path), "%s.%s", path, coding == PACK_GZIP ? "gz" : "br");
+  int fd = open(sibling_path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return -1;
+  }
+
+  struct stat st;
+  char *data;
+  if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)
+      || st.st_mtim.tv_sec < file_st->st_mtim.tv_sec
+      || (st.st_mtim.tv_sec == file_st->st_mtim.tv_sec
+          && st.st_mtim.tv_nsec < file_st->st_mtim.tv_nsec)
+      || (data = map_file(fd, st.st_size)) == NULL) {
+    close(fd);
+    return -1;
+  }
+
+  char etag[64];
+  content_etag(data, st.st_size, etag);
+  pack_add_body(writer, entry, coding, mime_type, data, st.st_size, etag, st.st_mtim.tv_sec);
+  unmap_file(data, st.st_size);
+  close(fd);
+  return 0;
+}
+
+/* Packs the regular file at PATH as request path KEY, with its variants.
+ * Returns its entry's index, -1 if it can't be read. */
+static int pack_file(pack_writer_t *writer, char *path, char *key) {
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  struct stat st;
+  char *data;
+  if (fd < 0 || fstat(fd, &st) < 0 || (data = map_file(fd, st.st_size)) == NULL) {
+    perror(path);
+    if (fd >= 0) close(fd);
+    return -1;
+  }
+
+  char *mime_type = http_get_mime_type(path);
+  pack_entry_t *entry = pack_add_entry(writer, key, 0, mime_type);
+  char etag[72];
+  content_etag(data, st.st_size, etag);
+  pack_add_body(writer, entry, PACK_IDENTITY, mime_type, data, st.st_size, etag,
+      st.st_mtim.tv_sec);
+
+  /* Compressed like httpserver would: a fresh sibling, or gzip if it helps */
+  if (http_mime_compressible(mime_type)) {
+    pack_sibling(writer, entry, PACK_BR, mime_type, path, &st);
+    if (pack_sibling(writer, entry, PACK_GZIP, mime_type, path, &st) < 0
+        && st.st_size >= COMPRESS_MIN_SIZE) {
+      struct http_buffer compressed;
+      http_buffer_init(&compressed);
+      if (compress_gzip(fd, st.st_size, &compressed) == 0
+          && compressed.size < (size_t) st.st_size) {
+        sprintf(etag + strlen(etag) - 1, "-gzip\"");
+        pack_add_body(writer, entry, PACK_GZIP, mime_type, compressed.data, compressed.size,
+            etag, st.st_mtim.tv_sec);
+      }
+      http_buffer_free(&compressed);
+    }
+  }
+
+  unmap_file(data, st.st_size);
+  close(fd);
+  return writer->count - 1;
+}
+
+/* Append a link to NAME, escaped as httpserver's listings do */
+static void listing_append_entry(struct http_buffer *listing, char *name) {
+  http_buffer_append(listing, "<a href='", strlen("<a href='"));
+  for (int pass = 0; pass < 2; pass++) {
+    for (char *c = name; *c; c++) {
+      char *entity = NULL;
+      switch (*c) {
+        case '&': entity = "&amp;"; break;
+        case '<': entity = "&lt;"; break;
+        case '>': entity = "&gt;"; break;
+        case '\'': entity = "&#39;"; break;
+        case '"': entity = "&quot;"; break;
+      }
+      if (entity != NULL) {
+        http_buffer_append(listing, entity, strlen(entity));
+      } else {
+        http_buffer_append(listing, c, 1);
+      }
+    }
+    if (pass == 0) http_buffer_append(listing, "'>", strlen("'>"));
+  }
+  http_buffer_append(listing, "</a><br />", strlen("</a><br />"));
+}
+
+/* Packs everything under directory PATH, then the directory itself as KEY:
+ * its index.html, or a listing of it */
+static void pack_directory(pack_writer_t *writer, char *path, char *key, struct stat *output) {
+  DIR *dir = opendir(path);
+  if (dir == NULL) {
+    perror(path);
+    return;
+  }
+
+  int index = -1;
+  struct http_buffer listing;
+  http_buffer_init(&listing);
+  http_buffer_append(&listing, "<h1>Index</h1>", strlen("<h1>Index</h1>"));
+
+  struct dirent *de;
+  while ((de = readdir(dir)) != NULL) {
+    listing_append_entry(&listing, de->d_name);
+    if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) {
+      continue;
+    }
+
+    char child_path[PATH_MAX];
+    char child_key[PATH_MAX];
+    snprintf(child_path, sizeof(child_path), "%s/%s", path, de->d_name);
+    snprintf(child_key, sizeof(child_key), "%s/%s", strcmp(key, "/") == 0 ? "" : key,
+        de->d_name);
+
+    /* Followed like the server follows them, the pack being written aside */
+    struct stat st;
+    if (stat(child_path, &st) < 0
+        || (st.st_dev == output->st_dev && st.st_ino == output->st_ino)) {
+      continue;
+    }
+    if (S_ISDIR(st.st_mode)) {
+      pack_directory(writer, child_path, child_key, output);
+    } else if (S_ISREG(st.st_mode)) {
+      int entry = pack_file(writer, child_path, child_key);
+      if (strcmp(de->d_name, "index.html") == 0) index = entry;
+    }
+  }
+  closedir(dir);
+
+  if (index >= 0) {
+    pack_entry_t *entry = pack_add_entry(writer, key, PACK_DIRECTORY, "text/html");
+    memcpy(entry->bodies, writer->entries[index].bodies, sizeof(entry->bodies));
+  } else {
+    pack_entry_t *entry = pack_add_entry(writer, key, PACK_DIRECTORY | PACK_LISTING,
+        "text/html");
+    pack_add_body(writer, entry, PACK_IDENTITY, "text/html", listing.data, listing.size,
+        NULL, 0);
+  }
+  http_buffer_free(&listing);
+}
+
+/* The hash index, probed linearly, at most half full */
+static void pack_write_index(pack_writer_t *writer, pack_header_t *header) {
+  uint32_t slots = 16;
+  while (slots < 2 * (uint32_t) writer->count) {
+    slots <<= 1;
+  }
+  pack_entry_t *index = calloc(slots, sizeof(pack_entry_t));
+  if (index == NULL) die("Can't allocate index");
+
+  for (int i = 0; i < writer->count; i++) {
+    uint32_t slot = writer->entries[i].hash & (slots - 1);
+    while (index[slot].hash != 0) {
+      slot = (slot + 1) & (slots - 1);
+    }
+    index[slot] = writer->entries[i];
+  }
+
+  pack_align(writer);
+  header->index_offset = pack_write(writer, index, slots * sizeof(pack_entry_t));
+  header->slots = slots;
+  header->count = writer->count;
+  free(index);
+}
+
+int main(int argc, char **argv) {
+  if (argc != 3) {
+    fprintf(stderr, "Usage: ./mkpack www_directory/ site.pack\n");
+    exit(EXIT_FAILURE);
+  }
+
+  char *root = argv[1];
+  size_t root_size = strlen(root);
+  while (root_size > 1 && root[root_size - 1] == '/') {
+    root[--root_size] = '\0';
+  }
+
+  char temporary[PATH_MAX];
+  snprintf(temporary, sizeof(temporary), "%s.tmp", argv[2]);
+  pack_writer_t writer;
+  memset(&writer, 0, sizeof(writer));
+  writer.fd = open(temporary, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  struct stat output;
+  if (writer.fd < 0 || fstat(writer.fd, &output) < 0) die(temporary);
+
+  /* The header goes in last, once the index is written */
+  pack_header_t header;
+  memset(&header, 0, sizeof(header));
+  pack_write(&writer, &header, sizeof(header));
+  writer.empty_string = pack_write_string(&writer, "");
+
+  pack_directory(&writer, root, "/", &output);
+  pack_write_index(&writer, &header);
+
+  memcpy(header.magic, PACK_MAGIC, 8);
+  header.version = PACK_VERSION;
+  header.size = writer.offset;
+  if (pwrite(writer.fd, &header, sizeof(header), 0) != sizeof(header)
+      || fsync(writer.fd) < 0 || close(writer.fd) < 0) {
+    die(temporary);
+  }
+  if (rename(temporary, argv[2]) < 0) die(argv[2]);
+
+  printf("Packed %d paths, %llu bytes, into %s\n", writer.count,
+      (unsigned long long) writer.offset, argv[2]);
+  return 0;
+}
@@ -0,0 +1,136 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "pack.h"
+
+uint64_t pack_hash(const char *path, size_t size) {
+  uint64_t hash = 14695981039346656037ULL;
+  for (size_t i = 0; i < size; i++) {
+    hash ^= (unsigned char) path[i];
+    hash *= 1099511628211ULL;
+  }
+  return hash == 0 ? 1 : hash;
+}
+
+/* SIZE bytes from OFFSET lie within the pack */
+static int pack_extent_valid(pack_t *pack, uint64_t offset, uint64_t size) {
+  return offset <= pack->size && size <= pack->size - offset;
+}
+
+/* A NUL terminated string starts at OFFSET, and ends within the pack */
+static int pack_string_valid(pack_t *pack, uint64_t offset) {
+  return offset < pack->size && memchr(pack->data + offset, '\0', pack->size - offset) != NULL;
+}
+
+/* Everything ENTRY points to lies within the pack. Variants it doesn't
+ * have are never looked at. */
+static int pack_entry_valid(pack_t *pack, pack_entry_t *entry) {
+  if (!pack_extent_valid(pack, entry->path_offset, (uint64_t) entry->path_size + 1)
+      || pack->data[entry->path_offset + entry->path_size] != '\0'
+      || pack_hash(pack->data + entry->path_offset, entry->path_size) != entry->hash
+      || !pack_string_valid(pack, entry->mime_offset)) {
+    return 0;
+  }
+  for (int coding = 0; coding < PACK_CODINGS; coding++) {
+    pack_body_t *body = &entry->bodies[coding];
+    if (coding != PACK_IDENTITY && body->headers_size == 0) continue;
+    if (!pack_extent_valid(pack, body->headers_offset, body->headers_size)
+        || !pack_extent_valid(pack, body->offset, body->size)
+        || !pack_string_valid(pack, body->etag_offset)
+        || !pack_string_valid(pack, body->last_modified_offset)) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+/* Every occupied slot is valid, and as many as the header says, so a probe
+ * always ends on an empty one */
+static int pack_index_valid(pack_t *pack) {
+  uint32_t count = 0;
+  for (uint32_t slot = 0; slot < pack->header->slots; slot++) {
+    pack_entry_t *entry = &pack->index[slot];
+    if (entry->hash == 0) continue;
+    if (!pack_entry_valid(pack, entry)) return 0;
+    count++;
+  }
+  return count == pack->header->count;
+}
+
+int pack_open(pack_t *pack, const char *path) {
+  memset(pack, 0, sizeof(pack_t));
+  pack->fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (pack->fd < 0) {
+    perror("Can't open pack");
+    return -1;
+  }
+
+  struct stat st;
+  if (fstat(pack->fd, &st) < 0) {
+    perror("Can't stat pack");
+    close(pack->fd);
+    return -1;
+  }
+  pack->size = st.st_size;
+  if (pack->size < sizeof(pack_header_t)) {
+    fprintf(stderr, "%s: not a pack\n", path);
+    close(pack->fd);
+    return -1;
+  }
+
+  pack->data = mmap(NULL, pack->size, PROT_READ, MAP_SHARED, pack->fd, 0);
+  if (pack->data == MAP_FAILED) {
+    perror("Can't map pack");
+    close(pack->fd);
+    return -1;
+  }
+
+  /* Trust nothing past a header that doesn't add up, nor an index pointing
+   * out of the pack */
+  pack->header = (pack_header_t *) pack->data;
+  pack_header_t *header = pack->header;
+  if (memcmp(header->magic, PACK_MAGIC, 8) != 0 || header->version != PACK_VERSION
+      || header->size != pack->size || header->slots == 0
+      || (header->slots & (header->slots - 1)) != 0 || header->count >= header->slots
+      || header->index_offset > pack->size || header->index_offset % 8 != 0
+      || (pack->size - header->index_offset) / sizeof(pack_entry_t) < header->slots) {
+    fprintf(stderr, "%s: not a pack, or a truncated one\n", path);
+    munmap(pack->data, pack->size);
+    close(pack->fd);
+    return -1;
+  }
+  pack->index = (pack_entry_t *) (pack->data + header->index_offset);
+  if (!pack_index_valid(pack)) {
+    fprintf(stderr, "%s: corrupt pack index\n", path);
+    munmap(pack->data, pack->size);
+    close(pack->fd);
+    return -1;
+  }
+
+  /* The index is probed on every request, bodies are read as they're sent */
+  madvise(pack->index, header->slots * sizeof(pack_entry_t), MADV_WILLNEED);
+  return 0;
+}
+
+pack_entry_t *pack_lookup(pack_t *pack, const char *path, size_t size) {
+  /* Directories are packed without their trailing slash */
+  int directory = size > 1 && path[size - 1] == '/';
+  if (directory) size--;
+
+  uint64_t hash = pack_hash(path, size);
+  uint32_t mask = pack->header->slots - 1;
+  for (uint32_t slot = hash & mask;; slot = (slot + 1) & mask) {
+    pack_entry_t *entry = &pack->index[slot];
+    if (entry->hash == 0) {
+      return NULL;
+    }
+    if (entry->hash == hash && entry->path_size == size
+        && memcmp(pack->data + entry->path_offset, path, size) == 0) {
+      return directory && !(entry->flags & PACK_DIRECTORY) ? NULL : entry;
+    }
+  }
+}
@@ -0,0 +1,84 @@
+#ifndef __PACK__
+#define __PACK__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* PACK is a files root built into one read-only file by mkpack, for trees
+ * deployed as a unit: an open addressing hash index of request paths, the
+ * header lines of every response prebuilt, and page aligned bodies, with
+ * their gzip and brotli variants. The server maps it once and answers from
+ * the mapping, a request costs a hash lookup and the write, no filesystem
+ * call. Offsets are from the start of the pack. */
+
+#define PACK_MAGIC "HTTPPAK1"
+#define PACK_VERSION 1
+#define PACK_ALIGN 4096
+
+/* Bodies at least this large go out with sendfile() from the pack, smaller
+ * ones are written from the mapping along with their headers */
+#define PACK_SENDFILE_MIN (64 * 1024)
+
+enum pack_coding {
+  PACK_IDENTITY,
+  PACK_GZIP,
+  PACK_BR,
+  PACK_CODINGS
+};
+
+/* Entry flags */
+#define PACK_DIRECTORY 1  // Its index.html, or a listing.
+#define PACK_LISTING 2    // A generated listing, without validators.
+
+typedef struct pack_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t count;             // Entries.
+  uint32_t slots;             // Index slots, a power of two.
+  uint32_t reserved;
+  uint64_t index_offset;
+  uint64_t size;              // Of the whole pack.
+} pack_header_t;
+
+typedef struct pack_body {
+  uint64_t headers_offset;    // Lines after the status line, blank line included.
+  uint64_t headers_size;      // 0 if the entry has no such variant.
+  uint64_t offset;            // Page aligned.
+  uint64_t size;
+  uint64_t etag_offset;       // NUL terminated, like the strings below.
+  uint64_t last_modified_offset;
+  int64_t mtime;              // s, for If-Modified-Since.
+} pack_body_t;
+
+typedef struct pack_entry {
+  uint64_t hash;              // Of the path, 0 for an empty slot.
+  uint64_t path_offset;
+  uint32_t path_size;
+  uint32_t flags;
+  uint64_t mime_offset;
+  pack_body_t bodies[PACK_CODINGS];
+} pack_entry_t;
+
+typedef struct pack {
+  int fd;
+  char *data;
+  size_t size;
+  pack_header_t *header;
+  pack_entry_t *index;
+} pack_t;
+
+/* Maps the pack at PATH. Returns -1 if it can't be read or isn't one. */
+int pack_open(pack_t *pack, const char *path);
+
+/* The entry for request path PATH of SIZE bytes, NULL if there's none. A
+ * trailing slash only finds directories. */
+pack_entry_t *pack_lookup(pack_t *pack, const char *path, size_t size);
+
+static inline char *pack_string(pack_t *pack, uint64_t offset) {
+  return pack->data + offset;
+}
+
+/* FNV-1a, never 0 */
+uint64_t pack_hash(const char *path, size_t size);
+
+#endif
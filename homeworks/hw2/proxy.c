@@ -0,0 +1,529 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <netdb.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "affinity.h"
+#include "listener.h"
+#include "proxy.h"
+
+static void *proxy_loop_routine(void *proxy_loop);
+static void *proxy_resolver_routine(void *proxy);
+
+static const char BAD_GATEWAY[] =
+  "HTTP/1.1 502 Bad Gateway\r\n"
+  "Connection: close\r\n"
+  "Content-Type: text/html\r\n"
+  "Content-Length: 45\r\n"
+  "\r\n"
+  "<center><h1>502 Bad Gateway</h1><hr></center>";
+
+static long long now_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+/* First IPv4 address of HOSTNAME, getaddrinfo() is thread-safe */
+static int proxy_resolve(char *hostname, unsigned int *address) {
+  struct addrinfo hints, *result;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_STREAM;
+
+  if (getaddrinfo(hostname, NULL, &hints, &result) != 0) {
+    return -1;
+  }
+  *address = ((struct sockaddr_in *) result->ai_addr)->sin_addr.s_addr;
+  freeaddrinfo(result);
+  return 0;
+}
+
+int proxy_upstream_init(proxy_upstream_t *upstream, char *hostname, int port) {
+  memset(upstream, 0, sizeof(proxy_upstream_t));
+  upstream->hostname = hostname;
+  upstream->port = port;
+  return proxy_resolve(hostname, &upstream->address);
+}
+
+/* Start a non-blocking connect to UPSTREAM, splices to it just wait for
+ * EPOLLOUT until it completes */
+static int proxy_connect(proxy_upstream_t *upstream) {
+  struct sockaddr_in address;
+  memset(&address, 0, sizeof(address));
+  address.sin_family = AF_INET;
+  address.sin_port = htons(upstream->port);
+  address.sin_addr.s_addr = __atomic_load_n(&upstream->address, __ATOMIC_RELAXED);
+
+  int fd = socket(PF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    perror("Failed to create a new socket");
+    return -1;
+  }
+  if (connect(fd, (struct sockaddr *) &address, sizeof(address)) < 0
+      && errno != EINPROGRESS) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+static int proxy_ejected(proxy_upstream_t *upstream, long long now) {
+  return __atomic_load_n(&upstream->ejected_until, __ATOMIC_RELAXED) > now;
+}
+
+/* Count a failed connection, ejecting UPSTREAM if too many came in a row */
+static void proxy_upstream_failed(proxy_upstream_t *upstream) {
+  if (__atomic_add_fetch(&upstream->failures, 1, __ATOMIC_RELAXED) >= PROXY_MAX_FAILS) {
+    __atomic_store_n(&upstream->failures, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&upstream->ejected_until, now_ms() + PROXY_EJECT_TIME, __ATOMIC_RELAXED);
+    fprintf(stderr, "Upstream %s:%d ejected\n", upstream->hostname, upstream->port);
+  }
+}
+
+static void proxy_upstream_ok(proxy_upstream_t *upstream) {
+  if (__atomic_load_n(&upstream->failures, __ATOMIC_RELAXED) != 0) {
+    __atomic_store_n(&upstream->failures, 0, __ATOMIC_RELAXED);
+  }
+}
+
+/* Pick the upstream for a new client, leaving ejected ones out unless all
+ * of them are. Ties between the least used go round-robin. */
+static proxy_upstream_t *proxy_pick(proxy_t *proxy, long long now) {
+  unsigned int next = __atomic_fetch_add(&proxy->next_upstream, 1, __ATOMIC_RELAXED);
+  proxy_upstream_t *picked = NULL;
+  int least = INT_MAX;
+
+  if (proxy->balance == PROXY_ROUND_ROBIN) {
+    /* Skipping takes a turn too, or the one after an ejected upstream
+     * would get its share as well */
+    for (int i = 0; i < proxy->upstream_count; i++) {
+      proxy_upstream_t *upstream = &proxy->upstreams[next % proxy->upstream_count];
+      if (!proxy_ejected(upstream, now)) {
+        return upstream;
+      }
+      next = __atomic_fetch_add(&proxy->next_upstream, 1, __ATOMIC_RELAXED);
+    }
+    return &proxy->upstreams[next % proxy->upstream_count];
+  }
+
+  for (int i = 0; i < proxy->upstream_count; i++) {
+    proxy_upstream_t *upstream = &proxy->upstreams[(next + i) % proxy->upstream_count];
+    if (proxy_ejected(upstream, now)) {
+      continue;
+    }
+    int connections = __atomic_load_n(&upstream->connections, __ATOMIC_RELAXED);
+    if (connections < least) {
+      least = connections;
+      picked = upstream;
+    }
+  }
+  return picked ? picked : &proxy->upstreams[next % proxy->upstream_count];
+}
+
+/* Top the warm connections up for every upstream in service, dropping the
+ * expired ones first */
+static void proxy_warm_fill(proxy_loop_t *loop) {
+  proxy_t *proxy = loop->proxy;
+  long long now = now_ms();
+  int kept = 0;
+  for (int i = 0; i < loop->warm_count; i++) {
+    if (now - loop->warm[i].created > PROXY_WARM_MAX_AGE) {
+      close(loop->warm[i].fd);
+    } else {
+      loop->warm[kept++] = loop->warm[i];
+    }
+  }
+  loop->warm_count = kept;
+
+  for (int i = 0; i < proxy->upstream_count; i++) {
+    proxy_upstream_t *upstream = &proxy->upstreams[i];
+    if (proxy_ejected(upstream, now)) {
+      continue;
+    }
+
+    int warm = 0;
+    for (int j = 0; j < loop->warm_count; j++) {
+      warm += loop->warm[j].upstream == upstream;
+    }
+    for (; warm < proxy->warm_target; warm++) {
+      int fd = proxy_connect(upstream);
+      if (fd < 0) {
+        break;
+      }
+      loop->warm[loop->warm_count].fd = fd;
+      loop->warm[loop->warm_count].upstream = upstream;
+      loop->warm[loop->warm_count].created = now;
+      loop->warm_count++;
+    }
+  }
+}
+
+/* A connection to UPSTREAM for a new client, warm if possible. A warm one
+ * that was refused or reset while it waited counts as a failure. */
+static int proxy_upstream_connect(proxy_loop_t *loop, proxy_upstream_t *upstream,
+    long long now) {
+  for (int i = loop->warm_count - 1; i >= 0; i--) {
+    proxy_warm_t warm = loop->warm[i];
+    if (warm.upstream != upstream) {
+      continue;
+    }
+    loop->warm[i] = loop->warm[--loop->warm_count];
+
+    if (now - warm.created <= PROXY_WARM_MAX_AGE) {
+      char c;
+      ssize_t n = recv(warm.fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+      if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        return warm.fd;
+      }
+      /* Closing an unused connection is fair, refusing it isn't */
+      if (n < 0) {
+        proxy_upstream_failed(upstream);
+      }
+    }
+    close(warm.fd);
+  }
+  return proxy_connect(upstream);
+}
+
+static int proxy_pipe(proxy_loop_t *loop, int pipe_fds[2]) {
+  if (loop->pipe_count > 0) {
+    loop->pipe_count--;
+    pipe_fds[0] = loop->pipes[loop->pipe_count][0];
+    pipe_fds[1] = loop->pipes[loop->pipe_count][1];
+    return 0;
+  }
+  return pipe2(pipe_fds, O_NONBLOCK | O_CLOEXEC);
+}
+
+/* Keep an empty pipe for the next relay, a pipe with data in it is closed */
+static void proxy_pipe_release(proxy_loop_t *loop, relay_half_t *half) {
+  if (half->pipe[0] < 0) {
+    return;
+  }
+  if (half->pending == 0 && loop->pipe_count < PROXY_PIPE_CACHE) {
+    loop->pipes[loop->pipe_count][0] = half->pipe[0];
+    loop->pipes[loop->pipe_count][1] = half->pipe[1];
+    loop->pipe_count++;
+  } else {
+    close(half->pipe[0]);
+    close(half->pipe[1]);
+  }
+}
+
+/* Move whatever SRC has to DST, until either would block. The pipe is
+ * always drained before SRC is read again, so a read only fails with EAGAIN
+ * when SRC is empty. Returns the bytes read, or -1 with the socket that
+ * failed in FAILED_FD. */
+static ssize_t relay_pump(relay_half_t *half, int *failed_fd) {
+  ssize_t moved = 0;
+
+  for (;;) {
+    while (half->pending > 0) {
+      ssize_t n = splice(half->pipe[0], NULL, half->dst, NULL, half->pending,
+          SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+      if (n < 0) {
+        if (errno == EINTR) continue;
+        if (errno == EAGAIN) return moved;
+        *failed_fd = half->dst;
+        return -1;
+      }
+      half->pending -= n;
+    }
+
+    if (half->eof) {
+      if (half->eof == 1) {
+        shutdown(half->dst, SHUT_WR);
+        half->eof = 2;
+      }
+      return moved;
+    }
+
+    ssize_t n = splice(half->src, NULL, half->pipe[1], NULL, PROXY_SPLICE_SIZE,
+        SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      if (errno == EAGAIN) return moved;
+      *failed_fd = half->src;
+      return -1;
+    }
+    if (n == 0) {
+      half->eof = 1;
+    }
+    half->pending += n;
+    moved += n;
+  }
+}
+
+/* Unregister and close RELAY, its memory is freed after the current batch
+ * of events since it may still be in there */
+static void relay_close(proxy_loop_t *loop, relay_t *relay) {
+  int client_fd = relay->request.src;
+  int upstream_fd = relay->response.src;
+
+  timer_wheel_remove(&loop->deadlines, &relay->deadline);
+  epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, client_fd, NULL);
+  epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, upstream_fd, NULL);
+  close(client_fd);
+  close(upstream_fd);
+  proxy_pipe_release(loop, &relay->request);
+  proxy_pipe_release(loop, &relay->response);
+  __atomic_sub_fetch(&relay->upstream->connections, 1, __ATOMIC_RELAXED);
+
+  relay->closed = 1;
+  relay->next = loop->closed;
+  loop->closed = relay;
+}
+
+/* The upstream failed before it sent anything, tell the client */
+static void relay_bad_gateway(int client_fd) {
+  char discard[1024];
+
+  send(client_fd, BAD_GATEWAY, sizeof(BAD_GATEWAY) - 1, MSG_NOSIGNAL | MSG_DONTWAIT);
+  shutdown(client_fd, SHUT_WR);
+  /* Unread request bytes would turn the close into a reset */
+  while (recv(client_fd, discard, sizeof(discard), MSG_DONTWAIT) > 0);
+}
+
+/* Pump both directions, whichever socket the event came from. Bytes moved
+ * either way push the idle deadline back. */
+static void relay_on_event(proxy_loop_t *loop, relay_t *relay) {
+  if (relay->closed) {
+    return;
+  }
+
+  int failed_fd = -1;
+  size_t pending = relay->request.pending + relay->response.pending;
+  ssize_t request = 0;
+  ssize_t response = relay_pump(&relay->response, &failed_fd);
+  if (response > 0) {
+    if (relay->response_bytes == 0) {
+      proxy_upstream_ok(relay->upstream);
+    }
+    relay->response_bytes += response;
+  }
+  if (response < 0 || (request = relay_pump(&relay->request, &failed_fd)) < 0) {
+    if (relay->response_bytes == 0 && failed_fd == relay->response.src) {
+      proxy_upstream_failed(relay->upstream);
+      relay_bad_gateway(relay->request.src);
+    }
+    relay_close(loop, relay);
+    return;
+  }
+
+  if (relay->request.eof == 2 && relay->response.eof == 2) {
+    relay_close(loop, relay);
+  } else if (response > 0 || request > 0
+      || relay->request.pending + relay->response.pending != pending) {
+    timer_wheel_add(&loop->deadlines, &relay->deadline, now_ms() + PROXY_IDLE_TIMEOUT);
+  }
+}
+
+static int relay_watch(proxy_loop_t *loop, relay_t *relay, int fd) {
+  struct epoll_event event;
+  event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+  event.data.ptr = relay;
+  return epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, fd, &event);
+}
+
+/* Pair a new client with an upstream connection */
+static void relay_open(proxy_loop_t *loop, int client_fd) {
+  long long now = now_ms();
+  proxy_upstream_t *upstream = proxy_pick(loop->proxy, now);
+  int upstream_fd = proxy_upstream_connect(loop, upstream, now);
+  if (upstream_fd < 0) {
+    proxy_upstream_failed(upstream);
+    relay_bad_gateway(client_fd);
+    close(client_fd);
+    return;
+  }
+
+  relay_t *relay = calloc(1, sizeof(relay_t));
+  if (relay == NULL) {
+    perror("Can't allocate relay");
+    close(client_fd);
+    close(upstream_fd);
+    return;
+  }
+  relay->request.pipe[0] = relay->response.pipe[0] = -1;
+  relay->request.src = relay->response.dst = client_fd;
+  relay->request.dst = relay->response.src = upstream_fd;
+  relay->upstream = upstream;
+  __atomic_add_fetch(&upstream->connections, 1, __ATOMIC_RELAXED);
+
+  if (proxy_pipe(loop, relay->request.pipe) < 0
+      || proxy_pipe(loop, relay->response.pipe) < 0) {
+    perror("Can't create relay pipe");
+    relay_close(loop, relay);
+    return;
+  }
+
+  relay->deadline.data = relay;
+  if (relay_watch(loop, relay, client_fd) < 0 || relay_watch(loop, relay, upstream_fd) < 0) {
+    perror("epoll_ctl(): Can't add relay");
+    relay_close(loop, relay);
+    return;
+  }
+  timer_wheel_add(&loop->deadlines, &relay->deadline, now + PROXY_REQUEST_TIMEOUT);
+}
+
+static void relay_expire(timer_wheel_timer_t *deadline, void *proxy_loop) {
+  relay_close((proxy_loop_t *) proxy_loop, (relay_t *) deadline->data);
+}
+
+/* Close relays past their deadline, returns the epoll_wait() timeout until
+ * the wheel has to be looked at again */
+static int proxy_loop_expire(proxy_loop_t *loop) {
+  long long now = now_ms();
+  timer_wheel_advance(&loop->deadlines, now, relay_expire, loop);
+  return timer_wheel_timeout(&loop->deadlines, now);
+}
+
+/* Accept every pending connection, the listening socket is edge-triggered */
+static void proxy_accept(proxy_loop_t *loop) {
+  for (;;) {
+    int fd = accept4(loop->server_socket, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd < 0) {
+      if (errno == EINTR) continue;
+      if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        perror("Error accepting socket");
+      }
+      break;
+    }
+    relay_open(loop, fd);
+  }
+  proxy_warm_fill(loop);
+}
+
+/* Start NUM_LOOPS relay loops on SERVER_SOCKETS and wait for them */
+int proxy_run(int *server_sockets, int num_sockets, int num_loops, proxy_t *proxy) {
+
+  if (num_loops <= 0 || num_sockets <= 0 || proxy->upstream_count <= 0
+      || proxy->warm_target < 0
+      || proxy->upstream_count * proxy->warm_target > PROXY_MAX_WARM) {
+    return -1;
+  }
+
+  /* A peer closing mid-splice must fail the call, not kill the server */
+  signal(SIGPIPE, SIG_IGN);
+
+  for (int i = 0; i < num_sockets; i++) {
+    int flags = fcntl(server_sockets[i], F_GETFL, 0);
+    if (flags < 0 || fcntl(server_sockets[i], F_SETFL, flags | O_NONBLOCK) < 0) {
+      perror("Can't make server socket non-blocking");
+      return -1;
+    }
+  }
+
+  pthread_t resolver;
+  if (pthread_create(&resolver, NULL, proxy_resolver_routine, proxy) != 0) {
+    perror("Error create resolver thread");
+    return -1;
+  }
+  pthread_detach(resolver);
+
+  proxy_loop_t *loops = calloc(num_loops, sizeof(proxy_loop_t));
+  if (loops == NULL) {
+    perror("Init proxy loops error");
+    return -1;
+  }
+
+  for (int i = 0; i < num_loops; i++) {
+    loops[i].server_socket = server_sockets[i % num_sockets];
+    loops[i].cpu = num_sockets > 1 || affinity_enabled() ? i : -1;
+    loops[i].proxy = proxy;
+    loops[i].epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (loops[i].epoll_fd < 0) {
+      perror("epoll_create1(): Error");
+      return -1;
+    }
+
+    /* Wake only one loop per incoming connection */
+    struct epoll_event event;
+    event.events = EPOLLIN | EPOLLET | EPOLLEXCLUSIVE;
+    event.data.ptr = NULL;
+    if (epoll_ctl(loops[i].epoll_fd, EPOLL_CTL_ADD, loops[i].server_socket, &event) < 0) {
+      perror("epoll_ctl(): Can't add server socket");
+      return -1;
+    }
+
+    timer_wheel_init(&loops[i].deadlines, now_ms());
+    proxy_warm_fill(&loops[i]);
+    if (pthread_create(&loops[i].thread, NULL, proxy_loop_routine, &loops[i]) != 0) {
+      perror("Error create proxy loop thread");
+      return -1;
+    }
+  }
+
+  for (int i = 0; i < num_loops; i++) {
+    pthread_join(loops[i].thread, NULL);
+  }
+  free(loops);
+  return 0;
+}
+
+/* Re-resolve every upstream now and then. A failed lookup keeps the last
+ * address, new connections pick a changed one up as they are made. */
+static void *proxy_resolver_routine(void *proxy_ptr) {
+  proxy_t *proxy = (proxy_t *) proxy_ptr;
+  struct timespec refresh = { PROXY_DNS_REFRESH / 1000, (PROXY_DNS_REFRESH % 1000) * 1000000 };
+
+  for (;;) {
+    nanosleep(&refresh, NULL);
+    for (int i = 0; i < proxy->upstream_count; i++) {
+      proxy_upstream_t *upstream = &proxy->upstreams[i];
+      unsigned int address;
+      if (proxy_resolve(upstream->hostname, &address) != 0) {
+        fprintf(stderr, "Cannot refresh host: %s\n", upstream->hostname);
+        continue;
+      }
+      __atomic_store_n(&upstream->address, address, __ATOMIC_RELAXED);
+    }
+  }
+
+  return NULL;
+}
+
+static void *proxy_loop_routine(void *proxy_loop) {
+  proxy_loop_t *loop = (proxy_loop_t *) proxy_loop;
+  struct epoll_event events[PROXY_MAX_EVENTS];
+
+  if (loop->cpu >= 0) {
+    listener_pin(loop->cpu);
+  }
+
+  for (;;) {
+    int timeout = proxy_loop_expire(loop);
+    int n = epoll_wait(loop->epoll_fd, events, PROXY_MAX_EVENTS, timeout);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      perror("epoll_wait(): Error");
+      break;
+    }
+
+    for (int i = 0; i < n; i++) {
+      if (events[i].data.ptr == NULL) {
+        proxy_accept(loop);
+      } else {
+        relay_on_event(loop, (relay_t *) events[i].data.ptr);
+      }
+    }
+
+    while (loop->closed != NULL) {
+      relay_t *relay = loop->closed;
+      loop->closed = relay->next;
+      free(relay);
+    }
+  }
+
+  return NULL;
+}
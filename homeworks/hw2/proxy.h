@@ -0,0 +1,112 @@
+#ifndef __PROXY__
+#define __PROXY__
+
+#include <netinet/in.h>
+#include <pthread.h>
+
+#include "timerwheel.h"
+
+/* PROXY relays client connections to a set of upstreams with a few epoll
+ * loops, both directions of every connection on the loop that accepted it.
+ * Bytes are moved with splice() through a pipe, socket to pipe to socket,
+ * so they never enter user space.
+ *
+ * Each loop keeps a handful of warm connections to every upstream,
+ * connected ahead of time, so a client doesn't wait for a handshake with
+ * the upstream. The relay doesn't parse HTTP and can't tell where a
+ * response ends, so an upstream connection serves a single client and is
+ * closed with it.
+ *
+ * Upstream names are resolved once before serving, then again every
+ * PROXY_DNS_REFRESH by a background thread; the loops never block on the
+ * resolver. An upstream failing PROXY_MAX_FAILS connections in a row is
+ * left out for PROXY_EJECT_TIME.
+ *
+ * A client has PROXY_REQUEST_TIMEOUT to send its first bytes, after that a
+ * relay moving nothing either way for PROXY_IDLE_TIMEOUT is closed, halves
+ * shut or not. */
+
+#define PROXY_MAX_EVENTS 256
+#define PROXY_MAX_UPSTREAMS 16
+#define PROXY_WARM_CONNECTIONS 4
+#define PROXY_MAX_WARM 64
+#define PROXY_WARM_MAX_AGE 30000   // ms, before a warm connection is replaced.
+#define PROXY_PIPE_CACHE 64        // Empty pipes kept per loop for reuse.
+#define PROXY_SPLICE_SIZE 65536    // The default pipe capacity.
+#define PROXY_DNS_REFRESH 30000    // ms
+#define PROXY_MAX_FAILS 3
+#define PROXY_EJECT_TIME 10000     // ms
+#define PROXY_REQUEST_TIMEOUT 10000 // ms
+#define PROXY_IDLE_TIMEOUT 60000   // ms
+
+typedef enum {
+  PROXY_ROUND_ROBIN,
+  PROXY_LEAST_CONNECTIONS,
+} proxy_balance_t;
+
+typedef struct proxy_upstream {
+  char *hostname;
+  int port;
+  unsigned int address;       // IPv4 in network order, swapped by the resolver.
+  int connections;            // Relays using it, across loops.
+  int failures;               // Failed connections in a row.
+  long long ejected_until;    // ms
+} proxy_upstream_t;
+
+/* One direction of a relay: SRC -> pipe -> DST */
+typedef struct relay_half {
+  int src;
+  int dst;
+  int pipe[2];
+  size_t pending;       // Bytes in the pipe, not yet spliced to DST.
+  int eof;              // 1 once SRC sent FIN, 2 once DST was sent one.
+} relay_half_t;
+
+typedef struct relay {
+  relay_half_t request;     // Client to upstream.
+  relay_half_t response;    // Upstream to client.
+  size_t response_bytes;
+  proxy_upstream_t *upstream;
+  int closed;
+  timer_wheel_timer_t deadline;
+  struct relay *next;       // Closed relays, freed after the epoll batch.
+} relay_t;
+
+typedef struct proxy_warm {
+  int fd;
+  proxy_upstream_t *upstream;
+  long long created;        // ms
+} proxy_warm_t;
+
+typedef struct proxy {
+  proxy_upstream_t *upstreams;
+  int upstream_count;
+  proxy_balance_t balance;
+  unsigned int next_upstream;
+  int warm_target;          // Per upstream and loop.
+} proxy_t;
+
+typedef struct proxy_loop {
+  int epoll_fd;
+  int server_socket;
+  int cpu;                  // Pinned to it if not -1.
+  pthread_t thread;
+  proxy_t *proxy;
+  proxy_warm_t warm[PROXY_MAX_WARM];
+  int warm_count;
+  int pipes[PROXY_PIPE_CACHE][2];
+  int pipe_count;
+  relay_t *closed;
+  timer_wheel_t deadlines;
+} proxy_loop_t;
+
+/* Sets UPSTREAM to HOSTNAME:PORT and resolves it, returns -1 if the name
+ * doesn't resolve. */
+int proxy_upstream_init(proxy_upstream_t *upstream, char *hostname, int port);
+
+/* Runs NUM_LOOPS relay loops from SERVER_SOCKETS to PROXY's upstreams,
+ * never returns on success. With several sockets, loop I accepts from
+ * socket I % NUM_SOCKETS and is pinned to CPU I. */
+int proxy_run(int *server_sockets, int num_sockets, int num_loops, proxy_t *proxy);
+
+#endif
@@ -0,0 +1,343 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "respcache.h"
+#include "utlist.h"
+
+#define RESPONSE_CACHE_EVENTS (IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_MOVED_FROM \
+    | IN_MOVED_TO | IN_CREATE | IN_DELETE | IN_DELETE_SELF | IN_MOVE_SELF)
+
+static void *response_cache_watch(void *response_cache);
+
+/* FNV-1a */
+static unsigned int response_cache_hash(const char *key) {
+  unsigned int hash = 2166136261u;
+  while (*key) {
+    hash ^= (unsigned char) *key++;
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+static response_cache_shard_t *response_cache_shard(response_cache_t *cache, unsigned int hash) {
+  return &cache->shards[hash % RESPONSE_CACHE_SHARDS];
+}
+
+/* Memory charged to the budget for ENTRY */
+static size_t response_cache_cost(response_cache_entry_t *entry) {
+  return sizeof(response_cache_entry_t) + entry->size + strlen(entry->key) + 1;
+}
+
+static void response_cache_entry_free(response_cache_entry_t *entry) {
+  free(entry->key);
+  free(entry->name);
+  free(entry->data);
+  free(entry);
+}
+
+/* Drop ENTRY from its shard, and the reference the shard held on it. Caller
+ * holds the shard's write lock. */
+static void response_cache_unlink(response_cache_shard_t *shard, response_cache_entry_t *entry) {
+  unsigned int bucket = (response_cache_hash(entry->key) / RESPONSE_CACHE_SHARDS)
+      % RESPONSE_CACHE_BUCKETS;
+  response_cache_entry_t **link = &shard->buckets[bucket];
+  while (*link != entry) link = &(*link)->hash_next;
+  *link = entry->hash_next;
+
+  CDL_DELETE(shard->hand, entry);
+  shard->size -= response_cache_cost(entry);
+
+  if (__atomic_sub_fetch(&entry->refcount, 1, __ATOMIC_SEQ_CST) == 0) {
+    response_cache_entry_free(entry);
+  }
+}
+
+/* Evict with the CLOCK hand until NEEDED more bytes fit in the shard */
+static void response_cache_evict(response_cache_t *cache, response_cache_shard_t *shard,
+    size_t needed) {
+  while (shard->hand != NULL && shard->size + needed > cache->shard_budget) {
+    response_cache_entry_t *entry = shard->hand;
+    if (__atomic_exchange_n(&entry->referenced, 0, __ATOMIC_RELAXED)) {
+      shard->hand = entry->next;
+    } else {
+      response_cache_unlink(shard, entry);
+    }
+  }
+}
+
+/* Drop entries built from NAME in the directory watched by WD. A NULL name
+ * matches every entry of the directory, a negative WD matches everything. */
+static void response_cache_invalidate(response_cache_t *cache, int wd, const char *name) {
+  for (int i = 0; i < RESPONSE_CACHE_SHARDS; i++) {
+    response_cache_shard_t *shard = &cache->shards[i];
+    pthread_rwlock_wrlock(&shard->lock);
+    for (int b = 0; b < RESPONSE_CACHE_BUCKETS; b++) {
+      response_cache_entry_t *entry = shard->buckets[b];
+      while (entry != NULL) {
+        response_cache_entry_t *next = entry->hash_next;
+        if (wd < 0 || (entry->wd == wd
+              && (name == NULL || entry->name == NULL || strcmp(entry->name, name) == 0))) {
+          response_cache_unlink(shard, entry);
+        }
+        entry = next;
+      }
+    }
+    pthread_rwlock_unlock(&shard->lock);
+  }
+}
+
+int response_cache_init(response_cache_t *cache, size_t budget) {
+  if (budget == 0) {
+    return -1;
+  }
+
+  memset(cache, 0, sizeof(response_cache_t));
+  cache->shard_budget = budget / RESPONSE_CACHE_SHARDS;
+  cache->max_entry = cache->shard_budget / 4;
+  if (cache->max_entry > RESPONSE_CACHE_MAX_ENTRY) {
+    cache->max_entry = RESPONSE_CACHE_MAX_ENTRY;
+  }
+  cache->max_rendered = cache->shard_budget / 2;
+
+  cache->inotify_fd = inotify_init1(IN_CLOEXEC);
+  if (cache->inotify_fd < 0) {
+    perror("Response cache disabled, inotify_init1()");
+    return -1;
+  }
+
+  for (int i = 0; i < RESPONSE_CACHE_SHARDS; i++) {
+    if (pthread_rwlock_init(&cache->shards[i].lock, NULL) != 0) {
+      perror("Init response cache lock error");
+      close(cache->inotify_fd);
+      return -1;
+    }
+  }
+
+  if (pthread_create(&cache->watcher, NULL, response_cache_watch, cache) != 0) {
+    perror("Error create response cache watcher");
+    close(cache->inotify_fd);
+    return -1;
+  }
+  pthread_detach(cache->watcher);
+  return 0;
+}
+
+response_cache_entry_t *response_cache_get(response_cache_t *cache, const char *key) {
+  unsigned int hash = response_cache_hash(key);
+  response_cache_shard_t *shard = response_cache_shard(cache, hash);
+
+  pthread_rwlock_rdlock(&shard->lock);
+  response_cache_entry_t *entry =
+      shard->buckets[(hash / RESPONSE_CACHE_SHARDS) % RESPONSE_CACHE_BUCKETS];
+  while (entry != NULL && strcmp(entry->key, key) != 0) {
+    entry = entry->hash_next;
+  }
+  if (entry != NULL) {
+    __atomic_add_fetch(&entry->refcount, 1, __ATOMIC_SEQ_CST);
+    if (!__atomic_load_n(&entry->referenced, __ATOMIC_RELAXED)) {
+      __atomic_store_n(&entry->referenced, 1, __ATOMIC_RELAXED);
+    }
+  }
+  pthread_rwlock_unlock(&shard->lock);
+  return entry;
+}
+
+void response_cache_put(response_cache_t *cache, response_cache_entry_t *entry) {
+  if (__atomic_sub_fetch(&entry->refcount, 1, __ATOMIC_SEQ_CST) == 0) {
+    response_cache_entry_free(entry);
+  }
+}
+
+/* Watch the directory of SOURCE_PATH (or SOURCE_PATH itself when it is a
+ * directory whose whole content matters), filling in the entry's wd and name */
+static int response_cache_watch_source(response_cache_t *cache,
+    response_cache_entry_t *entry, const char *source_path, int whole_dir) {
+  if (whole_dir) {
+    entry->wd = inotify_add_watch(cache->inotify_fd, source_path, RESPONSE_CACHE_EVENTS);
+    return entry->wd < 0 ? -1 : 0;
+  }
+
+  const char *slash = strrchr(source_path, '/');
+  char *dir = slash ? strndup(source_path, slash - source_path + 1) : strdup(".");
+  if (dir == NULL) {
+    return -1;
+  }
+
+  entry->wd = inotify_add_watch(cache->inotify_fd, dir, RESPONSE_CACHE_EVENTS);
+  free(dir);
+  entry->name = strdup(slash ? slash + 1 : source_path);
+  return entry->wd < 0 || entry->name == NULL ? -1 : 0;
+}
+
+/* Allocate an entry holding HEADERS and the blank line, with room for the body */
+static response_cache_entry_t *response_cache_entry_new(const char *key, char *headers,
+    size_t headers_size, size_t body_size, size_t max_size) {
+  size_t size = headers_size + 2 + body_size;
+  if (size > max_size) {
+    return NULL;
+  }
+
+  response_cache_entry_t *entry = calloc(1, sizeof(response_cache_entry_t));
+  if (entry == NULL) {
+    return NULL;
+  }
+  entry->key = strdup(key);
+  entry->data = malloc(size);
+  if (entry->key == NULL || entry->data == NULL) {
+    response_cache_entry_free(entry);
+    return NULL;
+  }
+
+  memcpy(entry->data, headers, headers_size);
+  memcpy(entry->data + headers_size, "\r\n", 2);
+  entry->header_size = headers_size + 2;
+  entry->size = size;
+  entry->refcount = 1;
+  return entry;
+}
+
+/* Publish ENTRY unless its source may have changed since GENERATION */
+static void response_cache_publish(response_cache_t *cache, response_cache_entry_t *entry,
+    unsigned long generation) {
+  unsigned int hash = response_cache_hash(entry->key);
+  response_cache_shard_t *shard = response_cache_shard(cache, hash);
+  unsigned int bucket = (hash / RESPONSE_CACHE_SHARDS) % RESPONSE_CACHE_BUCKETS;
+
+  pthread_rwlock_wrlock(&shard->lock);
+  response_cache_entry_t *other = shard->buckets[bucket];
+  while (other != NULL && strcmp(other->key, entry->key) != 0) {
+    other = other->hash_next;
+  }
+  if (other == NULL && __atomic_load_n(&cache->generation, __ATOMIC_SEQ_CST) == generation) {
+    response_cache_evict(cache, shard, response_cache_cost(entry));
+    entry->hash_next = shard->buckets[bucket];
+    shard->buckets[bucket] = entry;
+    /* Insert just behind the hand, the new entry is looked at last */
+    CDL_PREPEND(shard->hand, entry);
+    shard->hand = entry->next;
+    shard->size += response_cache_cost(entry);
+    /* The shard's own reference, dropped when it's unlinked */
+    __atomic_add_fetch(&entry->refcount, 1, __ATOMIC_SEQ_CST);
+  }
+  pthread_rwlock_unlock(&shard->lock);
+}
+
+response_cache_entry_t *response_cache_fill(response_cache_t *cache, const char *key,
+    const char *source_path, char *headers, size_t headers_size, int fd, size_t body_size) {
+
+  /* Changes before the watch exists are in what we read, later ones bump this */
+  unsigned long generation = __atomic_load_n(&cache->generation, __ATOMIC_SEQ_CST);
+  response_cache_entry_t *entry =
+      response_cache_entry_new(key, headers, headers_size, body_size, cache->max_entry);
+  if (entry == NULL) {
+    return NULL;
+  }
+  if (response_cache_watch_source(cache, entry, source_path, 0) < 0) {
+    response_cache_entry_free(entry);
+    return NULL;
+  }
+
+  /* The watch only covers the name from now on, make sure FD is still it */
+  struct stat fd_stat, path_stat;
+  if (fstat(fd, &fd_stat) < 0 || stat(source_path, &path_stat) < 0
+      || fd_stat.st_ino != path_stat.st_ino || fd_stat.st_dev != path_stat.st_dev) {
+    response_cache_entry_free(entry);
+    return NULL;
+  }
+
+  size_t done = 0;
+  while (done < body_size) {
+    ssize_t bytes_read = pread(fd, entry->data + entry->header_size + done,
+        body_size - done, done);
+    if (bytes_read < 0 && errno == EINTR) continue;
+    if (bytes_read <= 0) {
+      response_cache_entry_free(entry);
+      return NULL;
+    }
+    done += bytes_read;
+  }
+
+  response_cache_publish(cache, entry, generation);
+  return entry;
+}
+
+/* Publish a rendered BODY built from SOURCE_PATH, watched from now on, as
+ * long as SOURCE_PATH is still what it was rendered from: changes before
+ * the watch existed show in its mtime (and inode, for a file) */
+static int response_cache_insert_rendered(response_cache_t *cache, const char *key,
+    const char *source_path, int whole_dir, struct stat *source, char *headers,
+    size_t headers_size, char *body, size_t body_size) {
+
+  unsigned long generation = __atomic_load_n(&cache->generation, __ATOMIC_SEQ_CST);
+  response_cache_entry_t *entry =
+      response_cache_entry_new(key, headers, headers_size, body_size, cache->max_rendered);
+  if (entry == NULL) {
+    return -1;
+  }
+
+  struct stat st;
+  if (response_cache_watch_source(cache, entry, source_path, whole_dir) < 0
+      || stat(source_path, &st) < 0
+      || (!whole_dir && (st.st_ino != source->st_ino || st.st_dev != source->st_dev))
+      || st.st_mtim.tv_sec != source->st_mtim.tv_sec
+      || st.st_mtim.tv_nsec != source->st_mtim.tv_nsec) {
+    response_cache_entry_free(entry);
+    return -1;
+  }
+
+  memcpy(entry->data + entry->header_size, body, body_size);
+  response_cache_publish(cache, entry, generation);
+  response_cache_put(cache, entry);
+  return 0;
+}
+
+int response_cache_insert(response_cache_t *cache, const char *key, const char *dir_path,
+    struct timespec *dir_mtime, char *headers, size_t headers_size, char *body,
+    size_t body_size) {
+  struct stat dir;
+  dir.st_mtim = *dir_mtime;
+  return response_cache_insert_rendered(cache, key, dir_path, 1, &dir, headers, headers_size,
+      body, body_size);
+}
+
+int response_cache_insert_file(response_cache_t *cache, const char *key,
+    const char *source_path, struct stat *source, char *headers, size_t headers_size,
+    char *body, size_t body_size) {
+  return response_cache_insert_rendered(cache, key, source_path, 0, source, headers,
+      headers_size, body, body_size);
+}
+
+static void *response_cache_watch(void *response_cache) {
+  response_cache_t *cache = (response_cache_t *) response_cache;
+  char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+
+  for (;;) {
+    ssize_t size = read(cache->inotify_fd, events, sizeof(events));
+    if (size < 0 && errno == EINTR) continue;
+    if (size <= 0) {
+      perror("Response cache watcher stopped");
+      break;
+    }
+
+    for (char *p = events; p < events + size; ) {
+      struct inotify_event *event = (struct inotify_event *) p;
+      p += sizeof(struct inotify_event) + event->len;
+
+      /* Fills that started before this point won't be published */
+      __atomic_add_fetch(&cache->generation, 1, __ATOMIC_SEQ_CST);
+      if (event->mask & IN_Q_OVERFLOW) {
+        response_cache_invalidate(cache, -1, NULL);
+      } else if (event->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED)) {
+        response_cache_invalidate(cache, event->wd, NULL);
+      } else if (event->len > 0) {
+        response_cache_invalidate(cache, event->wd, event->name);
+      }
+    }
+  }
+  return NULL;
+}
@@ -0,0 +1,87 @@
+#ifndef __RESPCACHE__
+#define __RESPCACHE__
+
+#include <pthread.h>
+#include <stddef.h>
+#include <sys/stat.h>
+#include <time.h>
+
+/* RESPCACHE keeps fully serialized responses (headers after the status and
+ * Connection lines, blank line, body) for hot request paths, so a hit is a
+ * lookup plus one writev(). The table is split into shards guarded by
+ * read-write locks; lookups only take the read lock and mark the entry
+ * referenced, eviction uses the CLOCK approximation of LRU to stay within
+ * each shard's share of the memory budget.
+ *
+ * Entries are invalidated through inotify watches on the directory of the
+ * file they were built from: any change to that name (write, attribute or
+ * mtime change, rename, delete) drops them. Rendered directory listings
+ * watch the directory itself and are dropped by any change in it. */
+
+#define RESPONSE_CACHE_SHARDS 16
+#define RESPONSE_CACHE_BUCKETS 256
+#define RESPONSE_CACHE_MAX_ENTRY (1 << 20)
+
+typedef struct response_cache_entry {
+  char *key;
+  char *data;                         // Serialized headers and body.
+  size_t size;
+  size_t header_size;                 // Bytes of data before the body.
+  int wd;                             // Watch on the source's directory.
+  char *name;                         // Source name in it, NULL for any.
+  int refcount;                       // One more while in a shard.
+  int referenced;                     // CLOCK bit, set on every hit.
+  struct response_cache_entry *hash_next;
+  struct response_cache_entry *next;  // CLOCK ring.
+  struct response_cache_entry *prev;
+} response_cache_entry_t;
+
+typedef struct response_cache_shard {
+  pthread_rwlock_t lock;
+  response_cache_entry_t *buckets[RESPONSE_CACHE_BUCKETS];
+  response_cache_entry_t *hand;
+  size_t size;
+} response_cache_shard_t;
+
+typedef struct response_cache {
+  response_cache_shard_t shards[RESPONSE_CACHE_SHARDS];
+  size_t shard_budget;
+  size_t max_entry;                   // Largest entry read from a file.
+  size_t max_rendered;                // Largest one rendered by us, these
+                                      // cost far more than a read() to redo.
+  int inotify_fd;
+  unsigned long generation;           // Bumped by every invalidation.
+  pthread_t watcher;
+} response_cache_t;
+
+/* Returns -1 if the cache can't be used, BUDGET is in bytes. */
+int response_cache_init(response_cache_t *cache, size_t budget);
+
+/* Returns the entry for KEY with a reference held, or NULL. */
+response_cache_entry_t *response_cache_get(response_cache_t *cache, const char *key);
+
+/* Releases an entry returned by response_cache_get() or _fill(). */
+void response_cache_put(response_cache_t *cache, response_cache_entry_t *entry);
+
+/* Builds an entry for KEY from HEADERS (without the blank line) followed by
+ * BODY_SIZE bytes of FD, watching SOURCE_PATH for changes. The entry is
+ * returned with a reference held; it is only published if nothing was
+ * invalidated while it was read. Returns NULL if it can't be cached. */
+response_cache_entry_t *response_cache_fill(response_cache_t *cache, const char *key,
+    const char *source_path, char *headers, size_t headers_size, int fd, size_t body_size);
+
+/* Caches BODY (a rendering of the directory DIR_PATH) for KEY. Any change in
+ * the directory drops it, and it is not published if the directory's mtime
+ * no longer matches DIR_MTIME, taken before it was read. */
+int response_cache_insert(response_cache_t *cache, const char *key, const char *dir_path,
+    struct timespec *dir_mtime, char *headers, size_t headers_size, char *body,
+    size_t body_size);
+
+/* Caches BODY, made from the file SOURCE_PATH (a compressed variant), for
+ * KEY. Changes to the file drop it, and it is not published if the file's
+ * inode or mtime no longer match SOURCE, taken before it was read. */
+int response_cache_insert_file(response_cache_t *cache, const char *key,
+    const char *source_path, struct stat *source, char *headers, size_t headers_size,
+    char *body, size_t body_size);
+
+#endif
@@ -1,13 +1,31 @@
+#include <limits.h>
+#include <linux/futex.h>
 #include <stdio.h>
+#include <sys/syscall.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "affinity.h"
+#include "metrics.h"
 #include "wq.h"
 #include "threadpool.h"
 
 static void *thread_pool_routine(void *thpool);
+static int thread_pool_spawn(threadpool* pool, int rate_limited);
+static void *thread_pool_steal_routine(void *thread_pool_worker);
 
-/* Init thread pool for processing queue */
-threadpool* thread_pool_init(int num_threads, wq_t* work_queue, void (*request_handler)(int)) {
+/* The worker the calling thread is, if any */
+static __thread thread_pool_worker_t *current_worker;
+
+/* The shared-queue pool the calling thread works for, if any */
+static __thread threadpool *current_pool;
+
+static void thread_pool_futex(unsigned int *word, int op, unsigned int value) {
+  syscall(SYS_futex, word, op | FUTEX_PRIVATE_FLAG, value, NULL, NULL, 0);
+}
+
+/* Alloc the pool and its parameters, without starting anything */
+static threadpool* thread_pool_alloc(int num_threads, void (*request_handler)(int)) {
 
   if(num_threads <= 0 || num_threads > MAX_THREADS) {
       return NULL;
@@ -15,7 +33,7 @@ threadpool* thread_pool_init(int num_threads, wq_t* work_queue, void (*request_h
 
   /* Init pool */
   threadpool* pool;
-  pool = (struct thread_pool*) malloc(sizeof(struct thread_pool));
+  pool = (struct thread_pool*) calloc(1, sizeof(struct thread_pool));
   if (pool == NULL) {
     perror("Init pool error");
     return NULL;
@@ -25,12 +43,104 @@ threadpool* thread_pool_init(int num_threads, wq_t* work_queue, void (*request_h
   pool->thread_count = 0;
   pool->shutdown = 0;
   pool->request_handler = request_handler;
-  pool->queue = work_queue;
+  pool->pin = affinity_enabled() && affinity_current() < 0;
 
   /* Threads */
   pool->threads = (pthread_t *) malloc(sizeof(pthread_t) * num_threads);
   if (pool->threads == NULL) {
     perror("Init threads error");
+    free(pool);
+    return NULL;
+  }
+
+  return pool;
+}
+
+/* Start worker threads, ARGS[i] is handed to the i-th one */
+static threadpool* thread_pool_start(threadpool* pool, int num_threads,
+    void *(*routine)(void *), void *args, size_t arg_size) {
+
+  for(int i = 0; i < num_threads; i++) {
+      void *arg = args ? (char *) args + i * arg_size : (void *) pool;
+      if(pthread_create(&(pool->threads[i]), NULL, routine, arg) != 0) {
+          thread_pool_shutdown(pool);
+          return NULL;
+      }
+      pool->thread_count++;
+  }
+
+  return pool;
+}
+
+static long long thread_pool_now_us(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+/* Start one more worker of the shared-queue pool. If RATE_LIMITED, it is
+ * only started if no other was in the last target latency, so the previous
+ * one gets a chance to make a dent in the queue first. */
+static int thread_pool_spawn(threadpool* pool, int rate_limited) {
+  long long now = thread_pool_now_us();
+  int status = -1;
+
+  pthread_mutex_lock(&(pool->lock));
+  if (pool->thread_count < pool->config.max_threads && !pool->shutdown
+      && (!rate_limited || now - pool->last_grow >= pool->config.target_latency_ms * 1000LL)) {
+    pthread_attr_t attr;
+    pthread_t thread;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if (pthread_create(&thread, &attr, thread_pool_routine, (void *) pool) == 0) {
+      pool->thread_count++;
+      pool->last_grow = now;
+      status = 0;
+    }
+    pthread_attr_destroy(&attr);
+  }
+  pthread_mutex_unlock(&(pool->lock));
+  return status;
+}
+
+/* Add a worker if tasks wait longer than the target, or if the queue is full */
+static void thread_pool_grow(threadpool* pool, int overloaded) {
+  if (__atomic_load_n(&pool->thread_count, __ATOMIC_RELAXED) >= pool->config.max_threads) {
+    return;
+  }
+  if (overloaded || wq_oldest_wait(pool->queue) > pool->config.target_latency_ms * 1000LL) {
+    thread_pool_spawn(pool, 1);
+  }
+}
+
+/* Init thread pool for processing queue */
+threadpool* thread_pool_init(int num_threads, wq_t* work_queue, void (*request_handler)(int)) {
+  thread_pool_config_t config = {
+    num_threads, num_threads, MAX_QUEUE, THREAD_POOL_TARGET_LATENCY,
+    THREAD_POOL_IDLE_TIMEOUT, THREAD_POOL_REJECT, NULL
+  };
+  return thread_pool_init_dynamic(&config, work_queue, request_handler);
+}
+
+/* Init a thread pool sized between CONFIG's bounds by queue latency */
+threadpool* thread_pool_init_dynamic(thread_pool_config_t* config, wq_t* work_queue,
+    void (*request_handler)(int)) {
+
+  if(config->min_threads <= 0 || config->max_threads < config->min_threads
+      || config->queue_size <= 0) {
+      return NULL;
+  }
+
+  threadpool* pool = thread_pool_alloc(config->max_threads, request_handler);
+  if (pool == NULL) {
+    return NULL;
+  }
+  pool->queue = work_queue;
+  pool->config = *config;
+
+  /* Init queue, its cells are the only allocation */
+  if (wq_init(work_queue, config->queue_size) != 0) {
+    perror("Init work queue error");
     return NULL;
   }
 
@@ -40,60 +150,285 @@ threadpool* thread_pool_init(int num_threads, wq_t* work_queue, void (*request_h
     return NULL;
   }
 
-  /* Start worker threads */
-  for(int i = 0; i < num_threads; i++) {
-      if(pthread_create(&(pool->threads[i]), NULL, thread_pool_routine, (void*)pool) != 0) {
+  /* Start the minimum of worker threads, the rest come with the load */
+  for(int i = 0; i < config->min_threads; i++) {
+      if(thread_pool_spawn(pool, 0) != 0) {
           thread_pool_shutdown(pool);
           return NULL;
       }
-      pool->thread_count++;
   }
 
   return pool;
 }
 
-/* Add client_socket_number to queue for processing */
-int thread_pool_add(threadpool* pool, int client_socket_number) {
+/* Init a work-stealing thread pool, where tasks from outside threads are
+ * spread over the workers' inboxes according to DISTRIBUTION */
+threadpool* thread_pool_init_stealing(int num_threads,
+    thread_pool_distribution_t distribution, void (*request_handler)(int)) {
 
-  if(pool == NULL) {
-    perror("thread_pool_add(): Pool is null.\n");
-    return -1;
+  threadpool* pool = thread_pool_alloc(num_threads, request_handler);
+  if (pool == NULL) {
+    return NULL;
   }
+  pool->distribution = distribution;
 
-  if(pthread_mutex_lock(&(pool->lock)) != 0) {
-    perror("thread_pool_add(): Can't lock.\n");
-    return -1;
+  /* Workers, their queues are set up by themselves */
+  pool->workers = calloc(num_threads, sizeof(thread_pool_worker_t));
+  pool->idle = malloc(sizeof(int) * num_threads);
+  if (pool->workers == NULL || pool->idle == NULL) {
+    perror("Init workers error");
+    return NULL;
   }
+  for(int i = 0; i < num_threads; i++) {
+    thread_pool_worker_t *worker = &pool->workers[i];
+    worker->pool = pool;
+    worker->id = i;
+    worker->cpu = pool->pin ? affinity_cpu(i) : affinity_current();
+  }
+  pool->worker_count = num_threads;
+
+  if(pthread_mutex_init(&(pool->idle_lock), NULL) != 0
+      || pthread_cond_init(&(pool->notify), NULL) != 0) {
+    perror("Init idle lock error");
+    return NULL;
+  }
+
+  if (thread_pool_start(pool, num_threads, thread_pool_steal_routine,
+      pool->workers, sizeof(thread_pool_worker_t)) == NULL) {
+    return NULL;
+  }
+
+  /* Nothing can be queued or stolen before every queue is there */
+  pthread_mutex_lock(&(pool->idle_lock));
+  while (pool->ready < num_threads) {
+    pthread_cond_wait(&(pool->notify), &(pool->idle_lock));
+  }
+  pool->started = 1;
+  pthread_cond_broadcast(&(pool->notify));
+  pthread_mutex_unlock(&(pool->idle_lock));
 
-  do {
-    if(pool->queue->size == MAX_QUEUE) {
-      perror("Queue full.\n");
-      break;
+  if (pool->failed) {
+    perror("Init worker queues error");
+    thread_pool_shutdown(pool);
+    return NULL;
+  }
+  return pool;
+}
+
+/* Pin WORKER if the pool does, then set up its queues where it runs. Returns
+ * -1 if the pool couldn't start, the worker just exits then. */
+static int thread_pool_worker_start(thread_pool_worker_t *worker) {
+  threadpool *pool = worker->pool;
+  if (pool->pin) {
+    affinity_pin(worker->cpu);
+  }
+  int failed = deque_init(&worker->deque, WORKER_DEQUE_SIZE) != 0
+      || wq_init(&worker->inbox, WORKER_INBOX_SIZE) != 0;
+
+  pthread_mutex_lock(&(pool->idle_lock));
+  pool->ready++;
+  pool->failed |= failed;
+  pthread_cond_broadcast(&(pool->notify));
+  while (!pool->started) {
+    pthread_cond_wait(&(pool->notify), &(pool->idle_lock));
+  }
+  pthread_mutex_unlock(&(pool->idle_lock));
+  return pool->failed ? -1 : 0;
+}
+
+/* Run a task, client sockets are closed once served */
+static void thread_pool_run(threadpool* pool, task_t* task) {
+  if (task->function != NULL) {
+    task->function(task->arg);
+  } else {
+    metrics_record(METRIC_QUEUE_WAIT, metrics_now_us() - task->accepted);
+    metrics_count(METRIC_DEQUEUED, 1);
+    metrics_count(METRIC_OPENED, 1);
+    affinity_account(task->client_socket_fd);
+    pool->request_handler(task->client_socket_fd);
+    close(task->client_socket_fd);
+    metrics_count(METRIC_CLOSED, 1);
+  }
+}
+
+/* Turn a task away. Only sockets can be refused; a shed generic task is
+ * run right here instead, it was due anyway. */
+static void thread_pool_reject(threadpool* pool, task_t* task) {
+  if (task->function != NULL) {
+    task->function(task->arg);
+    return;
+  }
+  metrics_count(METRIC_REJECTED, 1);
+  if (pool != NULL && pool->config.reject_handler != NULL) {
+    pool->config.reject_handler(task->client_socket_fd);
+  }
+  close(task->client_socket_fd);
+}
+
+/* Take the I-th worker off the idle stack, caller holds the idle lock */
+static thread_pool_worker_t *thread_pool_unidle(threadpool* pool, int i) {
+  int id = pool->idle[i];
+  pool->idle[i] = pool->idle[pool->idle_count - 1];
+  __atomic_store_n(&pool->idle_count, pool->idle_count - 1, __ATOMIC_SEQ_CST);
+  return &pool->workers[id];
+}
+
+/* Wake an idle worker to look for tasks, unless one already is. The woken
+ * worker starts out counted as searching, so wakeups aren't repeated while
+ * it gets scheduled. */
+static void thread_pool_notify(threadpool* pool) {
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&pool->searching, __ATOMIC_SEQ_CST) > 0
+      || __atomic_load_n(&pool->idle_count, __ATOMIC_SEQ_CST) == 0) {
+    return;
+  }
+
+  thread_pool_worker_t *worker = NULL;
+  pthread_mutex_lock(&(pool->idle_lock));
+  if (pool->idle_count > 0 && __atomic_load_n(&pool->searching, __ATOMIC_SEQ_CST) == 0) {
+    worker = thread_pool_unidle(pool, pool->idle_count - 1);
+    __atomic_add_fetch(&pool->searching, 1, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&worker->wake, 1, __ATOMIC_RELEASE);
+  }
+  pthread_mutex_unlock(&(pool->idle_lock));
+
+  if (worker != NULL) {
+    thread_pool_futex(&worker->wake, FUTEX_WAKE, 1);
+  }
+}
+
+/* Pick the worker whose inbox gets TASK from an outside thread */
+static thread_pool_worker_t *thread_pool_pick(threadpool* pool, task_t* task) {
+  unsigned int next = __atomic_fetch_add(&pool->next_worker, 1, __ATOMIC_RELAXED);
+  int picked = next % pool->worker_count;
+
+  /* The next worker on the CPU the socket's packets are on, if any is */
+  if (pool->distribution == THREAD_POOL_INCOMING_CPU && task->function == NULL) {
+    int cpu = affinity_incoming_cpu(task->client_socket_fd);
+    for (int i = 0; cpu >= 0 && i < pool->worker_count; i++) {
+      int id = (next + i) % pool->worker_count;
+      if (pool->workers[id].cpu == cpu) {
+        return &pool->workers[id];
+      }
     }
+  }
 
-    if(pool->shutdown) {
-      perror("Pool shutdown.\n");
-      break;
+  if (pool->distribution == THREAD_POOL_LEAST_LOADED) {
+    /* Scan from the round-robin pick so ties are spread out */
+    int least = INT_MAX;
+    for (int i = 0; i < pool->worker_count; i++) {
+      int id = (next + i) % pool->worker_count;
+      thread_pool_worker_t *worker = &pool->workers[id];
+      int load = wq_size(&worker->inbox) + deque_size(&worker->deque)
+          + __atomic_load_n(&worker->busy, __ATOMIC_RELAXED);
+      if (load < least) {
+        least = load;
+        picked = id;
+      }
     }
+  }
+  return &pool->workers[picked];
+}
 
-    /* Add task to queue */
+/* Queue TASK on a work-stealing pool */
+static int thread_pool_push(threadpool* pool, task_t* task) {
+  thread_pool_worker_t *worker = current_worker;
+  if (worker == NULL || worker->pool != pool || deque_push(&worker->deque, task) != 0) {
+    /* Outside threads, and workers with a full deque, use the inboxes */
+    worker = thread_pool_pick(pool, task);
+    int i = 0;
+    while (wq_push_task(&pool->workers[(worker->id + i) % pool->worker_count].inbox,
+        task) != 0) {
+      if (++i == pool->worker_count) {
+        return -1;
+      }
+    }
+  }
+  thread_pool_notify(pool);
+  return 0;
+}
 
-    wq_push(pool->queue, client_socket_number);
+/* Hand TASK to the shared queue, applying the overload policy if full */
+static int thread_pool_enqueue(threadpool* pool, task_t* task) {
+  if (wq_push_task(pool->queue, task) == 0) {
+    thread_pool_grow(pool, 0);
+    return 0;
+  }
 
-    /* Unblock waiting thread */
-    if(pthread_cond_signal(&(pool->notify)) != 0) {
-      perror("pthread_cond_signal(): Can't notify.\n");
-      break;
+  /* More hands first */
+  thread_pool_grow(pool, 1);
+  if (pool->config.overload == THREAD_POOL_BLOCK) {
+    struct timespec pause = { 0, 1000000 };
+    while (wq_push_task(pool->queue, task) != 0) {
+      if (__atomic_load_n(&pool->shutdown, __ATOMIC_RELAXED)) {
+        return -1;
+      }
+      nanosleep(&pause, NULL);
+      thread_pool_grow(pool, 1);
     }
-  } while(0);
+    return 0;
+  }
+  if (pool->config.overload == THREAD_POOL_SHED_OLDEST) {
+    task_t oldest;
+    while (wq_push_task(pool->queue, task) != 0) {
+      if (wq_try_pop_task(pool->queue, &oldest) == 0) {
+        if (oldest.function == NULL) {
+          metrics_count(METRIC_DEQUEUED, 1);
+        }
+        thread_pool_reject(pool, &oldest);
+      }
+    }
+    return 0;
+  }
+  return -1;
+}
+
+static int thread_pool_queue(threadpool* pool, task_t* task) {
+
+  if(pool == NULL) {
+    perror("thread_pool_add(): Pool is null.\n");
+    return -1;
+  }
+
+  if(__atomic_load_n(&pool->shutdown, __ATOMIC_RELAXED)) {
+    perror("Pool shutdown.\n");
+    return -1;
+  }
 
-  if(pthread_mutex_unlock(&pool->lock) != 0) {
-    perror("pthread_mutex_unlock(): Can't unlock");
+  /* Add task to queue, a parked worker is woken up by it */
+  int status = pool->workers ? thread_pool_push(pool, task) : thread_pool_enqueue(pool, task);
+  if(status != 0) {
+    perror("Queue full.\n");
+    return -1;
+  }
+  if (task->function == NULL) {
+    metrics_count(METRIC_ENQUEUED, 1);
+  }
+  return 0;
+}
+
+/* Add client_socket_number to queue for processing */
+int thread_pool_add(threadpool* pool, int client_socket_number) {
+  task_t task = { NULL, NULL, client_socket_number, metrics_now_us() };
+  if (thread_pool_queue(pool, &task) != 0) {
+    thread_pool_reject(pool, &task);
     return -1;
   }
   return 0;
 };
 
+int thread_pool_submit(threadpool* pool, void (*function)(void *), void *arg) {
+  task_t task = { function, arg, -1 };
+  return thread_pool_queue(pool, &task);
+}
+
+
+int thread_pool_backlog(void) {
+  if (current_worker) {
+    return deque_size(&current_worker->deque) + wq_size(&current_worker->inbox);
+  }
+  return current_pool ? wq_size(current_pool->queue) : 0;
+}
 
 /* Shutdown the pool */
 int thread_pool_shutdown(threadpool* pool) {
@@ -103,36 +438,64 @@ int thread_pool_shutdown(threadpool* pool) {
     return -1;
   }
 
-  if(pthread_mutex_lock(&(pool->lock)) != 0) {
-    perror("thread_pool_shutdown(): Can't lock.\n");
-    return -1;
-  }
-
-  do {
-      if(pool->shutdown) {
-        break;
-      }
+  /* Wake up all worker threads, they exit once the queues are drained */
+  if (pool->workers) {
+    pthread_mutex_lock(&(pool->idle_lock));
+    if (pool->shutdown) {
+      pthread_mutex_unlock(&(pool->idle_lock));
+      return 0;
+    }
+    __atomic_store_n(&pool->shutdown, 1, __ATOMIC_RELAXED);
 
-      pool->shutdown = 1;
+    /* Workers still waiting for the others to start won't run at all */
+    if (!pool->started) {
+      pool->failed = 1;
+      pool->started = 1;
+      pthread_cond_broadcast(&(pool->notify));
+    }
+    while (pool->idle_count > 0) {
+      thread_pool_worker_t *worker = thread_pool_unidle(pool, pool->idle_count - 1);
+      __atomic_add_fetch(&pool->searching, 1, __ATOMIC_SEQ_CST);
+      __atomic_store_n(&worker->wake, 1, __ATOMIC_RELEASE);
+      thread_pool_futex(&worker->wake, FUTEX_WAKE, 1);
+    }
+    pthread_mutex_unlock(&(pool->idle_lock));
 
-      /* Wake up all worker threads */
-      if((pthread_cond_broadcast(&(pool->notify)) != 0) || (pthread_mutex_unlock(&(pool->lock)) != 0)) {
-        perror("Can't broadcast or can't lock.\n");
-        break;
+    /* Join all worker thread */
+    for(int i = 0; i < pool->thread_count; i++) {
+      if (pthread_join(pool->threads[i], NULL) != 0) {
+        perror("pthread_join(): Error.\n");
       }
+    }
+  } else {
+    pthread_mutex_lock(&(pool->lock));
+    if (pool->shutdown) {
+      pthread_mutex_unlock(&(pool->lock));
+      return 0;
+    }
+    __atomic_store_n(&pool->shutdown, 1, __ATOMIC_RELAXED);
+    wq_close(pool->queue);
 
-      /* Join all worker thread */
-      for(int i = 0; i < pool->thread_count; i++) {
-        if (pthread_join(pool->threads[i], NULL) != 0) {
-          perror("pthread_join(): Error.\n");
-        }
-      }
-  } while(0);
+    /* Workers are detached, wait for the last one to leave */
+    while (pool->thread_count > 0) {
+      pthread_cond_wait(&(pool->notify), &(pool->lock));
+    }
+    pthread_mutex_unlock(&(pool->lock));
+    pthread_mutex_destroy(&(pool->lock));
+    pthread_cond_destroy(&(pool->notify));
+  }
 
+  if (pool->workers) {
+    for(int i = 0; i < pool->worker_count; i++) {
+      free(pool->workers[i].deque.tasks);
+      free(pool->workers[i].inbox.cells);
+    }
+    pthread_mutex_destroy(&(pool->idle_lock));
+    pthread_cond_destroy(&(pool->notify));
+    free(pool->workers);
+    free(pool->idle);
+  }
   free(pool->threads);
-  pthread_mutex_lock(&(pool->lock));
-  pthread_mutex_destroy(&(pool->lock));
-  pthread_cond_destroy(&(pool->notify));
   free(pool);
   return 0;
 };
@@ -141,33 +504,142 @@ int thread_pool_shutdown(threadpool* pool) {
 static void *thread_pool_routine(void *thpool) {
 
     threadpool *pool = (threadpool *) thpool;
-    int client_socket_number;
+    task_t task;
 
-    for(;;) {
-        /* Lock first */
-        pthread_mutex_lock(&(pool->lock));
+    if (pool->pin) {
+        affinity_pin(affinity_cpu(__atomic_fetch_add(&pool->pinned, 1, __ATOMIC_RELAXED)));
+    }
 
-        /* Then wait on condition variable */
-        while ((pool->queue->size == 0) && (!pool->shutdown)) {
-            pthread_cond_wait(&(pool->notify), &(pool->lock));
+    current_pool = pool;
+    for(;;) {
+        /* Workers above the minimum only wait so long for a task */
+        int timeout = __atomic_load_n(&pool->thread_count, __ATOMIC_RELAXED)
+            > pool->config.min_threads ? pool->config.idle_timeout_ms : -1;
+
+        /* Pull a task out of queue */
+        if (wq_pop_task_timeout(pool->queue, &task, timeout) == 0) {
+            /* Serve request */
+            thread_pool_run(pool, &task);
+            continue;
         }
 
-        if (pool->shutdown || pool->queue->size == 0) {
+        pthread_mutex_lock(&(pool->lock));
+        if (pool->shutdown || pool->thread_count > pool->config.min_threads) {
             break;
         }
+        pthread_mutex_unlock(&(pool->lock));
+    }
 
-        /* Pull client_socket_number out of queue */
-        client_socket_number = wq_pop(pool->queue);
+    pool->thread_count--;
+    pthread_cond_broadcast(&(pool->notify));
+    pthread_mutex_unlock(&(pool->lock));
+    return(NULL);
+}
 
-        /* Unlock */
-        pthread_mutex_unlock(&(pool->lock));
+/* Own work first, newest first; then the oldest work of the others */
+static int thread_pool_take(thread_pool_worker_t *worker, task_t *task) {
+  threadpool *pool = worker->pool;
+
+  if (deque_pop(&worker->deque, task) == 0 || wq_try_pop_task(&worker->inbox, task) == 0) {
+    return 0;
+  }
+
+  for (int i = 1; i < pool->worker_count; i++) {
+    thread_pool_worker_t *victim = &pool->workers[(worker->id + i) % pool->worker_count];
+    if (deque_steal(&victim->deque, task) == 0 || wq_try_pop_task(&victim->inbox, task) == 0) {
+      return 0;
+    }
+  }
+  return -1;
+}
+
+/* Stop searching; if we were the last searcher, someone else takes over
+ * in case more tasks came in than we're taking */
+static void thread_pool_stop_searching(threadpool *pool, int found) {
+  if (__atomic_sub_fetch(&pool->searching, 1, __ATOMIC_SEQ_CST) == 0 && found) {
+    thread_pool_notify(pool);
+  }
+}
+
+/* Put WORKER on the idle stack and sleep until a notify takes it off.
+ * Returns 1 when woken up (as a searcher), 0 if a task showed up in TASK
+ * meanwhile, or -1 if the pool is shutting down. */
+static int thread_pool_park(thread_pool_worker_t *worker, task_t *task) {
+  threadpool *pool = worker->pool;
+
+  pthread_mutex_lock(&(pool->idle_lock));
+  if (pool->shutdown) {
+    pthread_mutex_unlock(&(pool->idle_lock));
+    return -1;
+  }
+  worker->wake = 0;
+  pool->idle[pool->idle_count] = worker->id;
+  __atomic_store_n(&pool->idle_count, pool->idle_count + 1, __ATOMIC_SEQ_CST);
+  pthread_mutex_unlock(&(pool->idle_lock));
+
+  /* Pairs with the fence in thread_pool_notify(): either its caller sees
+   * us idle or we see its task */
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if (thread_pool_take(worker, task) == 0) {
+    int claimed = 1;
+    pthread_mutex_lock(&(pool->idle_lock));
+    for (int i = 0; i < pool->idle_count; i++) {
+      if (pool->idle[i] == worker->id) {
+        thread_pool_unidle(pool, i);
+        claimed = 0;
+        break;
+      }
+    }
+    pthread_mutex_unlock(&(pool->idle_lock));
+
+    /* A notify counted us as searching already */
+    if (claimed) {
+      thread_pool_stop_searching(pool, 1);
+    }
+    return 0;
+  }
+
+  while (__atomic_load_n(&worker->wake, __ATOMIC_ACQUIRE) == 0) {
+    thread_pool_futex(&worker->wake, FUTEX_WAIT, 0);
+  }
+  return 1;
+}
+
+static void *thread_pool_steal_routine(void *thread_pool_worker) {
+
+    thread_pool_worker_t *worker = (thread_pool_worker_t *) thread_pool_worker;
+    threadpool *pool = worker->pool;
+    int searching = 0;
+    task_t task;
+
+    if (thread_pool_worker_start(worker) < 0) {
+        return NULL;
+    }
+    current_worker = worker;
+    for (;;) {
+        int found = thread_pool_take(worker, &task) == 0;
+        if (searching) {
+            searching = 0;
+            thread_pool_stop_searching(pool, found);
+        }
+
+        if (!found) {
+            int parked = thread_pool_park(worker, &task);
+            if (parked < 0) {
+                break;
+            }
+            if (parked > 0) {
+                searching = 1;
+                continue;
+            }
+        }
 
         /* Serve request */
-        pool->request_handler(client_socket_number);
-        close(client_socket_number);
+        __atomic_store_n(&worker->busy, 1, __ATOMIC_RELAXED);
+        thread_pool_run(pool, &task);
+        __atomic_store_n(&worker->busy, 0, __ATOMIC_RELAXED);
     }
 
-    pthread_mutex_unlock(&(pool->lock));
     pthread_exit(NULL);
     return(NULL);
 }
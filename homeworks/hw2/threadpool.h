@@ -3,25 +3,110 @@
 
 #include <pthread.h>
 #include <stdlib.h>
+#include "deque.h"
 #include "wq.h"
 
 #define MAX_THREADS 64
 #define MAX_QUEUE 65536
+#define WORKER_DEQUE_SIZE 4096
+#define WORKER_INBOX_SIZE 4096
+#define THREAD_POOL_TARGET_LATENCY 20    // ms
+#define THREAD_POOL_IDLE_TIMEOUT 30000   // ms
 
+/* How a work-stealing pool hands tasks from outside threads to workers */
+typedef enum {
+  THREAD_POOL_ROUND_ROBIN,
+  THREAD_POOL_LEAST_LOADED,
+  THREAD_POOL_INCOMING_CPU,   // A socket to a worker on the CPU its packets are on.
+} thread_pool_distribution_t;
+
+/* What thread_pool_add() does with a socket when the queue is full */
+typedef enum {
+  THREAD_POOL_REJECT,       // Turn the new one away.
+  THREAD_POOL_BLOCK,        // Wait for room, the listen backlog fills instead.
+  THREAD_POOL_SHED_OLDEST,  // Turn away the one that waited longest.
+} thread_pool_overload_t;
+
+/* Sizing of the shared-queue pool. It starts MIN_THREADS workers and adds
+ * one (up to MAX_THREADS) whenever the oldest queued task has waited over
+ * TARGET_LATENCY_MS; workers above the minimum exit after IDLE_TIMEOUT_MS
+ * without a task. Turned away sockets are passed to REJECT_HANDLER, if
+ * any, before being closed. */
+typedef struct thread_pool_config {
+  int min_threads;
+  int max_threads;
+  int queue_size;
+  int target_latency_ms;
+  int idle_timeout_ms;
+  thread_pool_overload_t overload;
+  void (*reject_handler)(int);
+} thread_pool_config_t;
+
+typedef struct thread_pool_worker {
+  struct thread_pool *pool;
+  int id;
+  int cpu;              // Pinned to it, -1 if not.
+  deque_t deque;        // Tasks submitted by the worker itself.
+  wq_t inbox;           // Tasks handed over by other threads.
+  int busy;
+  unsigned int wake;    // Futex word, set when taken off the idle stack.
+} thread_pool_worker_t;
+
+/* Workers of the shared-queue pool block in wq_pop(), the queue itself does
+ * the waking; the lock only guards starting and stopping them. A
+ * work-stealing pool has no shared queue: each worker serves its own deque
+ * and inbox, then steals from the others before going idle.
+ *
+ * With a CPU list (see affinity.h), workers of a pool started from an
+ * unpinned thread take its CPUs in turn; a work-stealing worker allocates
+ * its own deque and inbox once pinned, so they sit on its NUMA node. */
 typedef struct thread_pool {
   pthread_mutex_t lock;
-  pthread_cond_t notify;
+  pthread_cond_t notify;          // Signaled when a worker exits, or starts
+                                  // in a work-stealing pool.
   pthread_t *threads;
   wq_t *queue;
   void (*request_handler)(int);
   int thread_count;
   int shutdown;
+  thread_pool_config_t config;
+  long long last_grow;            // When a worker was last added, in us.
+  int pin;                        // Pin workers to the CPUs of the list.
+  unsigned int pinned;            // Workers pinned so far.
+
+  thread_pool_worker_t *workers;  // NULL without work stealing.
+  int worker_count;
+  thread_pool_distribution_t distribution;
+  unsigned int next_worker;
+  int searching;                  // Workers awake and looking for tasks.
+  pthread_mutex_t idle_lock;      // Only taken to park and unpark workers,
+  int *idle;                      // and while the workers start.
+  int idle_count;
+  int ready;                      // Workers with their queues set up.
+  int started;                    // All are, or some never will be.
+  int failed;
 } threadpool;
 
 threadpool* thread_pool_init(int num_threads, wq_t* work_queue, void (*request_handler)(int));
 
+threadpool* thread_pool_init_dynamic(thread_pool_config_t* config, wq_t* work_queue,
+    void (*request_handler)(int));
+
+threadpool* thread_pool_init_stealing(int num_threads,
+    thread_pool_distribution_t distribution, void (*request_handler)(int));
+
+/* Queues a client socket, the pool owns it from then on. Returns -1 if it
+ * was turned away. */
 int thread_pool_add(threadpool* thpool, int client_socket_number);
 
+/* Runs FUNCTION(ARG) on the pool. Tasks submitted by a worker of a
+ * work-stealing pool go to its own deque. */
+int thread_pool_submit(threadpool* thpool, void (*function)(void *), void *arg);
+
+/* Tasks waiting for the calling worker: in the shared queue, or in its own
+ * deque and inbox with work stealing. 0 outside a pool. */
+int thread_pool_backlog(void);
+
 int thread_pool_shutdown(threadpool* thpool);
 
 #endif
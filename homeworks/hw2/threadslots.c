@@ -0,0 +1,63 @@
+#include <pthread.h>
+#include <stdlib.h>
+
+#include "threadslots.h"
+
+static pthread_mutex_t key_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Hand the block of an exiting thread to the next new one */
+static void thread_slots_release(void *slot) {
+  __atomic_store_n(&((thread_slot_t *) slot)->owned, 0, __ATOMIC_RELEASE);
+}
+
+static int thread_slots_key(thread_slots_t *slots) {
+  if (__atomic_load_n(&slots->key_ready, __ATOMIC_ACQUIRE)) {
+    return 0;
+  }
+  pthread_mutex_lock(&key_lock);
+  if (!slots->key_ready && pthread_key_create(&slots->key, thread_slots_release) == 0) {
+    __atomic_store_n(&slots->key_ready, 1, __ATOMIC_RELEASE);
+  }
+  pthread_mutex_unlock(&key_lock);
+  return slots->key_ready ? 0 : -1;
+}
+
+void *thread_slots_claim(thread_slots_t *slots) {
+  if (thread_slots_key(slots) < 0) {
+    return NULL;
+  }
+
+  thread_slot_t *slot = NULL;
+  int count = thread_slots_count(slots);
+  for (int i = 0; i < count && slot == NULL; i++) {
+    int released = 0;
+    if (__atomic_load_n(&slots->slots[i].block, __ATOMIC_ACQUIRE) != NULL
+        && __atomic_compare_exchange_n(&slots->slots[i].owned, &released, 1, 0,
+          __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+      slot = &slots->slots[i];
+    }
+  }
+
+  if (slot == NULL) {
+    int i = __atomic_fetch_add(&slots->count, 1, __ATOMIC_ACQ_REL);
+    void *block;
+    if (i >= slots->max || (block = calloc(1, slots->block_size)) == NULL) {
+      return NULL;
+    }
+    slot = &slots->slots[i];
+    slot->owned = 1;
+    __atomic_store_n(&slot->block, block, __ATOMIC_RELEASE);
+  }
+
+  pthread_setspecific(slots->key, slot);
+  return slot->block;
+}
+
+int thread_slots_count(thread_slots_t *slots) {
+  int count = __atomic_load_n(&slots->count, __ATOMIC_ACQUIRE);
+  return count < slots->max ? count : slots->max;
+}
+
+void *thread_slots_get(thread_slots_t *slots, int i) {
+  return __atomic_load_n(&slots->slots[i].block, __ATOMIC_ACQUIRE);
+}
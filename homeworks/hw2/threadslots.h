@@ -0,0 +1,42 @@
+#ifndef __THREADSLOTS__
+#define __THREADSLOTS__
+
+#include <pthread.h>
+#include <stddef.h>
+
+/* THREADSLOTS gives every thread a block of its own, for data one thread
+ * writes and others only read, like per-thread counters or log rings. A
+ * thread claims a block released by an exited one if there is one, or
+ * appends a new one; blocks are never freed, so readers can walk them all
+ * without a lock, and a reused one keeps what its last owner left in it. */
+
+typedef struct thread_slot {
+  void *block;
+  int owned;                  // Cleared when the owner exits.
+} thread_slot_t;
+
+typedef struct thread_slots {
+  thread_slot_t *slots;
+  int max;
+  size_t block_size;
+  int count;                  // Slots handed out, may overshoot MAX.
+  int key_ready;
+  pthread_key_t key;
+} thread_slots_t;
+
+/* Static initializer for slots in the array SLOTS, of BLOCK_SIZE bytes */
+#define THREAD_SLOTS_INITIALIZER(slots, block_size) \
+  { (slots), sizeof(slots) / sizeof((slots)[0]), (block_size), 0, 0, 0 }
+
+/* The calling thread's block, zeroed when new. NULL once every slot is
+ * taken. Callers keep it in a __thread variable, this isn't meant for every
+ * use. */
+void *thread_slots_claim(thread_slots_t *slots);
+
+/* Slots to look at with thread_slots_get() */
+int thread_slots_count(thread_slots_t *slots);
+
+/* The block in slot I, NULL if it isn't there yet. */
+void *thread_slots_get(thread_slots_t *slots, int i);
+
+#endif
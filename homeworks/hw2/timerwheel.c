@@ -0,0 +1,118 @@
+#include <string.h>
+
+#include "timerwheel.h"
+#include "utlist.h"
+
+#define TIMER_WHEEL_SPAN (1LL << (TIMER_WHEEL_LEVELS * TIMER_WHEEL_BITS))
+
+void timer_wheel_init(timer_wheel_t *wheel, long long now) {
+  memset(wheel, 0, sizeof(timer_wheel_t));
+  wheel->now = now;
+}
+
+/* Put TIMER in the slot for its deadline, as seen from the wheel's now: the
+ * lowest level whose span covers it, at the slot its deadline falls in */
+static void timer_wheel_place(timer_wheel_t *wheel, timer_wheel_timer_t *timer) {
+  long long expires = timer->expires > wheel->now ? timer->expires : wheel->now;
+  if (expires - wheel->now >= TIMER_WHEEL_SPAN) {
+    expires = wheel->now + TIMER_WHEEL_SPAN - 1;
+  }
+
+  long long delta = expires - wheel->now;
+  int level = 0;
+  while (level < TIMER_WHEEL_LEVELS - 1 && delta >= 1LL << ((level + 1) * TIMER_WHEEL_BITS)) {
+    level++;
+  }
+  int index = (expires >> (level * TIMER_WHEEL_BITS)) & (TIMER_WHEEL_SLOTS - 1);
+
+  timer->slot = &wheel->slots[level][index];
+  DL_APPEND(*timer->slot, timer);
+}
+
+void timer_wheel_add(timer_wheel_t *wheel, timer_wheel_timer_t *timer, long long expires) {
+  timer_wheel_remove(wheel, timer);
+  timer->expires = expires;
+  timer_wheel_place(wheel, timer);
+  wheel->count++;
+}
+
+void timer_wheel_remove(timer_wheel_t *wheel, timer_wheel_timer_t *timer) {
+  if (timer->slot == NULL) return;
+  DL_DELETE(*timer->slot, timer);
+  timer->slot = NULL;
+  wheel->count--;
+}
+
+/* Spread a slot of LEVEL over the levels below, now that the wheel got to it */
+static void timer_wheel_cascade(timer_wheel_t *wheel, int level) {
+  int index = (wheel->now >> (level * TIMER_WHEEL_BITS)) & (TIMER_WHEEL_SLOTS - 1);
+  timer_wheel_timer_t *timers = wheel->slots[level][index];
+  wheel->slots[level][index] = NULL;
+
+  while (timers != NULL) {
+    timer_wheel_timer_t *timer = timers;
+    DL_DELETE(timers, timer);
+    timer_wheel_place(wheel, timer);
+  }
+}
+
+void timer_wheel_advance(timer_wheel_t *wheel, long long now,
+    void (*expire)(timer_wheel_timer_t *timer, void *arg), void *arg) {
+  /* Nothing to expire on the way */
+  if (wheel->count == 0) {
+    if (now >= wheel->now) wheel->now = now + 1;
+    return;
+  }
+
+  for (; wheel->now <= now; wheel->now++) {
+    for (int level = 1; level < TIMER_WHEEL_LEVELS; level++) {
+      if (wheel->now & ((1LL << (level * TIMER_WHEEL_BITS)) - 1)) break;
+      timer_wheel_cascade(wheel, level);
+    }
+
+    /* One at a time, EXPIRE may remove the next one */
+    timer_wheel_timer_t **slot = &wheel->slots[0][wheel->now & (TIMER_WHEEL_SLOTS - 1)];
+    while (*slot != NULL) {
+      timer_wheel_timer_t *timer = *slot;
+      DL_DELETE(*slot, timer);
+      timer->slot = NULL;
+      if (timer->expires > wheel->now) {
+        /* Beyond the span when armed, on to the next leg */
+        timer_wheel_place(wheel, timer);
+        continue;
+      }
+      wheel->count--;
+      expire(timer, arg);
+    }
+  }
+}
+
+int timer_wheel_timeout(timer_wheel_t *wheel, long long now) {
+  if (wheel->count == 0) {
+    return -1;
+  }
+
+  /* The first level 0 timer to fire, or the first slot above to cascade */
+  long long next = wheel->now + TIMER_WHEEL_SPAN;
+  for (int i = 0; i < TIMER_WHEEL_SLOTS; i++) {
+    if (wheel->slots[0][(wheel->now + i) & (TIMER_WHEEL_SLOTS - 1)] != NULL) {
+      next = wheel->now + i;
+      break;
+    }
+  }
+  for (int level = 1; level < TIMER_WHEEL_LEVELS; level++) {
+    int shift = level * TIMER_WHEEL_BITS;
+    long long base = wheel->now >> shift;
+    /* The current slot was cascaded already, unless the wheel is right at it */
+    int first = (wheel->now & ((1LL << shift) - 1)) == 0 ? 0 : 1;
+    for (int i = first; i <= TIMER_WHEEL_SLOTS && ((base + i) << shift) < next; i++) {
+      if (wheel->slots[level][(base + i) & (TIMER_WHEEL_SLOTS - 1)] != NULL) {
+        next = (base + i) << shift;
+        break;
+      }
+    }
+  }
+
+  long long timeout = next - now;
+  return timeout < 0 ? 0 : timeout > 1 << 30 ? 1 << 30 : (int) timeout;
+}
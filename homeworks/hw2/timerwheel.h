@@ -0,0 +1,45 @@
+#ifndef __TIMERWHEEL__
+#define __TIMERWHEEL__
+
+/* TIMERWHEEL keeps deadlines in a hierarchical timing wheel: levels of 64
+ * slots of 1 ms, 64 ms, 4 s and 4.4 min, so arming, moving and removing a
+ * timer are O(1) however many there are. The timers of a higher level slot
+ * are spread over the levels below when the wheel gets to it, and fire from
+ * level 0 on their millisecond. Deadlines beyond the span (4.6 hours) wait
+ * at its end until they're in reach. Not thread safe, every event loop has
+ * its own wheel. */
+
+#define TIMER_WHEEL_BITS 6
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_LEVELS 4
+
+typedef struct timer_wheel_timer {
+  long long expires;                  // ms
+  void *data;
+  struct timer_wheel_timer **slot;    // NULL when not armed.
+  struct timer_wheel_timer *next;
+  struct timer_wheel_timer *prev;
+} timer_wheel_timer_t;
+
+typedef struct timer_wheel {
+  long long now;                      // Next ms to expire, all before are done.
+  int count;
+  timer_wheel_timer_t *slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+} timer_wheel_t;
+
+void timer_wheel_init(timer_wheel_t *wheel, long long now);
+
+/* Arms TIMER to fire at EXPIRES ms, moving it if it already was. */
+void timer_wheel_add(timer_wheel_t *wheel, timer_wheel_timer_t *timer, long long expires);
+void timer_wheel_remove(timer_wheel_t *wheel, timer_wheel_timer_t *timer);
+
+/* Moves the wheel on to NOW ms, calling EXPIRE with every timer due by then,
+ * already disarmed. EXPIRE may arm and remove timers. */
+void timer_wheel_advance(timer_wheel_t *wheel, long long now,
+    void (*expire)(timer_wheel_timer_t *timer, void *arg), void *arg);
+
+/* Milliseconds from NOW until the wheel has something to do, -1 if it has
+ * no timers. */
+int timer_wheel_timeout(timer_wheel_t *wheel, long long now);
+
+#endif
@@ -0,0 +1,236 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <linux/time_types.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "uring.h"
+
+/* Operations the loops submit */
+static const int uring_required_ops[] = {
+  IORING_OP_ACCEPT, IORING_OP_RECV, IORING_OP_SEND, IORING_OP_POLL_ADD
+};
+
+static int uring_setup(unsigned int entries, struct io_uring_params *params) {
+  return (int) syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int uring_enter(int fd, unsigned int submit, unsigned int wait, unsigned int flags,
+    void *arg, size_t arg_size) {
+  return (int) syscall(__NR_io_uring_enter, fd, submit, wait, flags, arg, arg_size);
+}
+
+static int uring_register(int fd, unsigned int opcode, void *arg, unsigned int count) {
+  return (int) syscall(__NR_io_uring_register, fd, opcode, arg, count);
+}
+
+/* Fail with ENOSYS unless the kernel knows every operation we submit */
+static int uring_probe(uring_t *ring) {
+  size_t size = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+  struct io_uring_probe *probe = calloc(1, size);
+  if (probe == NULL) {
+    return -1;
+  }
+  int status = uring_register(ring->fd, IORING_REGISTER_PROBE, probe, 256);
+  for (int i = 0; status == 0 && i < sizeof(uring_required_ops) / sizeof(int); i++) {
+    int op = uring_required_ops[i];
+    if (op > probe->last_op || !(probe->ops[op].flags & IO_URING_OP_SUPPORTED)) {
+      errno = ENOSYS;
+      status = -1;
+    }
+  }
+  free(probe);
+  return status;
+}
+
+int uring_init(uring_t *ring, unsigned int entries) {
+  memset(ring, 0, sizeof(uring_t));
+  ring->fd = -1;
+
+  /* Completions are only reaped by the one thread submitting, let the
+   * kernel skip waking us for every one of them when it can */
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SUBMIT_ALL
+      | IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+  params.cq_entries = entries * 4;
+  ring->fd = uring_setup(entries, &params);
+  if (ring->fd < 0 && errno == EINVAL) {
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_CQSIZE;
+    params.cq_entries = entries * 4;
+    ring->fd = uring_setup(entries, &params);
+  }
+  if (ring->fd < 0) {
+    return -1;
+  }
+
+  unsigned int needed = IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP | IORING_FEAT_EXT_ARG;
+  ring->features = params.features;
+  if ((params.features & needed) != needed) {
+    errno = ENOSYS;
+    uring_free(ring);
+    return -1;
+  }
+
+  /* SQ and CQ rings share one mapping */
+  size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+  size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  ring->ring_size = sq_size > cq_size ? sq_size : cq_size;
+  ring->ring = mmap(NULL, ring->ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+      ring->fd, IORING_OFF_SQ_RING);
+  if (ring->ring == MAP_FAILED) {
+    ring->ring = NULL;
+    uring_free(ring);
+    return -1;
+  }
+  ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+  ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+      ring->fd, IORING_OFF_SQES);
+  if (ring->sqes == MAP_FAILED) {
+    ring->sqes = NULL;
+    uring_free(ring);
+    return -1;
+  }
+
+  char *base = ring->ring;
+  ring->sq_head = (unsigned int *) (base + params.sq_off.head);
+  ring->sq_tail = (unsigned int *) (base + params.sq_off.tail);
+  ring->sq_mask = *(unsigned int *) (base + params.sq_off.ring_mask);
+  ring->sq_entries = params.sq_entries;
+  ring->sq_pending = *ring->sq_tail;
+  ring->cq_head = (unsigned int *) (base + params.cq_off.head);
+  ring->cq_tail = (unsigned int *) (base + params.cq_off.tail);
+  ring->cq_mask = *(unsigned int *) (base + params.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe *) (base + params.cq_off.cqes);
+
+  /* Submission slot I is always SQE I */
+  unsigned int *array = (unsigned int *) (base + params.sq_off.array);
+  for (unsigned int i = 0; i < params.sq_entries; i++) {
+    array[i] = i;
+  }
+
+  if (uring_probe(ring) < 0) {
+    int saved = errno;
+    uring_free(ring);
+    errno = saved;
+    return -1;
+  }
+  return 0;
+}
+
+void uring_free(uring_t *ring) {
+  if (ring->buffers != NULL) {
+    munmap(ring->buffers, ring->buffer_count * sizeof(struct io_uring_buf));
+  }
+  free(ring->buffer_data);
+  if (ring->sqes != NULL) munmap(ring->sqes, ring->sqes_size);
+  if (ring->ring != NULL) munmap(ring->ring, ring->ring_size);
+  if (ring->fd >= 0) close(ring->fd);
+  memset(ring, 0, sizeof(uring_t));
+  ring->fd = -1;
+}
+
+int uring_buffers_init(uring_t *ring, unsigned short group, unsigned int count,
+    unsigned int size) {
+  /* The kernel wants the ring page aligned */
+  ring->buffers = mmap(NULL, count * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE,
+      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (ring->buffers == MAP_FAILED) {
+    ring->buffers = NULL;
+    return -1;
+  }
+  ring->buffer_count = count;
+  ring->buffer_size = size;
+  ring->buffer_data = malloc((size_t) count * size);
+  if (ring->buffer_data == NULL) {
+    return -1;
+  }
+
+  struct io_uring_buf_reg reg;
+  memset(&reg, 0, sizeof(reg));
+  reg.ring_addr = (unsigned long) ring->buffers;
+  reg.ring_entries = count;
+  reg.bgid = group;
+  if (uring_register(ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+    return -1;
+  }
+
+  for (unsigned int i = 0; i < count; i++) {
+    uring_buffer_recycle(ring, i);
+  }
+  return 0;
+}
+
+char *uring_buffer(uring_t *ring, unsigned int buffer_id) {
+  return ring->buffer_data + (size_t) buffer_id * ring->buffer_size;
+}
+
+void uring_buffer_recycle(uring_t *ring, unsigned int buffer_id) {
+  struct io_uring_buf *buffer =
+      &ring->buffers->bufs[ring->buffer_tail & (ring->buffer_count - 1)];
+  buffer->addr = (unsigned long) uring_buffer(ring, buffer_id);
+  buffer->len = ring->buffer_size;
+  buffer->bid = buffer_id;
+  ring->buffer_tail++;
+  __atomic_store_n(&ring->buffers->tail, ring->buffer_tail, __ATOMIC_RELEASE);
+}
+
+/* Hand the queued submissions to the kernel, without waiting */
+static int uring_submit(uring_t *ring) {
+  __atomic_store_n(ring->sq_tail, ring->sq_pending, __ATOMIC_RELEASE);
+  unsigned int submit = ring->sq_pending - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+  int status;
+  do {
+    status = uring_enter(ring->fd, submit, 0, 0, NULL, 0);
+  } while (status < 0 && errno == EINTR);
+  return status;
+}
+
+struct io_uring_sqe *uring_get_sqe(uring_t *ring) {
+  while (ring->sq_pending - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE)
+      >= ring->sq_entries) {
+    if (uring_submit(ring) < 0) {
+      return NULL;
+    }
+  }
+  struct io_uring_sqe *sqe = &ring->sqes[ring->sq_pending & ring->sq_mask];
+  memset(sqe, 0, sizeof(struct io_uring_sqe));
+  ring->sq_pending++;
+  return sqe;
+}
+
+int uring_submit_and_wait(uring_t *ring, int timeout) {
+  __atomic_store_n(ring->sq_tail, ring->sq_pending, __ATOMIC_RELEASE);
+  unsigned int submit = ring->sq_pending - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+
+  struct __kernel_timespec ts;
+  struct io_uring_getevents_arg arg;
+  memset(&arg, 0, sizeof(arg));
+  arg.sigmask_sz = _NSIG / 8;
+  if (timeout >= 0) {
+    ts.tv_sec = timeout / 1000;
+    ts.tv_nsec = (timeout % 1000) * 1000000LL;
+    arg.ts = (unsigned long) &ts;
+  }
+
+  int status = uring_enter(ring->fd, submit, 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG,
+      &arg, sizeof(arg));
+  return status < 0 ? -1 : 0;
+}
+
+struct io_uring_cqe *uring_peek_cqe(uring_t *ring) {
+  unsigned int head = *ring->cq_head;
+  if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+    return NULL;
+  }
+  return &ring->cqes[head & ring->cq_mask];
+}
+
+void uring_cqe_seen(uring_t *ring) {
+  __atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,66 @@
+#ifndef __URING__
+#define __URING__
+
+#include <linux/io_uring.h>
+#include <stddef.h>
+
+/* URING is a minimal io_uring ring on the raw system calls, liburing isn't
+ * needed: submissions are queued in the shared SQ ring and handed to the
+ * kernel in one io_uring_enter() together with the wait for completions.
+ * A ring may also own a provided buffer ring, buffers the kernel picks from
+ * for multishot receives. Not thread safe, one ring per thread. */
+
+typedef struct uring {
+  int fd;
+  unsigned int features;
+
+  unsigned int *sq_head;
+  unsigned int *sq_tail;
+  unsigned int sq_mask;
+  unsigned int sq_entries;
+  unsigned int sq_pending;     // Our tail, ahead of *sq_tail until submitted.
+  struct io_uring_sqe *sqes;
+
+  unsigned int *cq_head;
+  unsigned int *cq_tail;
+  unsigned int cq_mask;
+  struct io_uring_cqe *cqes;
+
+  void *ring;
+  size_t ring_size;
+  size_t sqes_size;
+
+  struct io_uring_buf_ring *buffers;   // NULL without provided buffers.
+  char *buffer_data;
+  unsigned int buffer_count;
+  unsigned int buffer_size;
+  unsigned short buffer_tail;
+} uring_t;
+
+/* Sets up RING with ENTRIES submissions. Returns -1 with errno set if
+ * io_uring is missing, disabled or too old for what the loops rely on. */
+int uring_init(uring_t *ring, unsigned int entries);
+void uring_free(uring_t *ring);
+
+/* Registers COUNT buffers of SIZE bytes as buffer group GROUP, COUNT a
+ * power of two. */
+int uring_buffers_init(uring_t *ring, unsigned short group, unsigned int count,
+    unsigned int size);
+
+/* Data of the buffer BUFFER_ID, and giving it back to the kernel. */
+char *uring_buffer(uring_t *ring, unsigned int buffer_id);
+void uring_buffer_recycle(uring_t *ring, unsigned int buffer_id);
+
+/* A cleared submission to fill in, submitting the queued ones first if the
+ * ring is full. */
+struct io_uring_sqe *uring_get_sqe(uring_t *ring);
+
+/* Submits what's queued and waits up to TIMEOUT ms (-1 forever) for a
+ * completion. Returns -1 with errno set, ETIME if none came in time. */
+int uring_submit_and_wait(uring_t *ring, int timeout);
+
+/* The next completion, NULL if none. uring_cqe_seen() frees its slot. */
+struct io_uring_cqe *uring_peek_cqe(uring_t *ring);
+void uring_cqe_seen(uring_t *ring);
+
+#endif
@@ -0,0 +1,495 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <poll.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "affinity.h"
+#include "listener.h"
+#include "metrics.h"
+#include "uringloop.h"
+
+/* What a completion is for, in the low bits of its user_data: the rest is
+ * the connection, none for the loop's accept */
+#define URING_OP_ACCEPT 0
+#define URING_OP_RECV 1
+#define URING_OP_SEND 2
+#define URING_OP_POLL 3
+#define URING_OP_MASK 3
+
+static void *uring_loop_routine(void *uring_loop);
+
+static long long now_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+/* Close CONN at the read deadline of its request, or while idle at the
+ * keep-alive timeout */
+static void conn_read_deadline(uring_loop_t *loop, uring_conn_t *conn) {
+  long long deadline = http_conn_deadline(&conn->conn.in);
+  if (deadline < 0) {
+    timer_wheel_remove(&loop->deadlines, &conn->conn.deadline);
+  } else {
+    timer_wheel_add(&loop->deadlines, &conn->conn.deadline, (deadline + 999) / 1000);
+  }
+}
+
+/* Close CONN if the client takes none of its response for so long */
+static void conn_send_deadline(uring_loop_t *loop, uring_conn_t *conn) {
+  timer_wheel_add(&loop->deadlines, &conn->conn.deadline, now_ms() + HTTP_SEND_TIMEOUT);
+}
+
+/* A submission for OP on CONN, counted in flight until it completes */
+static struct io_uring_sqe *conn_sqe(uring_loop_t *loop, uring_conn_t *conn, int op) {
+  struct io_uring_sqe *sqe = uring_get_sqe(&loop->ring);
+  if (sqe == NULL) {
+    return NULL;
+  }
+  sqe->fd = conn->conn.in.fd;
+  sqe->user_data = (uintptr_t) conn | op;
+  conn->inflight++;
+  return sqe;
+}
+
+static void uring_loop_accept(uring_loop_t *loop) {
+  struct io_uring_sqe *sqe = uring_get_sqe(&loop->ring);
+  if (sqe == NULL) {
+    perror("Can't submit accept");
+    return;
+  }
+  sqe->opcode = IORING_OP_ACCEPT;
+  sqe->fd = loop->server_socket;
+  sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+  sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+  sqe->user_data = URING_OP_ACCEPT;
+}
+
+/* Receive into one of the loop's provided buffers, no more than the request
+ * buffer has room for: the receive is only armed while reading, so data
+ * waits in the socket while a response goes out, as with epoll */
+static int conn_receive(uring_loop_t *loop, uring_conn_t *conn) {
+  struct http_conn *in = &conn->conn.in;
+  size_t room = LIBHTTP_REQUEST_MAX_SIZE - (in->size - in->start);
+  if (conn->receiving) {
+    return 0;
+  }
+  if (room == 0) {
+    /* The request doesn't fit */
+    errno = ENOBUFS;
+    return -1;
+  }
+
+  struct io_uring_sqe *sqe = conn_sqe(loop, conn, URING_OP_RECV);
+  if (sqe == NULL) {
+    return -1;
+  }
+  sqe->opcode = IORING_OP_RECV;
+  sqe->len = room < URING_LOOP_BUFFER_SIZE ? room : URING_LOOP_BUFFER_SIZE;
+  sqe->flags = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = URING_LOOP_BUFFER_GROUP;
+  conn->receiving = 1;
+  return 0;
+}
+
+/* Send SIZE bytes of DATA, the completion says how many the socket took */
+static int conn_send(uring_loop_t *loop, uring_conn_t *conn, char *data, size_t size,
+    int more) {
+  struct io_uring_sqe *sqe = conn_sqe(loop, conn, URING_OP_SEND);
+  if (sqe == NULL) {
+    return -1;
+  }
+  sqe->opcode = IORING_OP_SEND;
+  sqe->addr = (uintptr_t) data;
+  sqe->len = size;
+  sqe->msg_flags = MSG_NOSIGNAL | (more ? MSG_MORE : 0);
+  return 0;
+}
+
+/* Wake up when the socket has room for more of the file body */
+static int conn_poll_writable(uring_loop_t *loop, uring_conn_t *conn) {
+  struct io_uring_sqe *sqe = conn_sqe(loop, conn, URING_OP_POLL);
+  if (sqe == NULL) {
+    return -1;
+  }
+  sqe->opcode = IORING_OP_POLL_ADD;
+  sqe->poll32_events = POLLOUT;
+  return 0;
+}
+
+/* Send as much of the file body as the socket takes, straight from the page
+ * cache. Returns 1 once it's all sent, 0 if the socket is full. */
+static int conn_send_file(uring_loop_t *loop, uring_conn_t *conn) {
+  struct http_buffer *out = &conn->conn.out;
+  int progress = 0;
+  while (out->file_size > 0) {
+    ssize_t nsent = sendfile(conn->conn.in.fd, out->file_fd, &out->file_offset,
+        out->file_size);
+    if (nsent < 0) {
+      if (errno == EINTR) continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+      return -1;
+    }
+    if (nsent == 0) {
+      /* File shrank under us, the response can't be completed */
+      return -1;
+    }
+    out->file_size -= nsent;
+    progress = 1;
+  }
+  if (progress) conn_send_deadline(loop, conn);
+  return out->file_size == 0;
+}
+
+static void conn_free(uring_loop_t *loop, uring_conn_t *conn) {
+  int fd = conn->conn.in.fd;
+  if (loop->limit != NULL) conn_limit_release(loop->limit, fd);
+  close(fd);
+  http_conn_free(&conn->conn.in);
+  http_buffer_free(&conn->conn.out);
+  free(conn);
+  metrics_count(METRIC_CLOSED, 1);
+}
+
+/* Stop serving CONN. Shutting the socket down completes its receive, send
+ * or poll in flight; the connection is freed with the last completion. */
+static void conn_close(uring_loop_t *loop, uring_conn_t *conn) {
+  if (conn->conn.state == CONN_CLOSING) return;
+  conn->conn.state = CONN_CLOSING;
+  timer_wheel_remove(&loop->deadlines, &conn->conn.deadline);
+  if (conn->inflight > 0) {
+    shutdown(conn->conn.in.fd, SHUT_RDWR);
+  } else {
+    conn_free(loop, conn);
+  }
+}
+
+static void conn_read(uring_loop_t *loop, uring_conn_t *conn);
+
+/* Send whatever of the response is left: the buffered part through the
+ * ring, then the file body, then a streamed body's chunks. Once it's all
+ * sent, go on with the next request. */
+static void conn_write(uring_loop_t *loop, uring_conn_t *conn) {
+  struct http_buffer *out = &conn->conn.out;
+  for (;;) {
+    int more = out->file_size > 0 || out->stream != NULL ? MSG_MORE : 0;
+
+    /* A large buffered response is tried with send() right away: the ring
+     * copying it in the batch was measured slower than the syscall */
+    if (conn->conn.out_sent == 0 && out->size > URING_LOOP_INLINE_SEND) {
+      ssize_t nsent = send(conn->conn.in.fd, out->data, out->size,
+          MSG_DONTWAIT | MSG_NOSIGNAL | more);
+      if (nsent < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+        conn_close(loop, conn);
+        return;
+      }
+      if (nsent > 0) conn->conn.out_sent = nsent;
+    }
+
+    if (conn->conn.out_sent < out->size) {
+      /* Hold the headers back if a body follows them, a chunk if another
+       * one does */
+      if (conn_send(loop, conn, out->data + conn->conn.out_sent,
+          out->size - conn->conn.out_sent, more) < 0) {
+        conn_close(loop, conn);
+      }
+      return;
+    }
+
+    int status = conn_send_file(loop, conn);
+    if (status < 0 || (status == 0 && conn_poll_writable(loop, conn) < 0)) {
+      conn_close(loop, conn);
+      return;
+    }
+    if (status == 0) {
+      return;
+    }
+
+    /* A streamed body goes a chunk at a time, the next once the last is out */
+    if (out->stream == NULL) {
+      break;
+    }
+    if (http_buffer_next_chunk(out) < 0) {
+      conn_close(loop, conn);
+      return;
+    }
+    conn->conn.out_sent = 0;
+  }
+
+  http_buffer_free(out);
+  metrics_record(METRIC_SEND, metrics_now_us() - conn->conn.write_start);
+  if (conn->conn.keep_alive) {
+    conn->conn.state = CONN_READING;
+    conn_read(loop, conn);
+  } else {
+    conn_close(loop, conn);
+  }
+}
+
+/* Run the request handler with the connection's output buffer attached */
+static void conn_handle_request(uring_loop_t *loop, uring_conn_t *conn,
+    struct http_request *request) {
+  http_buffer_attach(&conn->conn.out);
+  http_set_keep_alive(request->keep_alive);
+  loop->request_handler(conn->conn.in.fd, request);
+  http_flush(conn->conn.in.fd);
+  http_set_keep_alive(0);
+  http_buffer_detach();
+  /* Only now, the handler may end the connection */
+  conn->conn.keep_alive = request->keep_alive;
+
+  conn->conn.out_sent = 0;
+  conn->conn.write_start = metrics_now_us();
+  conn->conn.state = CONN_WRITING;
+  conn_send_deadline(loop, conn);
+  conn_write(loop, conn);
+}
+
+/* Answer the next buffered request if one is complete, or receive more */
+static void conn_read(uring_loop_t *loop, uring_conn_t *conn) {
+  struct http_request *request;
+  int status = http_conn_parse(&conn->conn.in, &request);
+  if (status > 0) {
+    metrics_record(METRIC_PARSE, metrics_now_us() - conn->conn.in.arrived);
+    conn_handle_request(loop, conn, request);
+  } else if (status < 0 || conn_receive(loop, conn) < 0) {
+    conn_close(loop, conn);
+  } else {
+    conn_read_deadline(loop, conn);
+  }
+}
+
+/* Turn a socket over the connection limits away */
+static void uring_loop_refuse(int fd) {
+  struct http_response response;
+  http_response_init(&response, fd, 503);
+  http_response_header(&response, "Content-Length", "0");
+  http_response_send(&response);
+  close(fd);
+  metrics_count(METRIC_REFUSED, 1);
+}
+
+/* A connection came in, the multishot accept carries no address: ask for it
+ * only if the limits are per address */
+static void uring_loop_on_accept(uring_loop_t *loop, int fd) {
+  if (loop->limit != NULL) {
+    struct sockaddr_storage address;
+    socklen_t address_size = sizeof(address);
+    int known = loop->limit->max_per_address > 0
+        && getpeername(fd, (struct sockaddr *) &address, &address_size) == 0;
+    if (conn_limit_acquire(loop->limit, fd, known ? (struct sockaddr *) &address : NULL) < 0) {
+      uring_loop_refuse(fd);
+      return;
+    }
+  }
+
+  uring_conn_t *conn = calloc(1, sizeof(uring_conn_t));
+  if (conn == NULL) {
+    perror("Can't allocate connection");
+    if (loop->limit != NULL) conn_limit_release(loop->limit, fd);
+    close(fd);
+    return;
+  }
+  conn->conn.state = CONN_READING;
+  conn->conn.deadline.data = conn;
+  http_conn_init(&conn->conn.in, fd);
+  http_buffer_init(&conn->conn.out);
+  metrics_count(METRIC_OPENED, 1);
+  affinity_account(fd);
+
+  if (conn_receive(loop, conn) < 0) {
+    perror("Can't submit receive");
+    conn_close(loop, conn);
+    return;
+  }
+  conn_read_deadline(loop, conn);
+}
+
+/* Buffer what came in and answer it. Pipelined requests wait in the buffer,
+ * and the rest in the socket, until the response before them is out. */
+static void conn_on_recv(uring_loop_t *loop, uring_conn_t *conn, struct io_uring_cqe *cqe) {
+  conn->receiving = 0;
+  if (cqe->flags & IORING_CQE_F_BUFFER) {
+    unsigned int buffer_id = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+    int status = 0;
+    if (cqe->res > 0) {
+      status = http_conn_append(&conn->conn.in, uring_buffer(&loop->ring, buffer_id), cqe->res);
+    }
+    uring_buffer_recycle(&loop->ring, buffer_id);
+    if (status < 0) {
+      conn_close(loop, conn);
+      return;
+    }
+  }
+
+  if (cqe->res == 0 || (cqe->res < 0 && cqe->res != -ENOBUFS)) {
+    conn_close(loop, conn);
+  } else if (cqe->res > 0) {
+    conn_read(loop, conn);
+  } else if (conn_receive(loop, conn) < 0) {
+    /* Out of buffers for a moment: receive again */
+    conn_close(loop, conn);
+  }
+}
+
+/* Some of the buffered response went out, on with the rest */
+static void conn_on_send(uring_loop_t *loop, uring_conn_t *conn, int res) {
+  if (res <= 0) {
+    conn_close(loop, conn);
+    return;
+  }
+  conn->conn.out_sent += res;
+  conn_send_deadline(loop, conn);
+  conn_write(loop, conn);
+}
+
+/* The socket has room for more of the file body */
+static void conn_on_poll(uring_loop_t *loop, uring_conn_t *conn, int res) {
+  if (res < 0 || (res & (POLLERR | POLLHUP))) {
+    conn_close(loop, conn);
+    return;
+  }
+  conn_write(loop, conn);
+}
+
+/* Hand a completion to its connection. The connection is only freed after
+ * the completion of its last submission, never in the middle of one. */
+static void uring_loop_complete(uring_loop_t *loop, struct io_uring_cqe *cqe) {
+  int op = cqe->user_data & URING_OP_MASK;
+  uring_conn_t *conn = (uring_conn_t *) (uintptr_t) (cqe->user_data & ~(uint64_t) URING_OP_MASK);
+
+  if (op == URING_OP_ACCEPT) {
+    if (cqe->res >= 0) {
+      uring_loop_on_accept(loop, cqe->res);
+    } else if (cqe->res != -EINTR && cqe->res != -EAGAIN) {
+      errno = -cqe->res;
+      perror("Error accepting socket");
+    }
+    if (!(cqe->flags & IORING_CQE_F_MORE)) {
+      uring_loop_accept(loop);
+    }
+    return;
+  }
+
+  if (conn->conn.state != CONN_CLOSING) {
+    if (op == URING_OP_RECV) {
+      conn_on_recv(loop, conn, cqe);
+    } else if (op == URING_OP_SEND) {
+      conn_on_send(loop, conn, cqe->res);
+    } else {
+      conn_on_poll(loop, conn, cqe->res);
+    }
+  } else if (op == URING_OP_RECV && (cqe->flags & IORING_CQE_F_BUFFER)) {
+    uring_buffer_recycle(&loop->ring, cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+  }
+
+  if (!(cqe->flags & IORING_CQE_F_MORE)) {
+    conn->inflight--;
+  }
+  if (conn->conn.state == CONN_CLOSING && conn->inflight == 0) {
+    conn_free(loop, conn);
+  }
+}
+
+static void conn_expire(timer_wheel_timer_t *deadline, void *uring_loop) {
+  metrics_count(METRIC_TIMEOUTS, 1);
+  conn_close((uring_loop_t *) uring_loop, (uring_conn_t *) deadline->data);
+}
+
+/* Close connections past their deadline, returns the wait timeout until
+ * the wheel has to be looked at again */
+static int uring_loop_expire(uring_loop_t *loop) {
+  long long now = now_ms();
+  timer_wheel_advance(&loop->deadlines, now, conn_expire, loop);
+  return timer_wheel_timeout(&loop->deadlines, now);
+}
+
+/* Start NUM_LOOPS io_uring loops on SERVER_SOCKETS and wait for them */
+int uring_loop_run(int *server_sockets, int num_sockets, int num_loops,
+    conn_limit_t *limit, void (*request_handler)(int, struct http_request *)) {
+
+  if (num_loops <= 0 || num_sockets <= 0) {
+    return -1;
+  }
+
+  /* Everything the loops need, tried once before committing to it */
+  uring_t probe;
+  if (uring_init(&probe, 8) < 0) {
+    return -1;
+  }
+  if (uring_buffers_init(&probe, URING_LOOP_BUFFER_GROUP, 8, 64) < 0) {
+    int saved = errno;
+    uring_free(&probe);
+    errno = saved;
+    return -1;
+  }
+  uring_free(&probe);
+
+  uring_loop_t *loops = calloc(num_loops, sizeof(uring_loop_t));
+  if (loops == NULL) {
+    perror("Init io_uring loops error");
+    exit(ENOMEM);
+  }
+
+  for (int i = 0; i < num_loops; i++) {
+    loops[i].server_socket = server_sockets[i % num_sockets];
+    loops[i].cpu = num_sockets > 1 || affinity_enabled() ? i : -1;
+    loops[i].request_handler = request_handler;
+    loops[i].limit = limit;
+    if (pthread_create(&loops[i].thread, NULL, uring_loop_routine, &loops[i]) != 0) {
+      perror("Error create io_uring loop thread");
+      exit(errno);
+    }
+  }
+
+  for (int i = 0; i < num_loops; i++) {
+    pthread_join(loops[i].thread, NULL);
+  }
+  free(loops);
+  return 0;
+}
+
+static void *uring_loop_routine(void *uring_loop) {
+  uring_loop_t *loop = (uring_loop_t *) uring_loop;
+
+  if (loop->cpu >= 0) {
+    listener_pin(loop->cpu);
+  }
+
+  /* The ring belongs to the thread submitting to it */
+  if (uring_init(&loop->ring, URING_LOOP_ENTRIES) < 0
+      || uring_buffers_init(&loop->ring, URING_LOOP_BUFFER_GROUP, URING_LOOP_BUFFERS,
+          URING_LOOP_BUFFER_SIZE) < 0) {
+    perror("Can't set up io_uring loop");
+    return NULL;
+  }
+  timer_wheel_init(&loop->deadlines, now_ms());
+  uring_loop_accept(loop);
+
+  for (;;) {
+    int timeout = uring_loop_expire(loop);
+    if (uring_submit_and_wait(&loop->ring, timeout) < 0
+        && errno != ETIME && errno != EINTR && errno != EBUSY) {
+      perror("io_uring_enter(): Error");
+      break;
+    }
+
+    /* Completions are copied out, handling one may queue submissions */
+    struct io_uring_cqe *cqe;
+    while ((cqe = uring_peek_cqe(&loop->ring)) != NULL) {
+      struct io_uring_cqe completion = *cqe;
+      uring_cqe_seen(&loop->ring);
+      uring_loop_complete(loop, &completion);
+    }
+  }
+
+  uring_free(&loop->ring);
+  return NULL;
+}
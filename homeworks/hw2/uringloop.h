@@ -0,0 +1,52 @@
+#ifndef __URINGLOOP__
+#define __URINGLOOP__
+
+#include <pthread.h>
+
+#include "connlimit.h"
+#include "eventloop.h"
+#include "libhttp.h"
+#include "timerwheel.h"
+#include "uring.h"
+
+/* URINGLOOP serves connections like EVENTLOOP, with the same connection
+ * state, deadlines and request handler, but does the I/O through one
+ * io_uring per thread instead of waiting for readiness: one multishot
+ * accept per loop, a receive into the loop's provided buffers while a
+ * connection waits for a request, and sends of the buffered response, all
+ * submitted together with the wait for completions (a large response tries
+ * a plain send() first). A file body goes out with sendfile() as far as the socket
+ * takes it, the ring polls for room for the rest: a splice through the
+ * ring would run on a kernel worker thread. Opening and stat'ing files
+ * stays with the handler's fd cache, which already keeps them off the hot
+ * path. */
+
+#define URING_LOOP_ENTRIES 1024
+#define URING_LOOP_BUFFERS 512            // Provided receive buffers per loop.
+#define URING_LOOP_BUFFER_SIZE 4096
+#define URING_LOOP_BUFFER_GROUP 0
+#define URING_LOOP_INLINE_SEND 16384       // Larger responses try send() first.
+
+typedef struct uring_conn {
+  conn_t conn;
+  int inflight;              // Submissions not completed, freed at 0 once closing.
+  int receiving;             // A receive is in flight.
+} uring_conn_t;
+
+typedef struct uring_loop {
+  uring_t ring;
+  int server_socket;
+  int cpu;                   // Pinned to it if not -1.
+  pthread_t thread;
+  timer_wheel_t deadlines;
+  conn_limit_t *limit;       // NULL if connections aren't limited.
+  void (*request_handler)(int, struct http_request *);
+} uring_loop_t;
+
+/* Runs NUM_LOOPS io_uring loops on SERVER_SOCKETS, like event_loop_run().
+ * Returns -1 right away, before serving anything, if io_uring can't be used
+ * on this kernel: the caller falls back to event_loop_run(). */
+int uring_loop_run(int *server_sockets, int num_sockets, int num_loops,
+    conn_limit_t *limit, void (*request_handler)(int, struct http_request *));
+
+#endif
@@ -1,38 +1,272 @@
+#include <errno.h>
+#include <limits.h>
+#include <sched.h>
+#include <linux/futex.h>
 #include <stdlib.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
 #include "wq.h"
-#include "utlist.h"
+
+/* Tries to take a socket before parking, a push is usually close behind */
+#define WQ_SPIN 64
+
+static inline void wq_relax(void) {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_ia32_pause();
+#endif
+}
+
+static void wq_futex(unsigned int *word, int op, unsigned int value,
+    const struct timespec *timeout) {
+  syscall(SYS_futex, word, op | FUTEX_PRIVATE_FLAG, value, timeout, NULL, 0);
+}
+
+static long long wq_now_us(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
 
 /* Initializes a work queue WQ. */
-void wq_init(wq_t *wq) {
+int wq_init(wq_t *wq, int capacity) {
+  unsigned long size = 2;
+  while (size < (unsigned long) capacity) size *= 2;
+
+  wq->cells = malloc(size * sizeof(wq_cell_t));
+  if (wq->cells == NULL) {
+    return -1;
+  }
+  for (unsigned long i = 0; i < size; i++) {
+    wq->cells[i].sequence = i;
+  }
+  wq->mask = size - 1;
+  wq->enqueue_pos = 0;
+  wq->dequeue_pos = 0;
+  wq->count = 0;
+  wq->wakeups = 0;
+  wq->closed = 0;
+  return 0;
+}
 
-  /* FIXME: Do we need thread-safe here? */
+static int wq_ring_push(wq_t *wq, task_t *task) {
+  unsigned long pos = __atomic_load_n(&wq->enqueue_pos, __ATOMIC_RELAXED);
+  wq_cell_t *cell;
 
-  wq->size = 0;
-  wq->head = NULL;
+  for (;;) {
+    cell = &wq->cells[pos & wq->mask];
+    unsigned long sequence = __atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE);
+    long diff = (long) (sequence - pos);
+    if (diff == 0) {
+      /* The cell is free for this lap, claim the position */
+      if (__atomic_compare_exchange_n(&wq->enqueue_pos, &pos, pos + 1, 1,
+          __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        break;
+      }
+    } else if (diff < 0) {
+      /* Still holds an item from the previous lap */
+      return -1;
+    } else {
+      pos = __atomic_load_n(&wq->enqueue_pos, __ATOMIC_RELAXED);
+    }
+  }
+
+  cell->task = *task;
+  __atomic_store_n(&cell->enqueued, wq_now_us(), __ATOMIC_RELAXED);
+  __atomic_store_n(&cell->sequence, pos + 1, __ATOMIC_RELEASE);
+  return 0;
 }
 
-/* Remove an item from the WQ. This function should block until there
- * is at least one item on the queue. */
-int wq_pop(wq_t *wq) {
+static int wq_ring_pop(wq_t *wq, task_t *task) {
+  unsigned long pos = __atomic_load_n(&wq->dequeue_pos, __ATOMIC_RELAXED);
+  wq_cell_t *cell;
+
+  for (;;) {
+    cell = &wq->cells[pos & wq->mask];
+    unsigned long sequence = __atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE);
+    long diff = (long) (sequence - (pos + 1));
+    if (diff == 0) {
+      if (__atomic_compare_exchange_n(&wq->dequeue_pos, &pos, pos + 1, 1,
+          __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        break;
+      }
+    } else if (diff < 0) {
+      return -1;
+    } else {
+      pos = __atomic_load_n(&wq->dequeue_pos, __ATOMIC_RELAXED);
+    }
+  }
+
+  *task = cell->task;
+  /* Hand the cell to the producer of the next lap */
+  __atomic_store_n(&cell->sequence, pos + wq->mask + 1, __ATOMIC_RELEASE);
+  return 0;
+}
+
+/* Take one unit of COUNT if there is one */
+static int wq_try_acquire(wq_t *wq) {
+  int count = __atomic_load_n(&wq->count, __ATOMIC_RELAXED);
+  while (count > 0) {
+    if (__atomic_compare_exchange_n(&wq->count, &count, count - 1, 1,
+        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+      return 0;
+    }
+  }
+  return -1;
+}
+
+/* Take one unit of COUNT, parking until a push (or wq_close()) hands one
+ * over. Returns -1 if the queue is closed, or -2 if nothing came in
+ * TIMEOUT_MS (negative to wait for ever). */
+static int wq_acquire(wq_t *wq, int timeout_ms) {
+  long long deadline = timeout_ms >= 0 ? wq_now_us() + timeout_ms * 1000LL : 0;
+
+  for (int i = 0; i < WQ_SPIN; i++) {
+    if (wq_try_acquire(wq) == 0) return 0;
+    if (__atomic_load_n(&wq->closed, __ATOMIC_ACQUIRE)) return -1;
+    wq_relax();
+  }
+
+  if (__atomic_fetch_sub(&wq->count, 1, __ATOMIC_SEQ_CST) > 0) {
+    return 0;
+  }
 
-  /* FIXME: Do we need thread-safe here? */
+  /* We're now owed a wakeup by the next push */
+  for (;;) {
+    unsigned int wakeups = __atomic_load_n(&wq->wakeups, __ATOMIC_ACQUIRE);
+    if (wakeups > 0) {
+      if (__atomic_compare_exchange_n(&wq->wakeups, &wakeups, wakeups - 1, 0,
+          __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+        return 0;
+      }
+      continue;
+    }
+    if (__atomic_load_n(&wq->closed, __ATOMIC_SEQ_CST)) return -1;
+    if (timeout_ms < 0) {
+      wq_futex(&wq->wakeups, FUTEX_WAIT, 0, NULL);
+      continue;
+    }
 
-  wq_item_t *wq_item = wq->head;
-  int client_socket_fd = wq->head->client_socket_fd;
-  wq->size--;
-  DL_DELETE(wq->head, wq->head);
+    long long remaining = deadline - wq_now_us();
+    if (remaining > 0) {
+      struct timespec timeout = { remaining / 1000000, remaining % 1000000 * 1000 };
+      wq_futex(&wq->wakeups, FUTEX_WAIT, 0, &timeout);
+      continue;
+    }
 
-  free(wq_item);
-  return client_socket_fd;
+    /* Timed out: withdraw from COUNT, unless a push has already paid us */
+    int count = __atomic_load_n(&wq->count, __ATOMIC_SEQ_CST);
+    while (count < 0) {
+      if (__atomic_compare_exchange_n(&wq->count, &count, count + 1, 0,
+          __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+        return -2;
+      }
+    }
+    /* Its wakeup is on the way */
+    timeout_ms = -1;
+  }
 }
 
-/* Add ITEM to WQ. */
-void wq_push(wq_t *wq, int client_socket_fd) {
+/* Add TASK to WQ, waking a parked consumer if there is one. */
+int wq_push_task(wq_t *wq, task_t *task) {
+  if (wq_ring_push(wq, task) != 0) {
+    return -1;
+  }
+  if (__atomic_fetch_add(&wq->count, 1, __ATOMIC_SEQ_CST) < 0) {
+    __atomic_add_fetch(&wq->wakeups, 1, __ATOMIC_RELEASE);
+    wq_futex(&wq->wakeups, FUTEX_WAKE, 1, NULL);
+  }
+  return 0;
+}
+
+/* The unit taken guarantees a task, though the push that made it may
+ * land after an earlier one still being written. Units handed out by
+ * wq_close() come without one. */
+static int wq_take(wq_t *wq, task_t *task) {
+  for (int i = 0; wq_ring_pop(wq, task) != 0; i++) {
+    if (__atomic_load_n(&wq->closed, __ATOMIC_ACQUIRE)) {
+      return wq_ring_pop(wq, task);
+    }
+    /* The producer may have been preempted mid-push, let it run */
+    if (i < WQ_SPIN) {
+      wq_relax();
+    } else {
+      sched_yield();
+    }
+  }
+  return 0;
+}
+
+/* Remove a task from the WQ. This function blocks until there is at least
+ * one on the queue, or returns -1 once the queue is closed and drained. */
+int wq_pop_task(wq_t *wq, task_t *task) {
+  return wq_pop_task_timeout(wq, task, -1);
+}
+
+int wq_pop_task_timeout(wq_t *wq, task_t *task, int timeout_ms) {
+  int status = wq_acquire(wq, timeout_ms);
+  if (status == -2) {
+    errno = ETIMEDOUT;
+    return -1;
+  }
+  if (status != 0) {
+    /* Closed, but drain what is left */
+    return wq_try_pop_task(wq, task);
+  }
+  return wq_take(wq, task);
+}
+
+int wq_try_pop_task(wq_t *wq, task_t *task) {
+  if (wq_try_acquire(wq) != 0) {
+    return -1;
+  }
+  return wq_take(wq, task);
+}
+
+/* Add CLIENT_SOCKET_FD to WQ. */
+int wq_push(wq_t *wq, int client_socket_fd) {
+  task_t task = { NULL, NULL, client_socket_fd };
+  return wq_push_task(wq, &task);
+}
+
+/* Remove an item from the WQ. This function blocks until there is at least
+ * one item on the queue, or the queue is closed. */
+int wq_pop(wq_t *wq) {
+  task_t task;
+  return wq_pop_task(wq, &task) == 0 ? task.client_socket_fd : -1;
+}
+
+int wq_try_pop(wq_t *wq) {
+  task_t task;
+  return wq_try_pop_task(wq, &task) == 0 ? task.client_socket_fd : -1;
+}
+
+long long wq_oldest_wait(wq_t *wq) {
+  unsigned long pos = __atomic_load_n(&wq->dequeue_pos, __ATOMIC_RELAXED);
+  wq_cell_t *cell = &wq->cells[pos & wq->mask];
+  if (__atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE) != pos + 1) {
+    return 0;
+  }
+  long long wait = wq_now_us() - __atomic_load_n(&cell->enqueued, __ATOMIC_RELAXED);
+  return wait > 0 ? wait : 0;
+}
+
+int wq_size(wq_t *wq) {
+  int count = __atomic_load_n(&wq->count, __ATOMIC_RELAXED);
+  return count > 0 ? count : 0;
+}
 
-  /* FIXME: Do we need thread-safe here? */
+void wq_close(wq_t *wq) {
+  __atomic_store_n(&wq->closed, 1, __ATOMIC_SEQ_CST);
 
-  wq_item_t *wq_item = calloc(1, sizeof(wq_item_t));
-  wq_item->client_socket_fd = client_socket_fd;
-  DL_APPEND(wq->head, wq_item);
-  wq->size++;
+  /* Settle the debt to every parked consumer at once */
+  int count = __atomic_load_n(&wq->count, __ATOMIC_SEQ_CST);
+  while (count < 0 && !__atomic_compare_exchange_n(&wq->count, &count, 0, 0,
+      __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+  }
+  if (count < 0) {
+    __atomic_add_fetch(&wq->wakeups, -count, __ATOMIC_RELEASE);
+  }
+  wq_futex(&wq->wakeups, FUTEX_WAKE, INT_MAX, NULL);
 }
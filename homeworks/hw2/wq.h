@@ -1,25 +1,74 @@
 #ifndef __WQ__
 #define __WQ__
 
-#include <pthread.h>
-
 /* WQ defines a work queue which will be used to store accepted client sockets
- * waiting to be served. */
+ * waiting to be served.
+ *
+ * It is a bounded multi-producer multi-consumer ring (Dmitry Vyukov's design):
+ * every cell carries a sequence number telling whether it is ready to be
+ * written or read at a given position, so producers and consumers only race
+ * on a compare-and-swap of their own index and never allocate.
+ *
+ * Idle consumers park on a futex. COUNT works like a semaphore: it is the
+ * number of queued tasks, or minus the number of parked consumers, so a
+ * push only makes a system call when it has to hand its task to one. */
+
+#define WQ_CACHE_LINE 64
+
+/* A unit of work for a pool thread: FUNCTION(ARG), or serving the client
+ * socket CLIENT_SOCKET_FD when FUNCTION is NULL. */
+typedef struct task {
+  void (*function)(void *);
+  void *arg;
+  int client_socket_fd;
+  long long accepted;   // CLOCK_MONOTONIC microseconds, for sockets.
+} task_t;
 
-typedef struct wq_item {
-  int client_socket_fd; // Client socket to be served.
-  struct wq_item *next;
-  struct wq_item *prev;
-} wq_item_t;
+typedef struct wq_cell {
+  unsigned long sequence;
+  long long enqueued;   // CLOCK_MONOTONIC microseconds.
+  task_t task;
+} wq_cell_t;
 
 typedef struct wq {
-  int size;
-  wq_item_t *head;
-  /* TODO: More stuff here, maybe? */
+  wq_cell_t *cells;
+  unsigned long mask;   // Capacity - 1, the capacity is a power of two.
+  unsigned long enqueue_pos __attribute__((aligned(WQ_CACHE_LINE)));
+  unsigned long dequeue_pos __attribute__((aligned(WQ_CACHE_LINE)));
+  int count __attribute__((aligned(WQ_CACHE_LINE)));
+  unsigned int wakeups; // Futex word, handed to parked consumers by pushes.
+  int closed;
 } wq_t;
 
-void wq_init(wq_t *wq);
-void wq_push(wq_t *wq, int client_socket_fd);
+/* Initializes WQ with room for at least CAPACITY sockets. */
+int wq_init(wq_t *wq, int capacity);
+
+/* Returns -1 if WQ is full. */
+int wq_push(wq_t *wq, int client_socket_fd);
+
+/* Blocks until there is a socket to return, or returns -1 once WQ is closed
+ * and drained. */
 int wq_pop(wq_t *wq);
 
+/* Returns -1 instead of blocking if WQ is empty. */
+int wq_try_pop(wq_t *wq);
+
+/* The same for any task, they return 0 or -1 and pop into TASK. */
+int wq_push_task(wq_t *wq, task_t *task);
+int wq_pop_task(wq_t *wq, task_t *task);
+int wq_try_pop_task(wq_t *wq, task_t *task);
+
+/* Like wq_pop_task(), but gives up with errno set to ETIMEDOUT when nothing
+ * comes in TIMEOUT_MS. */
+int wq_pop_task_timeout(wq_t *wq, task_t *task, int timeout_ms);
+
+/* Microseconds the oldest queued task has been waiting, 0 if none. */
+long long wq_oldest_wait(wq_t *wq);
+
+/* Approximate number of queued tasks. */
+int wq_size(wq_t *wq);
+
+/* Wakes every parked consumer, pops fail once the queue is empty. */
+void wq_close(wq_t *wq);
+
 #endif
@@ -1,104 +1,229 @@
 /*
  * mm_alloc.c
  *
- * Stub implementations of the mm_* routines.
+ * Segregated free lists: a free block sits on the list of its size class and
+ * a bitmap tells which lists are non-empty. Small requests pop the head of
+ * their exact class, or split the first block of the next non-empty one, so
+ * malloc and free are O(1) for them; large ones first fit within their class.
  */
 
 #include "mm_alloc.h"
+#include <stdint.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
 
-mm_block* first_heap_block = NULL;
+#define MM_MAX_SIZE ((size_t) INTPTR_MAX / 2)
 
-/* new_mm_block create new block for memory allocation */
-mm_block* new_mm_block(mm_block* prev, size_t s) {
-    mm_block* new_block = sbrk(sizeof(mm_block) + s);
-    new_block->size = s;
-    new_block->free = 0;
-    new_block->prev = prev;
-    new_block->next = NULL;
-    new_block->curr  = (void*) ((address_t) new_block + (address_t) sizeof(mm_block));
-    return new_block;
-}
+static mm_block* free_lists[MM_CLASSES];
+static uint64_t nonempty;   // Bit c is set if free_lists[c] has a block.
 
-void *mm_malloc(size_t size) {
-    if (size == 0) return NULL;
+static mm_block* first_heap_block = NULL;
+static mm_block* last_heap_block = NULL;
 
-    /* First heap block */
-    if (first_heap_block == NULL) {
-        first_heap_block = sbrk(0);
-        return new_mm_block(NULL, size)->curr;
-    }
+static inline void *block_data(mm_block* block) {
+    return block + 1;
+}
 
-    mm_block* curr_block = first_heap_block;
+static inline mm_block* data_block(void *ptr) {
+    return (mm_block*) ptr - 1;
+}
 
-    while (curr_block){
-        if (curr_block->free && size <= curr_block->size) {
+static inline address_t block_end(mm_block* block) {
+    return (address_t) block_data(block) + block->size;
+}
 
-            /* Split block if current block's size is too large */
-            size_t size_need = sizeof(mm_block) + size;
-            if (size_need < curr_block-> size) {
-                mm_block* new_block = (mm_block *) ((address_t) curr_block + size + sizeof(mm_block));
+/* Blocks are only merged when nothing else took the memory in between */
+static inline int adjacent(mm_block* block, mm_block* next) {
+    return next != NULL && block_end(block) == (address_t) next;
+}
 
-                new_block->size = curr_block->size - size - sizeof(mm_block);
-                new_block->prev = curr_block;
-                new_block->next = curr_block->next;
-                new_block->free = 1;
-                new_block->curr = (void*) ((address_t) new_block + (address_t) sizeof(mm_block));
+static inline size_t align_size(size_t size) {
+    return (size + MM_ALIGN - 1) & ~(size_t) (MM_ALIGN - 1);
+}
 
-                curr_block->next = new_block;
-            }
+static inline int size_class(size_t size) {
+    if (size <= MM_SMALL_MAX)
+        return size / MM_ALIGN - 1;
+    int c = MM_SMALL_CLASSES + (63 - __builtin_clzll(size - 1)) - MM_SMALL_SHIFT;
+    return c < MM_CLASSES ? c : MM_CLASSES - 1;
+}
 
-            curr_block->free = 0;
-            curr_block->size = size;
+static void free_list_push(mm_block* block) {
+    int c = size_class(block->size);
+    block->free = 1;
+    block->prev_free = NULL;
+    block->next_free = free_lists[c];
+    if (free_lists[c])
+        free_lists[c]->prev_free = block;
+    free_lists[c] = block;
+    nonempty |= 1ULL << c;
+}
 
-            return curr_block->curr;
-        }
+static void free_list_remove(mm_block* block) {
+    int c = size_class(block->size);
+    block->free = 0;
+    if (block->prev_free)
+        block->prev_free->next_free = block->next_free;
+    else
+        free_lists[c] = block->next_free;
+    if (block->next_free)
+        block->next_free->prev_free = block->prev_free;
+    if (free_lists[c] == NULL)
+        nonempty &= ~(1ULL << c);
+}
 
-        if (curr_block->next == NULL)
-            break;
+/* Merges NEXT, which must be adjacent and off the free lists, into BLOCK */
+static void absorb(mm_block* block, mm_block* next) {
+    block->size += sizeof(mm_block) + next->size;
+    block->next = next->next;
+    if (next->next)
+        next->next->prev = block;
+    else
+        last_heap_block = block;
+}
 
-        curr_block = curr_block->next;
-    };
+/* Frees BLOCK, merged with its free neighbours, onto the lists */
+static void release(mm_block* block) {
+    if (adjacent(block, block->next) && block->next->free) {
+        free_list_remove(block->next);
+        absorb(block, block->next);
+    }
+    if (block->prev && block->prev->free && adjacent(block->prev, block)) {
+        free_list_remove(block->prev);
+        block = block->prev;
+        absorb(block, block->next);
+    }
+    free_list_push(block);
+}
 
-    /* If old blocks isn't suffice, create new one */
-    curr_block->next = new_mm_block(curr_block->next, size);
-    return curr_block->next->curr;
+/* Cuts BLOCK, in use, down to SIZE if what's left can hold another block */
+static void split(mm_block* block, size_t size) {
+    if (block->size < size + sizeof(mm_block) + MM_ALIGN)
+        return;
+
+    mm_block* rest = (mm_block*) ((address_t) block_data(block) + size);
+    rest->size = block->size - size - sizeof(mm_block);
+    rest->prev = block;
+    rest->next = block->next;
+    if (block->next)
+        block->next->prev = rest;
+    else
+        last_heap_block = rest;
+    block->next = rest;
+    block->size = size;
+    release(rest);
 }
 
-void *mm_realloc(void *ptr, size_t size) {
-    mm_block* old_block = (mm_block*) ((address_t) ptr - sizeof(mm_block));
-    old_block->free = 1;
+/* Takes a free block of at least SIZE off the lists, NULL if there's none */
+static mm_block* find_free(size_t size) {
+    int c = size_class(size);
+    if (c < MM_SMALL_CLASSES) {
+        if (free_lists[c]) {
+            mm_block* block = free_lists[c];
+            free_list_remove(block);
+            return block;
+        }
+    } else {
+        for (mm_block* block = free_lists[c]; block; block = block->next_free) {
+            if (block->size >= size) {
+                free_list_remove(block);
+                return block;
+            }
+        }
+    }
+
+    /* Any block of a bigger class fits */
+    uint64_t bigger = c + 1 < MM_CLASSES ? nonempty & (~0ULL << (c + 1)) : 0;
+    if (bigger == 0)
+        return NULL;
+    mm_block* block = free_lists[__builtin_ctzll(bigger)];
+    free_list_remove(block);
+    return block;
+}
 
-    mm_block* new_block = mm_malloc(size);
-    memmove(new_block, ptr, size);
+/* Grows the last block, if free and at the break, or sbrk()s a new one */
+static mm_block* new_mm_block(size_t size) {
+    void *brk = sbrk(0);
+    if (brk == (void*) -1)
+        return NULL;
+
+    mm_block* last = last_heap_block;
+    if (last && last->free && block_end(last) == (address_t) brk) {
+        if (sbrk(size - last->size) == (void*) -1)
+            return NULL;
+        free_list_remove(last);
+        last->size = size;
+        return last;
+    }
 
-    return new_block->curr;
+    /* Something else may have moved the break off our alignment */
+    size_t pad = -(address_t) brk & (MM_ALIGN - 1);
+    if (sbrk(pad + sizeof(mm_block) + size) == (void*) -1)
+        return NULL;
+
+    mm_block* block = (mm_block*) ((address_t) brk + pad);
+    block->size = size;
+    block->free = 0;
+    block->prev = last;
+    block->next = NULL;
+    if (last)
+        last->next = block;
+    else
+        first_heap_block = block;
+    last_heap_block = block;
+    return block;
 }
 
-void mm_free(void *ptr) {
-    mm_block* curr_block = first_heap_block;
+void *mm_malloc(size_t size) {
+    if (size == 0 || size > MM_MAX_SIZE) return NULL;
+    size = align_size(size);
 
-    while (curr_block) {
-        if (curr_block->curr == ptr) {
-            curr_block->free = 1;
+    mm_block* block = find_free(size);
+    if (block)
+        split(block, size);
+    else if ((block = new_mm_block(size)) == NULL)
+        return NULL;
 
-            /* coalesce blocks */
-            if (curr_block->prev != NULL && curr_block->prev->free) {
-                curr_block->prev->next = curr_block->next;
-                curr_block->prev->size = curr_block->prev->size + sizeof(mm_block) + curr_block->size;
-            }
-            if (curr_block->next != NULL && curr_block->next->free) {
-                curr_block->next = curr_block->next->next;
-                curr_block->size = curr_block->size + sizeof(mm_block) + curr_block->next->size;
-            }
-            break;
-        }
+    memset(block_data(block), 0, block->size);
+    return block_data(block);
+}
 
-        if (curr_block->next == NULL)
-            break;
+void *mm_realloc(void *ptr, size_t size) {
+    if (ptr == NULL) return mm_malloc(size);
+    if (size == 0) {
+        mm_free(ptr);
+        return NULL;
+    }
+    if (size > MM_MAX_SIZE) return NULL;
+
+    mm_block* block = data_block(ptr);
+    size_t old_size = block->size;
+    size_t new_size = align_size(size);
+
+    /* Grow in place into a free neighbour */
+    if (new_size > old_size && adjacent(block, block->next) && block->next->free
+            && old_size + sizeof(mm_block) + block->next->size >= new_size) {
+        free_list_remove(block->next);
+        absorb(block, block->next);
+        memset((char*) ptr + old_size, 0, block->size - old_size);
+    }
 
-        curr_block = curr_block->next;
+    if (new_size <= block->size) {
+        split(block, new_size);
+        /* Whatever is left past SIZE reads as zeroes if it grows again */
+        memset((char*) ptr + size, 0, block->size - size);
+        return ptr;
     }
+
+    void *new_ptr = mm_malloc(size);
+    if (new_ptr == NULL) return NULL;
+    memcpy(new_ptr, ptr, old_size);
+    mm_free(ptr);
+    return new_ptr;
+}
+
+void mm_free(void *ptr) {
+    if (ptr == NULL) return;
+    release(data_block(ptr));
 }
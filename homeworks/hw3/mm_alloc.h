@@ -10,15 +10,28 @@
 
 typedef long unsigned int address_t;
 
+/* Payloads are aligned to, and sized in multiples of, MM_ALIGN. Sizes up to
+ * MM_SMALL_MAX each have an exact class; above it, a class holds the sizes
+ * up to the next power of two, and the last class everything bigger. */
+#define MM_ALIGN 16
+#define MM_SMALL_MAX 512
+#define MM_SMALL_SHIFT 9   // log2(MM_SMALL_MAX)
+#define MM_SMALL_CLASSES (MM_SMALL_MAX / MM_ALIGN)
+#define MM_CLASSES 64
+
 /* Struct for a block of memory set by srbk(), mm_malloc() & mm_realloc() should
  * not create new blocks if not necessary because srbk() is quite expensive.
+ * Blocks are chained by address through next & prev; free ones are also on
+ * the free list of their size class. The payload follows the header, so the
+ * block of a pointer is found right before it.
  */
 typedef struct mm_b {
   size_t size;
   int free;
   struct mm_b* next;
   struct mm_b* prev;
-  void* curr;
+  struct mm_b* next_free;
+  struct mm_b* prev_free;
 } mm_block;
 
 void *mm_malloc(size_t size);
@@ -0,0 +1,318 @@
+/*
+ * mm_bench.c
+ *
+ * Replays allocation traces against hw3lib.so and reports ops/sec and
+ * fragmentation: how much of the heap grown by the allocator was not live at
+ * the peak. Without arguments it runs a set of generated traces, otherwise
+ * the trace files given, one operation per line:
+ *
+ *   a <id> <size>   id = mm_malloc(size)
+ *   r <id> <size>   id = mm_realloc(id, size)
+ *   f <id>          mm_free(id)
+ *
+ * Each trace runs in its own process, so it starts from an empty heap.
+ */
+
+#include <dlfcn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Function pointers to hw3 functions */
+void* (*mm_malloc)(size_t);
+void* (*mm_realloc)(void*, size_t);
+void (*mm_free)(void*);
+
+typedef struct op {
+    char type;
+    int id;
+    size_t size;
+} op_t;
+
+typedef struct trace {
+    const char *name;
+    op_t *ops;
+    int count;
+    int capacity;
+    int ids;
+} trace_t;
+
+void load_alloc_functions() {
+    void *handle = dlopen("hw3lib.so", RTLD_NOW);
+    if (!handle) {
+        fprintf(stderr, "%s\n", dlerror());
+        exit(1);
+    }
+
+    char* error;
+    mm_malloc = dlsym(handle, "mm_malloc");
+    if ((error = dlerror()) != NULL)  {
+        fprintf(stderr, "%s\n", error);
+        exit(1);
+    }
+
+    mm_realloc = dlsym(handle, "mm_realloc");
+    if ((error = dlerror()) != NULL)  {
+        fprintf(stderr, "%s\n", error);
+        exit(1);
+    }
+
+    mm_free = dlsym(handle, "mm_free");
+    if ((error = dlerror()) != NULL)  {
+        fprintf(stderr, "%s\n", error);
+        exit(1);
+    }
+}
+
+void trace_add(trace_t *trace, char type, int id, size_t size) {
+    if (trace->count == trace->capacity) {
+        trace->capacity = trace->capacity ? trace->capacity * 2 : 1024;
+        trace->ops = realloc(trace->ops, trace->capacity * sizeof(op_t));
+        if (trace->ops == NULL) {
+            perror("Can't grow trace");
+            exit(1);
+        }
+    }
+    trace->ops[trace->count++] = (op_t) {type, id, size};
+    if (id >= trace->ids)
+        trace->ids = id + 1;
+}
+
+/* xorshift, so every run replays the same traces */
+static unsigned long long rng_state = 88172645463325252ULL;
+
+size_t rng(size_t bound) {
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return rng_state % bound;
+}
+
+/* Sizes spread evenly over powers of two from MIN up to MAX */
+size_t rng_size(size_t min, size_t max) {
+    int bits = 0;
+    while ((min << (bits + 1)) <= max)
+        bits++;
+    size_t low = min << rng(bits + 1);
+    return low + rng(low < max ? low : 1);
+}
+
+/* Keeps about SLOTS blocks of SIZE(MIN, MAX) live, replacing one at random
+ * on every step, then frees them all. */
+void generate_churn(trace_t *trace, int steps, int slots, size_t min, size_t max,
+        size_t (*size)(size_t, size_t)) {
+    char *live = calloc(slots, 1);
+    for (int i = 0; i < steps; i++) {
+        int id = rng(slots);
+        if (live[id])
+            trace_add(trace, 'f', id, 0);
+        else
+            trace_add(trace, 'a', id, size(min, max));
+        live[id] = !live[id];
+    }
+    for (int id = 0; id < slots; id++) {
+        if (live[id])
+            trace_add(trace, 'f', id, 0);
+    }
+    free(live);
+}
+
+size_t uniform_size(size_t min, size_t max) {
+    return min + rng(max - min + 1);
+}
+
+/* Buffers growing by half at a time, as a string builder would */
+void generate_realloc(trace_t *trace, int rounds, int slots) {
+    size_t *sizes = calloc(slots, sizeof(size_t));
+    for (int i = 0; i < rounds; i++) {
+        int id = rng(slots);
+        if (sizes[id] == 0) {
+            sizes[id] = 16 + rng(48);
+            trace_add(trace, 'a', id, sizes[id]);
+        } else if (sizes[id] > 65536) {
+            trace_add(trace, 'f', id, 0);
+            sizes[id] = 0;
+        } else {
+            sizes[id] += sizes[id] / 2;
+            trace_add(trace, 'r', id, sizes[id]);
+        }
+    }
+    for (int id = 0; id < slots; id++) {
+        if (sizes[id])
+            trace_add(trace, 'f', id, 0);
+    }
+    free(sizes);
+}
+
+/* Fills the heap, frees every other block, then asks for bigger ones */
+void generate_phases(trace_t *trace, int blocks) {
+    for (int id = 0; id < blocks; id++)
+        trace_add(trace, 'a', id, uniform_size(16, 128));
+    for (int id = 0; id < blocks; id += 2)
+        trace_add(trace, 'f', id, 0);
+    for (int id = blocks; id < blocks + blocks / 4; id++)
+        trace_add(trace, 'a', id, uniform_size(128, 512));
+    for (int id = 0; id < blocks + blocks / 4; id++) {
+        if (id >= blocks || id % 2)
+            trace_add(trace, 'f', id, 0);
+    }
+}
+
+int read_trace(trace_t *trace, const char *path) {
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        perror(path);
+        return -1;
+    }
+    char type;
+    int id;
+    size_t size;
+    char line[256];
+    int line_number = 0;
+    while (fgets(line, sizeof(line), file) != NULL) {
+        line_number++;
+        if (line[0] == '#' || line[0] == '\n')
+            continue;
+        size = 0;
+        int fields = sscanf(line, " %c %d %zu", &type, &id, &size);
+        if (fields < 2 || id < 0 || !((type == 'a' && fields == 3)
+                || (type == 'r' && fields == 3) || type == 'f')) {
+            fprintf(stderr, "%s:%d: malformed operation\n", path, line_number);
+            fclose(file);
+            return -1;
+        }
+        trace_add(trace, type, id, size);
+    }
+    fclose(file);
+    trace->name = path;
+    return 0;
+}
+
+double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Marks the first and last byte of a block with its id, to catch blocks
+ * handed out twice */
+static inline void tag(char *block, int id, size_t size) {
+    block[0] = id;
+    block[size - 1] = id;
+}
+
+static inline int tagged(char *block, int id, size_t size) {
+    return block[0] == (char) id && block[size - 1] == (char) id;
+}
+
+/* Replays TRACE, then prints its results. Nothing else may allocate from the
+ * heap meanwhile, or it'd count as the allocator's. */
+int replay(trace_t *trace) {
+    char **blocks = calloc(trace->ids, sizeof(char*));
+    size_t *sizes = calloc(trace->ids, sizeof(size_t));
+    if (blocks == NULL || sizes == NULL) {
+        perror("Can't allocate blocks");
+        return 1;
+    }
+
+    size_t live = 0;
+    size_t peak = 0;
+    char *start = sbrk(0);
+    double begin = now();
+    for (int i = 0; i < trace->count; i++) {
+        op_t *op = &trace->ops[i];
+        switch (op->type) {
+        case 'a':
+        case 'r':
+            if (op->type == 'a' || blocks[op->id] == NULL) {
+                blocks[op->id] = mm_malloc(op->size);
+            } else if (!tagged(blocks[op->id], op->id, sizes[op->id])) {
+                fprintf(stderr, "%s: block %d overwritten\n", trace->name, op->id);
+                return 1;
+            } else {
+                live -= sizes[op->id];
+                blocks[op->id] = mm_realloc(blocks[op->id], op->size);
+            }
+            if (blocks[op->id] == NULL) {
+                fprintf(stderr, "%s: out of memory at operation %d\n", trace->name, i);
+                return 1;
+            }
+            sizes[op->id] = op->size;
+            tag(blocks[op->id], op->id, op->size);
+            live += op->size;
+            if (live > peak)
+                peak = live;
+            break;
+        case 'f':
+            if (blocks[op->id] && !tagged(blocks[op->id], op->id, sizes[op->id])) {
+                fprintf(stderr, "%s: block %d overwritten\n", trace->name, op->id);
+                return 1;
+            }
+            mm_free(blocks[op->id]);
+            blocks[op->id] = NULL;
+            live -= sizes[op->id];
+            sizes[op->id] = 0;
+            break;
+        }
+    }
+    double elapsed = now() - begin;
+    size_t heap = (char*) sbrk(0) - start;
+
+    printf("%-24s %10d %14.0f %12zu %12zu %8.1f%%\n", trace->name, trace->count,
+        trace->count / elapsed, peak, heap, heap ? 100.0 * (heap - peak) / heap : 0);
+    return 0;
+}
+
+int run(trace_t *trace) {
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == -1) {
+        perror("Failed to fork");
+        return -1;
+    }
+    if (pid == 0) {
+        exit(replay(trace));
+    }
+    int status;
+    waitpid(pid, &status, 0);
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        fprintf(stderr, "%s: failed\n", trace->name);
+        return -1;
+    }
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    load_alloc_functions();
+
+    printf("%-24s %10s %14s %12s %12s %9s\n", "trace", "ops", "ops/sec",
+        "peak live", "heap", "frag");
+
+    int failed = 0;
+    if (argc > 1) {
+        for (int i = 1; i < argc; i++) {
+            trace_t trace = {0};
+            failed |= read_trace(&trace, argv[i]) < 0 || run(&trace) < 0;
+            free(trace.ops);
+        }
+        return failed;
+    }
+
+    trace_t traces[5] = {
+        {"small churn"}, {"small/large churn"}, {"large churn"}, {"realloc growth"},
+        {"free every other"},
+    };
+    generate_churn(&traces[0], 1000000, 10000, 1, 256, uniform_size);
+    generate_churn(&traces[1], 500000, 5000, 8, 16384, rng_size);
+    generate_churn(&traces[2], 100000, 1000, 1024, 262144, rng_size);
+    generate_realloc(&traces[3], 200000, 1000);
+    generate_phases(&traces[4], 200000);
+    for (int i = 0; i < 5; i++) {
+        failed |= run(&traces[i]) < 0;
+        free(traces[i].ops);
+    }
+    return failed;
+}